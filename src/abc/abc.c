@@ -207,7 +207,7 @@ static int receive_until (struct timeval * t, char ** message,
 #endif /* DEBUG_PRINT */
     msize = receive_pipe_message_any (timeout_ms, message, from_fd, priority);
     if (msize > 0 && al > 0 && !iface->accept_sender_cb (sap)) {
-      free (*message);
+      release_pipe_message (*message);
       return 0;
     }
   }
@@ -643,7 +643,7 @@ printf ("%d-byte message from %d (ad is %d)\n", msize, from_fd, rpipe);
         check_priority_mode ();
       }
 else { printf ("invalid message from %d (ad is %d)\n", from_fd, rpipe); }
-      free (message);
+      release_pipe_message (message);
     } else {
       usleep (10 * 1000); /* 10ms */
     }
@@ -667,7 +667,7 @@ static void unmanaged_handle_until (struct timeval * t, int rpipe, int wpipe)
           unmanaged_handle_network_message (message, msize, wpipe);
         }
       }
-      free (message);
+      release_pipe_message (message);
     } else {
       usleep (10 * 1000); /* 10ms */
     }
@@ -698,7 +698,7 @@ static void handle_until (struct timeval * t, struct timeval * quiet_end,
         handle_network_message (message, msize, wpipe, &beacon_deadline,
                                 &time_buffer, quiet_end,
                                 &send_type, &send_size, send_message, 0);
-      free (message);
+      release_pipe_message (message);
       /* forward any pending messages */
       if (send_type != ABC_SEND_TYPE_NONE) {
         handle_quiet (quiet_end, rpipe, wpipe);
@@ -1,6 +1,8 @@
 /* acache.c: cache all data messages and respond to requests */
 /* only one thread, listening on a pipe from ad, and responding
  * acache takes two arguments, the fd of a pipe from AD and of a pipe to AD
+ * if ~/.allnet/acache/shards is more than 1, acache starts that many
+ * processes, each caching the messages whose IDs fall in its shard
  */
 
 #include <stdio.h>
@@ -13,6 +15,9 @@
 #include <inttypes.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
 
 #include "lib/packet.h"
 #include "lib/mgmt.h"
@@ -23,6 +28,28 @@
 #include "lib/log.h"
 #include "lib/config.h"
 #include "lib/sha.h"
+#include "iblt.h"
+
+/* each shard is a separate process that caches the messages and saves the
+ * acks whose IDs fall in the shard, in its own directory: ~/.allnet/acache
+ * for shard 0, and ~/.allnet/acache/shardN for the others.  Every shard
+ * receives every message from ad, so each data request is answered by
+ * all the shards, each from its own cache, and only the owner of an ID
+ * requests it or asks others for it.  The configuration files (sizes,
+ * durability, shards) are only in ~/.allnet/acache, and the sizes are
+ * divided among the shards */
+#define MAX_SHARDS	16
+static int num_shards = 1;
+static int shard = 0;
+static char * acache_dir = "acache";
+
+static int in_shard (const char * id)
+{
+  if (num_shards <= 1)
+    return 1;
+  /* the summary cells (iblt.c) are chosen by the first 12 bytes */
+  return ((readb32 (id + MESSAGE_ID_SIZE - 4) % num_shards) == shard);
+}
 
 struct ack_entry {
   char message_id  [MESSAGE_ID_SIZE];
@@ -34,8 +61,8 @@ static int ack_space = 0;
 static int last_ack = 0;
 
 /* for now, a fixed-size entry, later, allocate dynamically according to size */
-/* or, may just delete -- only needed for list_next_matching, used to loop
- * over all the messages, but we could loop over the hash table instead */
+/* or, may just delete -- the messages are found through the hash table
+ * and the index, so nothing needs to loop over this list */
 #ifdef SMALL_FIXED_SIZE
 #define LIST_SIZE	16
 #endif /* SMALL_FIXED_SIZE */
@@ -50,14 +77,17 @@ static int message_list_used = 0;
 
 struct hash_entry {
   struct hash_entry * next_by_hash;   /* this one also used for fre list */
-  struct hash_entry * next_by_source;
   unsigned char id [MESSAGE_ID_SIZE];
   unsigned char received_at [ALLNET_TIME_SIZE];
-  int file_position;
+  int64_t file_position;
   unsigned char src_nbits;           /* limited to not more than 16 */
   unsigned char dst_nbits;           /* limited to not more than 16 */
   unsigned char source [2];
   unsigned char destination [2];
+  struct hash_entry * newer;           /* ordered by received_at */
+  struct hash_entry * older;
+  struct hash_entry * next_in_index [2];   /* see index_add */
+  struct hash_entry * prev_in_index [2];
 };
 
 #ifdef SMALL_FIXED_SIZE
@@ -72,8 +102,6 @@ static struct hash_entry message_hash_pool [HASH_POOL_SIZE];
 static struct hash_entry * message_hash_free = NULL;
 /* hash table */
 static struct hash_entry * message_hash_table [HASH_SIZE];
-/* entries sorted by source address */
-static struct hash_entry * message_source_table [HASH_SIZE];
 
 #else /* SMALL_FIXED_SIZE */
 
@@ -85,8 +113,6 @@ static struct hash_entry * message_hash_pool;
 static struct hash_entry * message_hash_free = NULL;
 /* hash table */
 static struct hash_entry * * message_hash_table;
-/* entries sorted by source address */
-static struct hash_entry * * message_source_table;
 #endif /* SMALL_FIXED_SIZE */
 
 static off_t fd_size (int fd)
@@ -104,21 +130,13 @@ static off_t fd_size (int fd)
 
 static int read_at_pos (int fd, char * data, int max, off_t position)
 {
-  if (lseek (fd, position, SEEK_SET) != position) {
-    /* perror ("acache read_at_pos lseek"); */
-    snprintf (log_buf, LOG_SIZE,
-              "acache unable to lseek to position %d for %d/%d\n",
-              (int) position, max, (int) (fd_size (fd)));
-    log_error ("acache read_at_pos lseek");
-    return 0;
-  }
-  int r = read (fd, data, max);
+  int r = pread (fd, data, max, position);
   if (r < 0) {
-    /* perror ("acache read_at_pos read"); */
+    /* perror ("acache read_at_pos pread"); */
     snprintf (log_buf, LOG_SIZE,
               "acache unable to read data at %d: %d %d %d %d\n",
               (int) position, fd, r, max, (int) (fd_size (fd)));
-    log_error ("acache read_at_pos read");
+    log_error ("acache read_at_pos pread");
     r = 0;
   }
   return r;
@@ -126,21 +144,13 @@ static int read_at_pos (int fd, char * data, int max, off_t position)
 
 static void write_at_pos (int fd, char * data, int dsize, off_t position)
 {
-  if (lseek (fd, position, SEEK_SET) != position) {
-    /* perror ("acache write_at_pos lseek"); */
-    snprintf (log_buf, LOG_SIZE,
-              "acache unable to lseek to pos %d for %d %d\n",
-              (int) position, dsize, (int) (fd_size (fd)));
-    log_error ("acache write_at_pos lseek");
-    return;
-  }
-  int w = write (fd, data, dsize);
+  int w = pwrite (fd, data, dsize, position);
   if (w != dsize) {
-    /* perror ("acache write_at_pos write"); */
+    /* perror ("acache write_at_pos pwrite"); */
     snprintf (log_buf, LOG_SIZE,
               "acache unable to save data at %d: %d %d %d\n",
               (int) position, w, dsize, (int) (fd_size (fd)));
-    log_error ("acache write_at_pos write");
+    log_error ("acache write_at_pos pwrite");
     return;
   }
 }
@@ -155,6 +165,67 @@ static void truncate_to_size (int fd, int max_size, char * caller)
   }
 }
 
+/* acks are kept in the acks array in the order received, and when the
+ * array is full, the oldest ack is replaced.  ack_index is an
+ * open-addressing hash table (linear probing) of indices into acks,
+ * used to find an ack without looking at every entry.
+ * The acks file holds a checkpoint of the acks array, and every ack
+ * received since the checkpoint is appended to the ack journal.  After
+ * ACK_JOURNAL_MAX acks, the array is saved again and the journal emptied */
+#define ACK_JOURNAL_MAX		1024
+static int * ack_index = NULL;   /* -1 for an empty slot */
+static int ack_index_size = 0;   /* a power of two */
+static int ack_journal_fd = -1;
+static int ack_journal_count = 0;
+
+static int ack_is_empty (int i)
+{
+  static char empty [MESSAGE_ID_SIZE];   /* all zeros */
+  return (memcmp (acks [i].message_id, empty, MESSAGE_ID_SIZE) == 0);
+}
+
+static int ack_hash (const char * ack)
+{
+  return (readb32 (ack) ^ readb32 (ack + 4)) & (ack_index_size - 1);
+}
+
+/* returns the slot in ack_index holding this ack, or the empty slot
+ * where it would be added */
+static int ack_slot (const char * ack)
+{
+  int slot = ack_hash (ack);
+  while ((ack_index [slot] >= 0) &&
+         (memcmp (acks [ack_index [slot]].message_ack, ack,
+                  MESSAGE_ID_SIZE) != 0))
+    slot = (slot + 1) & (ack_index_size - 1);
+  return slot;
+}
+
+/* remove acks [i] from ack_index, and clear it */
+static void ack_index_remove (int i)
+{
+  if (ack_is_empty (i))
+    return;
+  int slot = ack_slot (acks [i].message_ack);
+  if (ack_index [slot] == i) {
+    /* move back any later entries that would no longer be found */
+    ack_index [slot] = -1;
+    int next = (slot + 1) & (ack_index_size - 1);
+    while (ack_index [next] >= 0) {
+      int home = ack_hash (acks [ack_index [next]].message_ack);
+      /* can the entry at next move to the empty slot? */
+      if (((next > slot) && ((home <= slot) || (home > next))) ||
+          ((next < slot) && ((home <= slot) && (home > next)))) {
+        ack_index [slot] = ack_index [next];
+        ack_index [next] = -1;
+        slot = next;
+      }
+      next = (next + 1) & (ack_index_size - 1);
+    }
+  }
+  bzero (&(acks [i]), sizeof (struct ack_entry));
+}
+
 static void save_ack_data (int fd)
 {
   write_at_pos (fd, (char *) acks, sizeof (struct ack_entry) * ack_space, 0);
@@ -166,8 +237,39 @@ static void read_ack_data (int fd)
   read_at_pos (fd, (char *) acks, sizeof (struct ack_entry) * ack_space, 0);
 }
 
+/* save all the acks to the acks file, and empty the journal */
+static void ack_checkpoint (int ack_fd)
+{
+  save_ack_data (ack_fd);
+  if (ack_journal_fd >= 0) {
+    if (ftruncate (ack_journal_fd, 0) != 0)
+      perror ("acache ack journal ftruncate");
+    fsync (ack_journal_fd);
+  }
+  ack_journal_count = 0;
+}
+
+/* add the ack to the array and index, replacing the oldest.  Returns 0
+ * if the ack was already there, 1 if it was added */
+static int ack_insert (const char * ack, const char * id)
+{
+  int slot = ack_slot (ack);
+  if (ack_index [slot] >= 0)
+    return 0;
+  last_ack = (last_ack + 1) % ack_space;
+  ack_index_remove (last_ack);
+  memcpy (acks [last_ack].message_ack, ack, MESSAGE_ID_SIZE);
+  memcpy (acks [last_ack].message_id , id , MESSAGE_ID_SIZE);
+  ack_index [ack_slot (ack)] = last_ack;
+  /* clear the next location, to mark it in the file */
+  ack_index_remove ((last_ack + 1) % ack_space);
+  return 1;
+}
+
 static void init_acks (int fd, int max_acks)
 {
+  if (max_acks < 2)   /* need room for one ack and the empty marker */
+    max_acks = 2;
   int ack_size = sizeof (struct ack_entry);
   int max_size = ack_size * max_acks;
   /* if file is bigger than max_size, get rid of the last part */
@@ -179,41 +281,64 @@ static void init_acks (int fd, int max_acks)
   /* if file is smaller than max_size, the last part should be zeros */
   bzero (acks, max_size);
   read_ack_data (fd);
-  struct ack_entry empty;
-  bzero (&empty, sizeof (struct ack_entry));
-  read_ack_data (fd);
   int i;
   int limit = fsize / sizeof (struct ack_entry);
   for (i = 1; i < limit; i++) {
-    if (memcmp (acks [i].message_id, empty.message_id, MESSAGE_ID_SIZE) == 0) {
+    if (ack_is_empty (i)) {
       last_ack = i - 1;
       break;
     }
   }
-}
-
-static int ack_found (char * ack)
-{
-  int i;
+  /* at most half full, so probe sequences stay short */
+  ack_index_size = 1;
+  while (ack_index_size < 2 * ack_space)
+    ack_index_size *= 2;
+  ack_index = malloc_or_fail (ack_index_size * sizeof (int), "ack index");
+  for (i = 0; i < ack_index_size; i++)
+    ack_index [i] = -1;
   for (i = 0; i < ack_space; i++) {
-    if (memcmp (acks [i].message_ack, ack, MESSAGE_ID_SIZE) == 0) {
-      return 1;
+    if (! ack_is_empty (i)) {
+      int slot = ack_slot (acks [i].message_ack);
+      if (ack_index [slot] < 0)
+        ack_index [slot] = i;
+      else    /* duplicate, should not happen */
+        bzero (&(acks [i]), sizeof (struct ack_entry));
     }
   }
-  return 0;
+  /* add any acks saved after the checkpoint */
+  ack_journal_fd = open_rw_config (acache_dir, "ackjournal", 1);
+  if (ack_journal_fd >= 0) {
+    int journal_size = fd_size (ack_journal_fd);
+    int count = 0;
+    int pos;
+    for (pos = 0; pos + ack_size <= journal_size; pos += ack_size) {
+      struct ack_entry entry;
+      if (read_at_pos (ack_journal_fd, (char *) (&entry), ack_size, pos)
+          != ack_size)
+        break;
+      count += ack_insert (entry.message_ack, entry.message_id);
+    }
+    snprintf (log_buf, LOG_SIZE, "%d acks restored from the ack journal\n",
+              count);
+    log_print ();
+  }
+  ack_checkpoint (fd);
 }
 
 static void ack_add (char * ack, char * id, int ack_fd)
 {
-  if (ack_found (ack))
+  if (! ack_insert (ack, id))
     return;
-  last_ack = (last_ack + 1) % ack_space;
-  memcpy (acks [last_ack].message_ack, ack, MESSAGE_ID_SIZE);
-  memcpy (acks [last_ack].message_id , id , MESSAGE_ID_SIZE);
-  /* clear the next location, to mark it in the file */
-  int next_ack = (last_ack + 1) % ack_space;
-  bzero (&(acks [next_ack]), sizeof (struct ack_entry));
-  save_ack_data (ack_fd);
+  /* append to the journal, and occasionally save everything instead */
+  if ((ack_journal_fd < 0) || (ack_journal_count + 1 >= ACK_JOURNAL_MAX)) {
+    ack_checkpoint (ack_fd);
+    return;
+  }
+  write_at_pos (ack_journal_fd, (char *) (acks + last_ack),
+                sizeof (struct ack_entry),
+                ack_journal_count * sizeof (struct ack_entry));
+  fsync (ack_journal_fd);
+  ack_journal_count++;
 }
 
 /* storage of a message in the file: 12-byte header */
@@ -238,6 +363,248 @@ struct message_entry_do_not_use {
 
 #define MAX_MESSAGE_ENTRY_SIZE	(MESSAGE_ENTRY_HEADER_SIZE + ALLNET_MTU)
 
+/* the messages are kept in segment files, ~/.allnet/acache/segment.n,
+ * each of at most segment_size bytes.  A segment starts with its 8-byte
+ * sequence number, larger for newer segments, followed by message entries.
+ * New messages are appended to the newest (active) segment, and once it
+ * is full, a new segment is started.  gc compacts one segment at a time,
+ * so the time it takes depends on the segment size rather than the size
+ * of the cache.  The position of a message is n * segment_size plus its
+ * offset in segment n.  Each segment is mapped read-only, so messages can
+ * be parsed where they are, using pread if mmap fails */
+#define SEGMENT_HEADER_SIZE	8
+#define MIN_SEGMENT_SIZE	(64 * 1024)
+#define MAX_SEGMENT_SIZE	(16 * 1024 * 1024)
+
+struct segment {
+  int fd;               /* -1 if this segment is not in use */
+  uint64_t seq;
+  off_t size;           /* bytes in the file, including the header */
+  char * map;           /* segment_size bytes, or NULL if not mapped */
+  int unsynced;         /* written to the file but not fsync'd */
+  int indexed;          /* has an index file, see write_segment_index */
+};
+
+static struct segment * segments = NULL;
+static int num_segments = 0;
+static off_t segment_size = 0;
+static int active = -1;           /* the segment new messages go to */
+static uint64_t next_seq = 1;
+static int64_t cache_bytes = 0;   /* in all the segments, including staged */
+
+static int64_t segment_position (int n, off_t offset)
+{
+  return ((int64_t) n) * segment_size + offset;
+}
+
+/* new messages are first saved in a staging buffer, which is appended
+ * to the active segment with a single write.  How often that happens is
+ * set by the first line of ~/.allnet/acache/durability:
+ *   packet            -- write and fsync each message (the old behavior)
+ *   group [ms [n]]    -- write and fsync after ms milliseconds or n messages
+ *   os [ms [n]]       -- same, but never fsync, leaving it to the OS
+ * Until then, reads and writes of the staged messages use the buffer */
+#define ACACHE_SYNC_PACKET	0
+#define ACACHE_SYNC_GROUP	1
+#define ACACHE_SYNC_OS		2
+#define STAGING_SIZE		(10 * MAX_MESSAGE_ENTRY_SIZE)
+static int sync_mode = ACACHE_SYNC_GROUP;
+static int sync_ms = 100;
+static int sync_packets = 32;
+static char staging [STAGING_SIZE];
+static int64_t staging_start = 0;  /* position of staging [0] */
+static int staging_used = 0;       /* bytes in the staging buffer */
+static int staging_count = 0;      /* messages in the staging buffer */
+static unsigned long long int staging_deadline = 0; /* allnet_time_ms */
+
+/* bytes in segment n, including any staged messages */
+static off_t segment_used (int n)
+{
+  if (n == active)
+    return segments [n].size + staging_used;
+  return segments [n].size;
+}
+
+static struct hash_entry * hash_find (char * hash);
+static void remove_from_hash_table (char * id);
+#ifdef USING_MESSAGE_LIST
+static void list_remove_message (char * id);
+#endif /* USING_MESSAGE_LIST */
+
+/* returns the number of bytes in the staged messages that fit entirely
+ * in the first written bytes of the staging buffer.  The messages after
+ * that were not saved, and are removed from the hash table */
+static int staging_written (int written)
+{
+  int offset = 0;
+  while (offset + MESSAGE_ENTRY_HEADER_SIZE <= staging_used) {
+    char * entry = staging + offset;
+    int fsize = MESSAGE_ENTRY_HEADER_SIZE +
+                readb16 (entry + MESSAGE_ENTRY_HEADER_MSIZE_OFFSET);
+    if (offset + fsize > written)
+      break;
+    offset += fsize;
+  }
+  int kept = offset;
+  int dropped = 0;
+  while (offset + MESSAGE_ENTRY_HEADER_SIZE <= staging_used) {
+    char * entry = staging + offset;
+    int msize = readb16 (entry + MESSAGE_ENTRY_HEADER_MSIZE_OFFSET);
+    int id_off = readb16 (entry + MESSAGE_ENTRY_HEADER_IDOFF_OFFSET);
+    char * id = entry + MESSAGE_ENTRY_HEADER_SIZE + id_off;
+    struct hash_entry * h = NULL;
+    if ((id_off > 0) && (id_off + MESSAGE_ID_SIZE <= msize))
+      h = hash_find (id);   /* erased messages have id_off 0 */
+    if ((h != NULL) && (h->file_position == staging_start + offset)) {
+      remove_from_hash_table (id);
+#ifdef USING_MESSAGE_LIST
+      list_remove_message (id);
+#endif /* USING_MESSAGE_LIST */
+      dropped++;
+    }
+    offset += MESSAGE_ENTRY_HEADER_SIZE + msize;
+  }
+  if (dropped > 0) {
+    snprintf (log_buf, LOG_SIZE, "acache dropped %d unsaved messages\n",
+              dropped);
+    log_print ();
+  }
+  cache_bytes -= (staging_used - kept);
+  return kept;
+}
+
+/* write the staged messages to the active segment, and fsync any
+ * segments that have been written */
+static void flush_staging ()
+{
+  if (staging_used > 0) {
+    struct segment * s = segments + active;
+    int w = pwrite (s->fd, staging, staging_used, s->size);
+    int kept = staging_used;
+    if (w != staging_used) {
+      snprintf (log_buf, LOG_SIZE,
+                "acache unable to save %d staged bytes at %d/%d: %d\n",
+                staging_used, (int) (s->size), active, w);
+      log_error ("acache flush_staging pwrite");
+      /* the mapping only has valid data up to s->size, so only count
+       * the messages that were written completely */
+      kept = staging_written (w);
+      if ((w > kept) && (ftruncate (s->fd, s->size + kept) != 0))
+        perror ("acache flush_staging ftruncate");
+    }
+    s->size += kept;
+    s->unsynced = 1;
+  }
+  int i;
+  for (i = 0; i < num_segments; i++) {
+    if ((segments [i].unsynced) && (sync_mode != ACACHE_SYNC_OS))
+      fsync (segments [i].fd);
+    segments [i].unsynced = 0;
+  }
+  staging_used = 0;
+  staging_count = 0;
+  staging_deadline = 0;
+}
+
+/* returns a pointer to the data at position, and sets *available to the
+ * number of bytes there, at most max, and not past the end of the segment.
+ * The pointer is into the staging buffer, the segment's mapping, or (if
+ * the segment is not mapped) a static buffer, and is valid until the next
+ * call to msg_data_at or until the segment is next written */
+static char * msg_data_at (int64_t position, int max, int * available)
+{
+  *available = 0;
+  if ((staging_used > 0) && (position >= staging_start) &&
+      (position < staging_start + staging_used)) {
+    int offset = position - staging_start;
+    if (max > staging_used - offset)
+      max = staging_used - offset;
+    *available = max;
+    return staging + offset;
+  }
+  if ((position < 0) || (position >= segment_position (num_segments, 0)))
+    return NULL;
+  struct segment * s = segments + (position / segment_size);
+  off_t offset = position % segment_size;
+  if ((s->fd < 0) || (offset >= s->size))
+    return NULL;
+  if (max > s->size - offset)
+    max = s->size - offset;
+  if (s->map != NULL) {
+    *available = max;
+    return s->map + offset;
+  }
+  static char buffer [MAX_MESSAGE_ENTRY_SIZE];
+  if (max > (int) (sizeof (buffer)))
+    max = sizeof (buffer);
+  *available = read_at_pos (s->fd, buffer, max, offset);
+  return buffer;
+}
+
+/* returns 1 if msg_data_at returns a pointer into the staging buffer or
+ * a mapped segment, which stays valid until the next write or gc, and 0
+ * if it returns the buffer that is overwritten by the next call */
+static int msg_data_is_mapped (int64_t position)
+{
+  if ((staging_used > 0) && (position >= staging_start) &&
+      (position < staging_start + staging_used))
+    return 1;
+  if ((position < 0) || (position >= segment_position (num_segments, 0)))
+    return 0;
+  return (segments [position / segment_size].map != NULL);
+}
+
+/* write to the segment at position, or to the staging buffer */
+static void msg_write_at_pos (char * data, int dsize, int64_t position)
+{
+  if ((staging_used > 0) && (position >= staging_start) &&
+      (position + dsize <= staging_start + staging_used)) {
+    memcpy (staging + (position - staging_start), data, dsize);
+    return;
+  }
+  struct segment * s = segments + (position / segment_size);
+  write_at_pos (s->fd, data, dsize, position % segment_size);
+  if (sync_mode == ACACHE_SYNC_PACKET) {
+    fsync (s->fd);
+  } else if (sync_mode == ACACHE_SYNC_GROUP) {
+    s->unsynced = 1;   /* fsync with the next group */
+    if (staging_deadline == 0)
+      staging_deadline = allnet_time_ms () + sync_ms;
+  }
+}
+
+static void init_durability ()
+{
+  int fd = open_read_config ("acache", "durability", 0);
+  if (fd >= 0) {
+    char buffer [100];
+    int n = read (fd, buffer, sizeof (buffer) - 1);
+    close (fd);
+    if (n > 0) {
+      buffer [n] = '\0';
+      char mode [10] = "";
+      int ms = sync_ms;
+      int packets = sync_packets;
+      sscanf (buffer, "%9s %d %d", mode, &ms, &packets);
+      if (strcmp (mode, "packet") == 0)
+        sync_mode = ACACHE_SYNC_PACKET;
+      else if (strcmp (mode, "group") == 0)
+        sync_mode = ACACHE_SYNC_GROUP;
+      else if (strcmp (mode, "os") == 0)
+        sync_mode = ACACHE_SYNC_OS;
+      if (ms >= 0)
+        sync_ms = ms;
+      if (packets > 0)
+        sync_packets = packets;
+    }
+  }
+  snprintf (log_buf, LOG_SIZE, "acache durability %s, %dms, %d packets\n",
+            ((sync_mode == ACACHE_SYNC_PACKET) ? "packet" :
+             ((sync_mode == ACACHE_SYNC_GROUP) ? "group" : "os")),
+            sync_ms, sync_packets);
+  log_print ();
+}
+
 struct request_details {
   int src_nbits; /* limited to at most 16 */
   unsigned char source [ADDRESS_SIZE];
@@ -288,7 +655,7 @@ static void build_request_details (char * message, int msize,
     int sbits = 0;
     int sbytes = 0;
     if ((drp->dst_bits_power_two > 0) && (drp->dst_bits_power_two < 32)) {
-      dbits = 1 << (drp->dst_bits_power_two - 1);
+      dbits = 1 << drp->dst_bits_power_two;
       dbytes = (dbits + 7) / 8;
       if (hsize + drsize + dbytes <= msize) {
         result->dpower_two = drp->dst_bits_power_two;
@@ -297,7 +664,7 @@ static void build_request_details (char * message, int msize,
       }
     }
     if ((drp->src_bits_power_two > 0) && (drp->src_bits_power_two < 32)) {
-      sbits = 1 << (drp->src_bits_power_two - 1);
+      sbits = 1 << drp->src_bits_power_two;
       sbytes = (sbits + 7) / 8;
       if (hsize + drsize + dbytes + sbytes <= msize) {
         result->spower_two = drp->src_bits_power_two;
@@ -323,6 +690,8 @@ static uint64_t get_nbits (unsigned char * bits, int nbits)
 }
 
 /* returns 1 if the address is (or may be) in the bitmap, 0 otherwise */
+/* the first power_two bits of the address select a bit of the bitmap.  A
+ * shorter address matches if any of the bits it may select is set */
 static int match_bitmap (int power_two, int bitmap_bits, unsigned char * bitmap,
                          unsigned char * address, int abits)
 {
@@ -334,13 +703,13 @@ static int match_bitmap (int power_two, int bitmap_bits, unsigned char * bitmap,
   uint64_t end_index = start_index;
   if (abits > power_two) {
     start_index = (start_index >> (abits - power_two));
+    end_index = start_index;
   } else if (abits < power_two) {
     /* make end_index have all 1s in the last (power_two - abits) bits */
     end_index = ((start_index + 1) << (power_two - abits)) - 1;
     start_index = (start_index << (power_two - abits));
   }
-  if ((start_index > end_index) ||
-      (start_index > bitmap_bits) || (end_index > bitmap_bits)) {
+  if (end_index >= bitmap_bits) {
     snprintf (log_buf, LOG_SIZE,
               "match_bitmap error: index %" PRIu64 "-%" PRIu64 ", %d bits\n",
               start_index, end_index, bitmap_bits);
@@ -348,16 +717,10 @@ static int match_bitmap (int power_two, int bitmap_bits, unsigned char * bitmap,
     log_print ();
     return 1;
   }
-  while (start_index <= end_index) {
-    int byte = bitmap [start_index / 8] & 0xff;
-    int i;
-    for (i = start_index % 8;
-         (i < 8) && (i < (end_index - (start_index / 8) * 8)); i++)
-      if (((i == 7) && (( byte                   & 0x1) == 0x1)) ||
-          ((i <  7) && (((byte >> (8 - (i + 1))) & 0x1) == 0x1)))
-        return 1;
-    start_index = (start_index - (start_index % 8)) + 8;
-  }
+  uint64_t i;
+  for (i = start_index; i <= end_index; i++)
+    if (((bitmap [i / 8] >> (7 - (i % 8))) & 0x1) == 0x1)
+      return 1;
   return 0;  /* did not match any bit in the bitmap */
 }
 
@@ -416,43 +779,54 @@ static int hash_matches (struct request_details * req,
 }
 
 /* see get_next_message */
-static int next_prev_position (int next_position, int msize)
+static int64_t next_prev_position (int64_t next_position, int msize)
 {
   return next_position - (MESSAGE_ENTRY_HEADER_SIZE + msize);
 }
 
 /* note that the return value is the position of the NEXT message, if any.
- * the position of this message is given by next_prev_position */
-static int get_next_message (int fd, int max_size, int position,
-                             struct request_details *rd,
-                             char ** message, int * msize, int * id_off,
-                             int * priority, char * received_time)
+ * the position of this message is given by next_prev_position
+ * *message points into the segment as given by msg_data_at, so is
+ * read-only, and only valid until the segment is next read or written */
+static int64_t get_next_message (int64_t position, struct request_details *rd,
+                                 char ** message, int * msize, int * id_off,
+                                 int * priority, char * received_time)
 {
   if (position < 0)
     return -1;
-  while (position < max_size) {
-    static char buffer [MAX_MESSAGE_ENTRY_SIZE];
-    int rsize = MAX_MESSAGE_ENTRY_SIZE;
-    if (rsize > (max_size - position))
-      rsize = max_size - position;
-    int r = read_at_pos (fd, buffer, rsize, position);
-    if (r <= 0) { /* unable to read */
+  while (position < segment_position (num_segments, 0)) {
+    int n = position / segment_size;
+    off_t offset = position % segment_size;
+    if (offset < SEGMENT_HEADER_SIZE) {
+      position = segment_position (n, SEGMENT_HEADER_SIZE);
+      continue;
+    }
+    if ((segments [n].fd < 0) || (offset >= segment_used (n))) {
+      position = segment_position (n + 1, 0);   /* go on to the next one */
+      continue;
+    }
+    int r = 0;
+    char * buffer = msg_data_at (position, MAX_MESSAGE_ENTRY_SIZE, &r);
+    if (r < MESSAGE_ENTRY_HEADER_SIZE) { /* unable to read */
 #ifdef DEBUG_PRINT
       snprintf (log_buf, LOG_SIZE, "get_next_message r %d\n", r); log_print ();
 #endif /* DEBUG_PRINT */
-      return -1;
+      position = segment_position (n + 1, 0);   /* skip the rest */
+      continue;
     }
     int found_size = readb16 (buffer + MESSAGE_ENTRY_HEADER_MSIZE_OFFSET);
-    if ((found_size <= 0) || (found_size > ALLNET_MTU)) { /* unknown size */
+    if ((found_size <= 0) || (found_size > ALLNET_MTU) ||  /* unknown size */
+        (MESSAGE_ENTRY_HEADER_SIZE + found_size > r)) {     /* or truncated */
 #ifdef DEBUG_PRINT
       snprintf (log_buf, LOG_SIZE,
-                "get_next_message found %d at %d (%d/%zd)\n",
-                found_size, position, r, fd_size (fd));
+                "get_next_message found %d at %" PRId64 " (%d)\n",
+                found_size, position, r);
       log_print ();
       buffer_to_string (buffer, r, "data", 16, 0, log_buf, LOG_SIZE);
       log_print ();
 #endif /* DEBUG_PRINT */
-      return -1;
+      position = segment_position (n + 1, 0);   /* skip the rest */
+      continue;
     }
     position += (MESSAGE_ENTRY_HEADER_SIZE + found_size);
     int found_id_off = readb16 (buffer + MESSAGE_ENTRY_HEADER_IDOFF_OFFSET);
@@ -469,7 +843,7 @@ static int get_next_message (int fd, int max_size, int position,
       if (received_time != NULL)
         memcpy (received_time, found_time, ALLNET_TIME_SIZE);
 #ifdef DEBUG_PRINT
-      snprintf (log_buf, LOG_SIZE, "get_next_message: %d %d ok\n",
+      snprintf (log_buf, LOG_SIZE, "get_next_message: %d %" PRId64 " ok\n",
                 found_size, position);
       log_print ();
 #endif /* DEBUG_PRINT */
@@ -477,7 +851,8 @@ static int get_next_message (int fd, int max_size, int position,
     }
 #ifdef DEBUG_PRINT
     snprintf (log_buf, LOG_SIZE,
-              "get_next_message found %d id_off %d p %d %d\n", found_size,
+              "get_next_message found %d id_off %d p %" PRId64 " %" PRId64
+              "\n", found_size,
               found_id_off, position - (MESSAGE_ENTRY_HEADER_SIZE + found_size),
               position);
     log_print ();
@@ -531,13 +906,333 @@ static int round_up (int n)
   return 0x80000000;
 }
 
+/* to answer data requests without looking at every message, the hash
+ * entries are also in a list ordered by the time they were received,
+ * and in buckets by the first INDEX_BITS bits of the destination
+ * (index 0) and of the source (index 1).  Addresses with fewer bits
+ * are in the last bucket, which may match any request */
+#define INDEX_DST	0
+#define INDEX_SRC	1
+#define INDEX_BITS	8
+#define INDEX_BUCKETS	((1 << INDEX_BITS) + 1)
+#define INDEX_SHORT	(INDEX_BUCKETS - 1)
+
+static struct hash_entry * oldest_entry = NULL;
+static struct hash_entry * newest_entry = NULL;
+static struct hash_entry * index_buckets [2] [INDEX_BUCKETS];
+static int index_counts [2] [INDEX_BUCKETS];
+static int entries_in_use = 0;
+
+static int index_bucket (struct hash_entry * entry, int which)
+{
+  if (which == INDEX_SRC)
+    return ((entry->src_nbits < INDEX_BITS) ? INDEX_SHORT : entry->source [0]);
+  return ((entry->dst_nbits < INDEX_BITS) ? INDEX_SHORT :
+                                            entry->destination [0]);
+}
+
+static void index_add (struct hash_entry * entry)
+{
+  /* new messages are usually the newest, so search from the newest */
+  uint64_t time = readb64u (entry->received_at);
+  struct hash_entry * older = newest_entry;
+  while ((older != NULL) && (readb64u (older->received_at) > time))
+    older = older->older;
+  entry->older = older;
+  entry->newer = ((older == NULL) ? oldest_entry : older->newer);
+  if (entry->older != NULL)
+    entry->older->newer = entry;
+  else
+    oldest_entry = entry;
+  if (entry->newer != NULL)
+    entry->newer->older = entry;
+  else
+    newest_entry = entry;
+  int which;
+  for (which = INDEX_DST; which <= INDEX_SRC; which++) {
+    int b = index_bucket (entry, which);
+    entry->prev_in_index [which] = NULL;
+    entry->next_in_index [which] = index_buckets [which] [b];
+    if (index_buckets [which] [b] != NULL)
+      index_buckets [which] [b]->prev_in_index [which] = entry;
+    index_buckets [which] [b] = entry;
+    index_counts [which] [b]++;
+  }
+  entries_in_use++;
+}
+
+static void index_remove (struct hash_entry * entry)
+{
+  if (entry->older != NULL)
+    entry->older->newer = entry->newer;
+  else
+    oldest_entry = entry->newer;
+  if (entry->newer != NULL)
+    entry->newer->older = entry->older;
+  else
+    newest_entry = entry->older;
+  int which;
+  for (which = INDEX_DST; which <= INDEX_SRC; which++) {
+    int b = index_bucket (entry, which);
+    if (entry->prev_in_index [which] != NULL)
+      entry->prev_in_index [which]->next_in_index [which] =
+        entry->next_in_index [which];
+    else
+      index_buckets [which] [b] = entry->next_in_index [which];
+    if (entry->next_in_index [which] != NULL)
+      entry->next_in_index [which]->prev_in_index [which] =
+        entry->prev_in_index [which];
+    index_counts [which] [b]--;
+  }
+  entries_in_use--;
+}
+
+/* returns 1 if messages in bucket b of the index may match the bitmap */
+static int index_bucket_matches (int b, int power_two, int bits,
+                                 unsigned char * bitmap)
+{
+  if (b == INDEX_SHORT)
+    return 1;
+  unsigned char prefix = b;
+  return match_bitmap (power_two, bits, bitmap, &prefix, INDEX_BITS);
+}
+
+/* returns the number of messages in the buckets that may match */
+static int index_candidates (int which, int power_two, int bits,
+                             unsigned char * bitmap)
+{
+  if ((bits <= 0) || (bitmap == NULL))
+    return entries_in_use;
+  int result = 0;
+  int b;
+  for (b = 0; b < INDEX_BUCKETS; b++)
+    if ((index_counts [which] [b] > 0) &&
+        (index_bucket_matches (b, power_two, bits, bitmap)))
+      result += index_counts [which] [b];
+  return result;
+}
+
+/* the hot cache keeps copies of the messages most recently cached or sent
+ * in response, so popular messages are sent without touching the message
+ * files.  It is kept as an LRU list, and limited both in the number of
+ * messages and in the total bytes.  Entries are found by message ID, and
+ * removed whenever the message is removed from the hash table */
+#define HOT_CACHE_ENTRIES	1024
+#define HOT_CACHE_BUCKETS	(HOT_CACHE_ENTRIES * 2)
+#define HOT_CACHE_BYTES		(1024 * 1024)
+struct hot_entry {
+  char id [MESSAGE_ID_SIZE];
+  char * message;            /* NULL for an unused entry */
+  int msize;
+  unsigned long long int sent;  /* in response to others, or 0, see
+                                 * hot_sent_within */
+  int next;                  /* in the same bucket, or -1 */
+  int newer;                 /* in the LRU list, or -1 */
+  int older;
+};
+static struct hot_entry hot [HOT_CACHE_ENTRIES];
+static int hot_buckets [HOT_CACHE_BUCKETS];
+static int hot_unused = -1;    /* list of unused entries, linked by next */
+static int hot_newest = -1;    /* LRU list of the entries in use */
+static int hot_oldest = -1;
+static int hot_bytes = 0;
+static int hot_initialized = 0;
+static unsigned long long int hot_hits = 0;
+static unsigned long long int hot_misses = 0;
+static unsigned long long int hot_evictions = 0;
+
+static void hot_init ()
+{
+  int i;
+  for (i = 0; i < HOT_CACHE_BUCKETS; i++)
+    hot_buckets [i] = -1;
+  for (i = 0; i < HOT_CACHE_ENTRIES; i++) {
+    hot [i].message = NULL;
+    hot [i].next = ((i + 1 < HOT_CACHE_ENTRIES) ? (i + 1) : -1);
+  }
+  hot_unused = 0;
+  hot_initialized = 1;
+}
+
+static int hot_bucket (const char * id)
+{
+  return readb32 (id) % HOT_CACHE_BUCKETS;
+}
+
+static void hot_unlink_lru (int i)
+{
+  if (hot [i].newer >= 0)
+    hot [hot [i].newer].older = hot [i].older;
+  else
+    hot_newest = hot [i].older;
+  if (hot [i].older >= 0)
+    hot [hot [i].older].newer = hot [i].newer;
+  else
+    hot_oldest = hot [i].newer;
+}
+
+static void hot_make_newest (int i)
+{
+  hot [i].newer = -1;
+  hot [i].older = hot_newest;
+  if (hot_newest >= 0)
+    hot [hot_newest].newer = i;
+  hot_newest = i;
+  if (hot_oldest < 0)
+    hot_oldest = i;
+}
+
+static int hot_lookup (const char * id)
+{
+  int i;
+  for (i = hot_buckets [hot_bucket (id)]; i >= 0; i = hot [i].next)
+    if (memcmp (hot [i].id, id, MESSAGE_ID_SIZE) == 0)
+      return i;
+  return -1;
+}
+
+static void hot_free (int i)
+{
+  int * p = hot_buckets + hot_bucket (hot [i].id);
+  while ((*p >= 0) && (*p != i))
+    p = &(hot [*p].next);
+  if (*p == i)
+    *p = hot [i].next;
+  hot_unlink_lru (i);
+  free (hot [i].message);
+  hot [i].message = NULL;
+  hot_bytes -= hot [i].msize;
+  hot [i].next = hot_unused;
+  hot_unused = i;
+}
+
+static void hot_remove (const char * id)
+{
+  if (! hot_initialized)
+    return;
+  int i = hot_lookup (id);
+  if (i >= 0)
+    hot_free (i);
+}
+
+static void hot_add (const char * id, const char * message, int msize)
+{
+  if (! hot_initialized)
+    hot_init ();
+  if ((msize <= 0) || (msize > HOT_CACHE_BYTES) || (hot_lookup (id) >= 0))
+    return;
+  while ((hot_unused < 0) || (hot_bytes + msize > HOT_CACHE_BYTES)) {
+    hot_free (hot_oldest);
+    hot_evictions++;
+  }
+  int i = hot_unused;
+  hot_unused = hot [i].next;
+  memcpy (hot [i].id, id, MESSAGE_ID_SIZE);
+  hot [i].message = malloc_or_fail (msize, "hot_add");
+  memcpy (hot [i].message, message, msize);
+  hot [i].msize = msize;
+  hot [i].sent = 0;
+  hot_bytes += msize;
+  int b = hot_bucket (id);
+  hot [i].next = hot_buckets [b];
+  hot_buckets [b] = i;
+  hot_make_newest (i);
+}
+
+/* returns the cached copy of the message, or NULL */
+static char * hot_find (const char * id, int * msize)
+{
+  int i = (hot_initialized ? hot_lookup (id) : -1);
+  if (i < 0) {
+    hot_misses++;
+    return NULL;
+  }
+  hot_hits++;
+  hot_unlink_lru (i);
+  hot_make_newest (i);
+  *msize = hot [i].msize;
+  return hot [i].message;
+}
+
+/* a message sent in response to a request from elsewhere goes to all our
+ * neighbors, so it is not sent again within ACACHE_COALESCE_MS (see
+ * respond_to_request), as long as it stays in the hot cache */
+#define ACACHE_COALESCE_MS	5000
+
+static int hot_sent_within (const char * id, unsigned long long int now)
+{
+  int i = (hot_initialized ? hot_lookup (id) : -1);
+  return ((i >= 0) && (hot [i].sent != 0) &&
+          (hot [i].sent + ACACHE_COALESCE_MS > now));
+}
+
+static void hot_mark_sent (const char * id, unsigned long long int now)
+{
+  int i = (hot_initialized ? hot_lookup (id) : -1);
+  if (i >= 0)
+    hot [i].sent = now;
+}
+
+static void hot_log_stats ()
+{
+  unsigned long long int total = hot_hits + hot_misses;
+  snprintf (log_buf, LOG_SIZE,
+            "hot cache: %llu hits, %llu misses (%llu%% hits), %llu evictions, "
+            "%d bytes\n", hot_hits, hot_misses,
+            ((total > 0) ? (hot_hits * 100 / total) : 0), hot_evictions,
+            hot_bytes);
+  log_print ();
+}
+
+/* the responses in progress, see send_responses.  A response that goes
+ * through the time list or an index keeps a pointer to the next entry to
+ * look at, so when that entry is removed from the cache, the response
+ * moves on to the entry that follows it */
+#define MAX_RESPONSES	32
+struct response {
+  int in_use;
+  int requester;             /* in requesters, or -1 for local requests */
+  int local_request;
+  int priority;              /* of the next message sent */
+  char * request;            /* a copy of the request, rd points into it */
+  struct request_details rd;
+  int which;                 /* -1 for the time list, or INDEX_DST/SRC */
+  int bucket;                /* the index bucket of next */
+  uint64_t since;            /* the time list ends before this time */
+  struct hash_entry * next;  /* the next entry to look at */
+  char * ids;                /* for id requests, or else NULL */
+  int num_ids;
+  int next_id;
+};
+static struct response responses [MAX_RESPONSES];
+static int responses_in_use = 0;
+
+static struct hash_entry * following_entry (struct response * r,
+                                            struct hash_entry * entry)
+{
+  if (r->which < 0)
+    return entry->older;
+  return entry->next_in_index [r->which];
+}
+
+static void response_entry_removed (struct hash_entry * entry)
+{
+  if (responses_in_use <= 0)
+    return;
+  int i;
+  for (i = 0; i < MAX_RESPONSES; i++)
+    if ((responses [i].in_use) && (responses [i].next == entry))
+      responses [i].next = following_entry (responses + i, entry);
+}
+
 /* later, take as parameters the size and dynamically allocate the message
  * list, the hash pool, and the hash table */
-static void init_hash_table (int max_msg_size)
+static void init_hash_table (int64_t max_msg_size)
 {
 #ifdef SMALL_FIXED_SIZE
 #else /* SMALL_FIXED_SIZE */
-  hash_pool_size = round_up ((max_msg_size / sizeof (struct hash_entry)) / 10);
+  hash_pool_size =
+    round_up ((int) ((max_msg_size / sizeof (struct hash_entry)) / 10));
   if (hash_pool_size < 16)
     hash_pool_size = 16;
   hash_size = hash_pool_size / 4;
@@ -547,9 +1242,6 @@ static void init_hash_table (int max_msg_size)
   message_hash_table =
     malloc_or_fail (sizeof (struct hash_entry *) * hash_size,
                     "init_hash_table hash table");
-  message_source_table =
-    malloc_or_fail (sizeof (struct hash_entry *) * hash_size,
-                    "init_hash_table source table");
 #endif /* SMALL_FIXED_SIZE */
   message_hash_pool [0].next_by_hash = NULL;
   int i;
@@ -557,10 +1249,17 @@ static void init_hash_table (int max_msg_size)
     message_hash_pool [i].next_by_hash = message_hash_pool + (i - 1);
     message_hash_free = message_hash_pool + i;
   }
-  for (i = 0; i < hash_size; i++) {
+  for (i = 0; i < hash_size; i++)
     message_hash_table [i] = NULL;
-    message_source_table [i] = NULL;
+  oldest_entry = NULL;
+  newest_entry = NULL;
+  for (i = 0; i < INDEX_BUCKETS; i++) {
+    index_buckets [INDEX_DST] [i] = NULL;
+    index_buckets [INDEX_SRC] [i] = NULL;
+    index_counts [INDEX_DST] [i] = 0;
+    index_counts [INDEX_SRC] [i] = 0;
   }
+  entries_in_use = 0;
 }
 
 static int count_list (struct hash_entry * entry, int index)
@@ -576,7 +1275,7 @@ static int count_list (struct hash_entry * entry, int index)
     if (index != -1) {
       off += buffer_to_string ((char *) (entry->id), MESSAGE_ID_SIZE, " ",
                                16, 0, log_buf + off, LOG_SIZE - off);
-      off += snprintf (log_buf + off, LOG_SIZE - off, " @ %d, ",
+      off += snprintf (log_buf + off, LOG_SIZE - off, " @ %" PRId64 ", ",
                        entry->file_position);
     }
 #endif /* DEBUG_PRINT */
@@ -660,8 +1359,10 @@ static int hash_has_space ()
   return (message_hash_free != NULL);
 }
 
-static void hash_add_message (char * message, int msize, char * id,
-                              int position, char * time)
+/* the source and destination are limited to 16 bits */
+static void hash_add_entry (char * id, int64_t position, char * time,
+                            int src_nbits, unsigned char * source,
+                            int dst_nbits, unsigned char * destination)
 {
   /* allocate an entry from the pool */
   if (message_hash_free == NULL) {
@@ -672,33 +1373,38 @@ static void hash_add_message (char * message, int msize, char * id,
     log_print ();
     exit (1);
   }
-  struct allnet_header * hp = (struct allnet_header *) message;
-  if (msize < ALLNET_SIZE (hp->transport))  /* invalid header */
-    return;
   struct hash_entry * entry = message_hash_free;
   message_hash_free = entry->next_by_hash;
   /* initialize the entry */
   bzero (entry, sizeof (struct hash_entry));
   memcpy (entry->id, id, MESSAGE_ID_SIZE);
   entry->file_position = position;
-  entry->src_nbits = hp->src_nbits;
+  entry->src_nbits = src_nbits;
   if (entry->src_nbits > 16) entry->src_nbits = 16;
-  entry->dst_nbits = hp->dst_nbits;
+  entry->dst_nbits = dst_nbits;
   if (entry->dst_nbits > 16) entry->dst_nbits = 16;
-  memcpy (entry->source,      hp->source,      (hp->src_nbits + 7) / 8);
-  memcpy (entry->destination, hp->destination, (hp->dst_nbits + 7) / 8);
+  memcpy (entry->source,      source,      (entry->src_nbits + 7) / 8);
+  memcpy (entry->destination, destination, (entry->dst_nbits + 7) / 8);
   memcpy (entry->received_at, time, ALLNET_TIME_SIZE);
   /* add the entry to the chain in the hash table */
   int h_index = hash_index (id);
   entry->next_by_hash = message_hash_table [h_index];
   message_hash_table [h_index] = entry;
-  /* add the entry to the chain in the source table */
-  int s_index = hash_index ((char *) (entry->source));
-  entry->next_by_source = message_source_table [s_index];
-  message_source_table [s_index] = entry;
+  index_add (entry);
+  iblt_update (id, 1);
+}
+
+static void hash_add_message (char * message, int msize, char * id,
+                              int64_t position, char * time)
+{
+  struct allnet_header * hp = (struct allnet_header *) message;
+  if (msize < ALLNET_SIZE (hp->transport))  /* invalid header */
+    return;
+  hash_add_entry (id, position, time, hp->src_nbits, hp->source,
+                  hp->dst_nbits, hp->destination);
 }
 
-static void update_hash_position (char * id, int position)
+static void update_hash_position (char * id, int64_t position)
 {
   int index = hash_index (id);
   struct hash_entry * entry = message_hash_table [index];
@@ -728,25 +1434,6 @@ static void remove_hash_entry (struct hash_entry * entry, int index)
   }
 }
 
-static void remove_source_entry (struct hash_entry * entry, int index)
-{
-  if (entry == NULL)
-    return;
-  if (entry == message_source_table [index]) {
-    message_source_table [index] = entry->next_by_source;
-    return;
-  }
-  struct hash_entry * prev = message_source_table [index];
-  struct hash_entry * current = prev->next_by_source;
-  while (current != NULL) {
-    if (current == entry) 
-      prev->next_by_source = current->next_by_source;
-    else
-      prev = current;
-    current = prev->next_by_source;
-  }
-}
-
 static struct hash_entry * hash_find (char * hash)
 {
   int h_index = hash_index (hash);
@@ -765,8 +1452,10 @@ static void remove_from_hash_table (char * id)
   if (entry != NULL) {
     /* delete from hash table chain */
     remove_hash_entry (entry, hash_index (id));
-    /* and delete from the source chain */
-    remove_source_entry (entry, hash_index ((char *) (entry->source)));
+    response_entry_removed (entry);
+    hot_remove ((char *) (entry->id));
+    index_remove (entry);
+    iblt_update ((char *) (entry->id), -1);
     /* add back to free list */
     entry->next_by_hash = message_hash_free;
     message_hash_free = entry;
@@ -778,16 +1467,19 @@ static void remove_from_hash_table (char * id)
   }
 }
 
-static int assign_matching (struct hash_entry * matching, int fd,
-                            char ** message, int * msize, int * id_off,
-                            int * priority, char * time)
+static int64_t assign_matching (struct hash_entry * matching,
+                                char ** message, int * msize, int * id_off,
+                                int * priority, char * time)
 {
   if (matching != NULL) {
-    static char data [MAX_MESSAGE_ENTRY_SIZE];
-    int r = read_at_pos (fd, data, sizeof (data), matching->file_position);
+    int r = 0;
+    char * data = msg_data_at (matching->file_position,
+                               MAX_MESSAGE_ENTRY_SIZE, &r);
     if (r <= MESSAGE_ENTRY_HEADER_SIZE)
       return -1;
     int found_msize = readb16 (data + MESSAGE_ENTRY_HEADER_MSIZE_OFFSET);
+    if (MESSAGE_ENTRY_HEADER_SIZE + found_msize > r)
+      return -1;
     int found_id_off = readb16 (data + MESSAGE_ENTRY_HEADER_IDOFF_OFFSET);
     if (message != NULL) *message = data + MESSAGE_ENTRY_HEADER_SIZE;
     if (msize != NULL) *msize = found_msize;
@@ -801,14 +1493,14 @@ static int assign_matching (struct hash_entry * matching, int fd,
   return -1;
 }
 
-static int hash_get_next (int fd, int max, int pos, char * hash,
-                          char ** message, int * msize, int * id_off,
-                          int * priority, char * time)
+static int64_t hash_get_next (int64_t pos, char * hash,
+                              char ** message, int * msize, int * id_off,
+                              int * priority, char * time)
 {
   if (pos < 0)
     return -1;
   int h_index = hash_index (hash);
-  int least_not_less_than = -1;
+  int64_t least_not_less_than = -1;
   struct hash_entry * entry = message_hash_table [h_index];
   struct hash_entry * matching = NULL;
   while (entry != NULL) {
@@ -821,112 +1513,28 @@ static int hash_get_next (int fd, int max, int pos, char * hash,
     }
     entry = entry->next_by_hash;
   }
-  return assign_matching (matching, fd, message, msize, id_off, priority, time);
-}
-
-static int source_get_next (int fd, int max, int pos, unsigned char * source,
-                            char ** message, int * msize, int * id_off,
-                            int * priority, char * time)
-{
-  if (pos < 0)
-    return -1;
-  int s_index = hash_index ((char *) source);
-  int least_not_less_than = -1;
-  struct hash_entry * entry = message_source_table [s_index];
-  struct hash_entry * matching = NULL;
-  while (entry != NULL) {
-    if ((entry->file_position >= pos) &&
-        ((least_not_less_than == -1) ||
-         (least_not_less_than > entry->file_position))) {
-      matching = entry;
-      least_not_less_than = entry->file_position;
-    }
-    entry = entry->next_by_source;
-  }
-  return assign_matching (matching, fd, message, msize, id_off, priority, time);
+  return assign_matching (matching, message, msize, id_off, priority, time);
 }
 
-static int64_t list_next_matching (int fd, int max_size, int64_t position,
-                                   struct request_details * rd, char ** message,
-                                   int * msize)
-{
-  if (position < 0)
-    return -1;
-  if ((rd == NULL) ||
-      ((rd->empty) && (rd->src_nbits < bits_in_hash_table)))
-    return get_next_message (fd, max_size, (int) position, NULL,
-                             message, msize, NULL, NULL, NULL);
-  if (rd->empty)
-    return source_get_next (fd, max_size, (int) position, rd->source,
-                            message, msize, NULL, NULL, NULL);
-  int64_t index = position >> 32;
-  int64_t count = position & 0xffffffff;
-  int64_t use_count = count;
-  struct hash_entry * entry = message_hash_table [index];
-  for ( ; index < hash_size; index++) {
-    while ((entry != NULL) && (count > 0)) {
-      entry = entry->next_by_hash;
-      count--;
-    }
-    while ((entry != NULL) && (! (hash_matches (rd, entry)))) {
-      entry = entry->next_by_hash;
-      use_count++;   /* skip over this one when looking next time */
-    }
-    if (entry != NULL) {  /* hash must match */
-      assign_matching (entry, fd, message, msize, NULL, NULL, NULL);
-      /* return same index, use_count + 1 */
-      return (index << 32) | (use_count + 1);
-    }
-    /* not found at this hash index, continue with the next */
-    use_count = 0;
-    count = 0;
-  }
-  return -1;  /* nothing found */
-}
-
-#if 0
-static int list_next_matching (int fd, int max_size, int position,
-                               struct request_details * rd, char ** message,
-                               int * msize)
-{
-  if (position < 0)
-    return -1;
-  if ((rd == NULL) ||
-      ((rd->empty) && (rd->src_nbits < bits_in_hash_table)))
-    return get_next_message (fd, max_size, position, NULL,
-                             message, msize, NULL, NULL, NULL);
-  if (rd->empty)
-    return source_get_next (fd, max_size, position, rd->source,
-                            message, msize, NULL, NULL, NULL);
-  int index;
-  for (index = position; index < message_list_used; index++) {
-    struct hash_entry * entry = hash_find (message_list [index].message_id);
-    if ((entry != NULL) && (hash_matches (rd, entry))) {
-      int m = assign_matching (entry, fd, message, msize, NULL, NULL, NULL);
-      if (m > 0)
-        return index + 1;
-    }
-  }
-  return -1;  /* nothing found */
-}
-#endif /* 0 */
-
-/* returns 1 if this message is ready to be deleted, 0 otherwise */
-static int delete_gc_message (char * message, int msize,
-                              int id_off, int priority, char * time,
-                              int end_pos, int file_max)
+/* returns 1 if this message is ready to be deleted, 0 otherwise */
+/* end_pos is where the message ends if all the segments were in a single
+ * file from oldest to newest, and file_max the largest size of that file */
+static int delete_gc_message (char * message, int msize,
+                              int id_off, int priority, char * time,
+                              int64_t end_pos, int64_t file_max)
 {
   if ((msize <= ALLNET_HEADER_SIZE + MESSAGE_ID_SIZE) || (msize > ALLNET_MTU) ||
       (id_off < ALLNET_HEADER_SIZE) || (id_off + MESSAGE_ID_SIZE > msize))
     return 1;  /* bad message, no need to keep */
-  int file_pos = next_prev_position (end_pos, msize);
+  int64_t file_pos = next_prev_position (end_pos, msize);
   struct allnet_header * hp = (struct allnet_header *) message;
   /* we should delete something, so at least the first 6% of the file */
-  int min_delete = (file_max / 16);
+  int64_t min_delete = (file_max / 16);
 #ifdef DEBUG_PRINT
   int off = buffer_to_string (message + id_off, MESSAGE_ID_SIZE, "id",
                               MESSAGE_ID_SIZE, 0, log_buf, LOG_SIZE);
-  off += snprintf (log_buf + off, LOG_SIZE - off, ", pos %d/%d, transport %x",
+  off += snprintf (log_buf + off, LOG_SIZE - off,
+                   ", pos %" PRId64 "/%" PRId64 ", transport %x",
                    file_pos, min_delete, hp->transport);
 #endif /* DEBUG_PRINT */
   if (file_pos <= min_delete)
@@ -936,7 +1544,9 @@ static int delete_gc_message (char * message, int msize,
    * if the priority is less, go ahead and delete */
   /* for example, priority 3/4 should only be deleted if fof < 1/4 */
   /* for example, priority 1/5 should be deleted unless fof >= 4/5 */
-  int fraction_of_file = allnet_divide (file_pos, file_max);
+  int64_t scale = 1 + file_max / 0x40000000;   /* allnet_divide takes ints */
+  int fraction_of_file = allnet_divide ((int) (file_pos / scale),
+                                        (int) (file_max / scale));
 #ifdef DEBUG_PRINT
   off += snprintf (log_buf + off, LOG_SIZE - off,
                    ", %x<>%x (%d)", fraction_of_file,
@@ -960,24 +1570,362 @@ static int delete_gc_message (char * message, int msize,
   return 0;
 }
 
-static void gc (int fd, int max_size)
+/* the name of the file for segment n, to be freed by the caller */
+static char * segment_name (int n)
+{
+  char file [100];
+  snprintf (file, sizeof (file), "segment.%d", n);
+  char * name = NULL;
+  if (config_file_name (acache_dir, file, &name) < 0)
+    return NULL;
+  return name;
+}
+
+/* each segment except the active one may have an index file,
+ * ~/.allnet/acache/segment.n.index, so that at startup the hash table can
+ * be filled in without reading every message.  The index file has:
+ *   8 bytes: SEGMENT_INDEX_MAGIC
+ *   4 bytes: SEGMENT_INDEX_VERSION
+ *   4 bytes: the number of records
+ *   8 bytes: the sequence number of the segment
+ *   8 bytes: the size of the segment file
+ *   8 bytes: the first 8 bytes of the sha512 hash of the records
+ * followed by one record per message: the offset of the message in the
+ * segment (4 bytes), its ID, the time it was received, and the number of
+ * bits (1 byte each) and the first 2 bytes of its source and destination.
+ * The index file is removed before the segment is changed, and written
+ * again after the segment is compacted, so an index that matches the
+ * segment's sequence number and size describes the segment.  Any other
+ * index file is removed, and the segment is read instead */
+#define SEGMENT_INDEX_MAGIC		"acacheix"
+#define SEGMENT_INDEX_VERSION		1
+#define SEGMENT_INDEX_HEADER_SIZE	40
+#define SEGMENT_INDEX_RECORD_SIZE	(4 + MESSAGE_ID_SIZE + ALLNET_TIME_SIZE + 6)
+
+static char * segment_index_name (int n, char * suffix)
+{
+  char file [100];
+  snprintf (file, sizeof (file), "segment.%d.index%s", n, suffix);
+  char * name = NULL;
+  if (config_file_name (acache_dir, file, &name) < 0)
+    return NULL;
+  return name;
+}
+
+static void unlink_segment_index (int n)
+{
+  char * name = segment_index_name (n, "");
+  if (name != NULL) {
+    unlink (name);
+    free (name);
+  }
+  segments [n].indexed = 0;
+}
+
+/* call before changing segment n */
+static void forget_segment_index (int n)
+{
+  if ((n >= 0) && (n < num_segments) && (segments [n].indexed))
+    unlink_segment_index (n);
+}
+
+/* the message is valid and has an ID, so it belongs in the hash table */
+static int message_has_id (char * message, int msize, int id_off)
 {
-  int gc_size = max_size;
-  if (gc_size > fd_size (fd))
-    gc_size = fd_size (fd);
+  return ((msize > 0) && (msize <= ALLNET_MTU) && (id_off != 0) &&
+          (id_off + MESSAGE_ID_SIZE <= msize));
+}
+
+static void write_segment_index (int n)
+{
+  struct segment * s = segments + n;
+  if ((s->fd < 0) || (n == active) || (s->indexed))
+    return;
+  int max_records = 1024;
+  char * records = malloc_or_fail (max_records * SEGMENT_INDEX_RECORD_SIZE,
+                                   "write_segment_index");
+  int count = 0;
+  int64_t base = segment_position (n, 0);
+  int64_t end = segment_position (n + 1, 0);
+  int64_t position = base;
+  char * message;
+  int msize;
+  int id_off;
+  char time [ALLNET_TIME_SIZE];
+  while (((position = get_next_message (position, NULL, &message, &msize,
+                                        &id_off, NULL, time)) > 0) &&
+         (next_prev_position (position, msize) < end)) {
+    struct allnet_header * hp = (struct allnet_header *) message;
+    if ((! message_has_id (message, msize, id_off)) ||
+        (msize < ALLNET_SIZE (hp->transport)))
+      continue;
+    if (count >= max_records) {
+      max_records *= 2;
+      char * larger = realloc (records,
+                               max_records * SEGMENT_INDEX_RECORD_SIZE);
+      if (larger == NULL) {
+        snprintf (log_buf, LOG_SIZE, "unable to index segment %d\n", n);
+        log_print ();
+        free (records);
+        return;
+      }
+      records = larger;
+    }
+    char * r = records + count * SEGMENT_INDEX_RECORD_SIZE;
+    bzero (r, SEGMENT_INDEX_RECORD_SIZE);
+    writeb32 (r, next_prev_position (position, msize) - base);
+    memcpy (r + 4, message + id_off, MESSAGE_ID_SIZE);
+    char * p = r + 4 + MESSAGE_ID_SIZE;
+    memcpy (p, time, ALLNET_TIME_SIZE);
+    p += ALLNET_TIME_SIZE;
+    int sbits = ((hp->src_nbits > 16) ? 16 : hp->src_nbits);
+    int dbits = ((hp->dst_nbits > 16) ? 16 : hp->dst_nbits);
+    p [0] = sbits;
+    p [1] = dbits;
+    memcpy (p + 2, hp->source, (sbits + 7) / 8);
+    memcpy (p + 4, hp->destination, (dbits + 7) / 8);
+    count++;
+  }
+  char header [SEGMENT_INDEX_HEADER_SIZE];
+  memcpy (header, SEGMENT_INDEX_MAGIC, 8);
+  writeb32 (header + 8, SEGMENT_INDEX_VERSION);
+  writeb32 (header + 12, count);
+  writeb64 (header + 16, s->seq);
+  writeb64 (header + 24, s->size);
+  sha512_bytes (records, count * SEGMENT_INDEX_RECORD_SIZE, header + 32, 8);
+  /* write a new file, then rename it, so the index is never partly written */
+  char * tmp_name = segment_index_name (n, ".new");
+  char * name = segment_index_name (n, "");
+  int fd = ((tmp_name == NULL) ? -1 :
+            open (tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0600));
+  if (fd >= 0) {
+    write_at_pos (fd, header, SEGMENT_INDEX_HEADER_SIZE, 0);
+    write_at_pos (fd, records, count * SEGMENT_INDEX_RECORD_SIZE,
+                  SEGMENT_INDEX_HEADER_SIZE);
+    if (sync_mode != ACACHE_SYNC_OS)
+      fsync (fd);
+    close (fd);
+    if ((name != NULL) && (rename (tmp_name, name) == 0))
+      s->indexed = 1;
+    else
+      unlink (tmp_name);
+  }
+  if (tmp_name != NULL)
+    free (tmp_name);
+  if (name != NULL)
+    free (name);
+  free (records);
+}
+
+/* adds the messages in the index of segment n to the hash table.
+ * returns the number added, or -1 if there is no valid index */
+static int load_segment_index (int n)
+{
+  struct segment * s = segments + n;
+  char * name = segment_index_name (n, "");
+  if (name == NULL)
+    return -1;
+  int fd = open (name, O_RDONLY);
+  if (fd < 0) {
+    free (name);
+    return -1;
+  }
+  off_t size = fd_size (fd);
+  char * map = NULL;
+  if (size >= SEGMENT_INDEX_HEADER_SIZE)
+    map = mmap (NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    map = NULL;
+  int count = ((map == NULL) ? 0 : readb32 (map + 12));
+  char hash [8];
+  if (map != NULL)
+    sha512_bytes (map + SEGMENT_INDEX_HEADER_SIZE,
+                  size - SEGMENT_INDEX_HEADER_SIZE, hash, sizeof (hash));
+  if ((map == NULL) ||
+      (memcmp (map, SEGMENT_INDEX_MAGIC, 8) != 0) ||
+      (readb32 (map + 8) != SEGMENT_INDEX_VERSION) ||
+      (size != SEGMENT_INDEX_HEADER_SIZE +
+               (off_t) count * SEGMENT_INDEX_RECORD_SIZE) ||
+      (readb64 (map + 16) != s->seq) ||
+      (readb64 (map + 24) != s->size) ||
+      (memcmp (map + 32, hash, sizeof (hash)) != 0)) {
+    snprintf (log_buf, LOG_SIZE, "index of segment %d is not valid\n", n);
+    log_print ();
+    if (map != NULL)
+      munmap (map, size);
+    unlink (name);
+    free (name);
+    return -1;
+  }
+  free (name);
+  int added = 0;
+  int i;
+  for (i = 0; (i < count) && (message_hash_free != NULL); i++) {
+    char * r = map + SEGMENT_INDEX_HEADER_SIZE + i * SEGMENT_INDEX_RECORD_SIZE;
+    off_t offset = readb32 (r);
+    if ((offset < SEGMENT_HEADER_SIZE) ||
+        (offset + MESSAGE_ENTRY_HEADER_SIZE > s->size))
+      continue;
+    char * p = r + 4 + MESSAGE_ID_SIZE + ALLNET_TIME_SIZE;
+    hash_add_entry (r + 4, segment_position (n, offset),
+                    r + 4 + MESSAGE_ID_SIZE,
+                    p [0], (unsigned char *) (p + 2),
+                    p [1], (unsigned char *) (p + 4));
+    added++;
+  }
+  munmap (map, size);
+  s->indexed = 1;
+  return added;
+}
+
+static void map_segment (int n)
+{
+  struct segment * s = segments + n;
+  void * map = mmap (NULL, segment_size, PROT_READ, MAP_SHARED, s->fd, 0);
+  if (map == MAP_FAILED) {
+    perror ("acache mmap");
+    snprintf (log_buf, LOG_SIZE,
+              "acache unable to map segment %d, using pread\n", n);
+    log_print ();
+    map = NULL;
+  }
+  s->map = map;
+}
+
+/* returns the oldest segment whose sequence number is at least min_seq,
+ * or -1 if there is none.  If skip_active, never returns the active one */
+static int oldest_segment (uint64_t min_seq, int skip_active)
+{
+  int result = -1;
+  int n;
+  for (n = 0; n < num_segments; n++)
+    if ((segments [n].fd >= 0) && ((n != active) || (! skip_active)) &&
+        (segments [n].seq >= min_seq) &&
+        ((result < 0) || (segments [n].seq < segments [result].seq)))
+      result = n;
+  return result;
+}
+
+/* close and delete segment n, whose messages must no longer be in the
+ * hash table */
+static void remove_segment (int n)
+{
+  struct segment * s = segments + n;
+  if (n == active) {
+    flush_staging ();
+    active = -1;
+  }
+  forget_segment_index (n);
+  if (s->map != NULL)
+    munmap (s->map, segment_size);
+  close (s->fd);
+  char * name = segment_name (n);
+  if (name != NULL) {
+    unlink (name);
+    free (name);
+  }
+  cache_bytes -= s->size;
+  s->fd = -1;
+  s->map = NULL;
+  s->size = 0;
+  s->unsynced = 0;
+}
+
+/* delete all the messages in segment n, and the segment */
+static void drop_segment (int n)
+{
+  int64_t end = segment_position (n + 1, 0);
+  int64_t position = segment_position (n, 0);
+  int count = 0;
+  char * message;
+  int msize;
+  int id_off;
+  while (((position = get_next_message (position, NULL, &message, &msize,
+                                        &id_off, NULL, NULL)) > 0) &&
+         (next_prev_position (position, msize) < end)) {
+    remove_from_hash_table (message + id_off);
+#ifdef USING_MESSAGE_LIST
+    list_remove_message (message + id_off);
+#endif /* USING_MESSAGE_LIST */
+    count++;
+  }
+  snprintf (log_buf, LOG_SIZE, "dropped segment %d with %d messages\n",
+            n, count);
+  log_print ();
+  remove_segment (n);
+}
+
+/* start a new active segment.  Returns 1 for success, 0 for failure */
+static int start_segment ()
+{
+  flush_staging ();
+  int sealed = active;   /* no longer changes, so may be indexed */
+  int n;
+  for (n = 0; n < num_segments; n++)
+    if (segments [n].fd < 0)
+      break;
+  if (n >= num_segments) {   /* all in use, replace the oldest */
+    n = oldest_segment (0, 1);
+    if (n < 0)
+      return 0;
+    drop_segment (n);
+  }
+  char * name = segment_name (n);
+  int fd = -1;
+  if (name != NULL) {
+    fd = open (name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    free (name);
+  }
+  if (fd < 0) {
+    perror ("acache open segment");
+    snprintf (log_buf, LOG_SIZE, "acache unable to create segment %d\n", n);
+    log_error ("acache start_segment");
+    return 0;
+  }
+  char header [SEGMENT_HEADER_SIZE];
+  writeb64 (header, next_seq);
+  write_at_pos (fd, header, SEGMENT_HEADER_SIZE, 0);
+  struct segment * s = segments + n;
+  s->fd = fd;
+  s->seq = next_seq++;
+  s->size = SEGMENT_HEADER_SIZE;
+  s->unsynced = 1;
+  map_segment (n);
+  cache_bytes += SEGMENT_HEADER_SIZE;
+  active = n;
+  if ((sealed >= 0) && (sealed != n))
+    write_segment_index (sealed);
+  return 1;
+}
+
+/* compact segment n (which is not the active segment), leaving out
+ * the messages that delete_gc_message selects */
+static void gc_segment (int n, int64_t max_size)
+{
+  struct segment * s = segments + n;
+  int64_t older = 0;   /* bytes in segments older than this one */
+  int i;
+  for (i = 0; i < num_segments; i++)
+    if ((segments [i].fd >= 0) && (segments [i].seq < s->seq))
+      older += segment_used (i);
+  int64_t base = segment_position (n, 0);
+  int64_t end = segment_position (n + 1, 0);
   int copied = 0, deleted = 0;
-  int read_position = 0;
-  int write_position = 0;
+  forget_segment_index (n);
+  int64_t read_position = base;
+  off_t write_offset = SEGMENT_HEADER_SIZE;
   char * message;
   int msize;
   int id_off;
   int priority;
   char time [ALLNET_TIME_SIZE];
-  while ((read_position =
-            get_next_message (fd, max_size, read_position, NULL, &message,
-                              &msize, &id_off, &priority, time)) > 0) {
+  while (((read_position =
+             get_next_message (read_position, NULL, &message, &msize,
+                               &id_off, &priority, time)) > 0) &&
+         (next_prev_position (read_position, msize) < end)) {
     int delete = delete_gc_message (message, msize, id_off, priority, time,
-                                    read_position, gc_size);
+                                    older + (read_position - base), max_size);
 #ifdef DEBUG_PRINT
     snprintf (log_buf + strlen (log_buf), LOG_SIZE - strlen (log_buf),
               "  ==> delete %d\n", delete);
@@ -992,9 +1940,11 @@ static void gc (int fd, int max_size)
               ALLNET_TIME_SIZE);
       memcpy (buffer + MESSAGE_ENTRY_HEADER_SIZE, message, msize);
       int write_size = MESSAGE_ENTRY_HEADER_SIZE + msize;
-      write_at_pos (fd, buffer, write_size, write_position);
-      update_hash_position (message + id_off, write_position);
-      write_position += write_size;
+      /* the write may overlap this message, so use the copy from now on */
+      write_at_pos (s->fd, buffer, write_size, write_offset);
+      update_hash_position (buffer + MESSAGE_ENTRY_HEADER_SIZE + id_off,
+                            base + write_offset);
+      write_offset += write_size;
       copied++;
     } else {
       remove_from_hash_table (message + id_off);
@@ -1004,15 +1954,104 @@ static void gc (int fd, int max_size)
       deleted++;
     }
   }
-  truncate_to_size (fd, write_position, "gc");
-  fsync (fd);
-  snprintf (log_buf, LOG_SIZE, "%d copied, %d deleted, ", copied, deleted);
-#ifdef DEBUG_PRINT
-#endif /* DEBUG_PRINT */
-  print_stats (1, copied);
+  snprintf (log_buf, LOG_SIZE,
+            "segment %d: %d bytes, %d copied, %d deleted\n",
+            n, (int) (s->size), copied, deleted);
+  log_print ();
+  if (write_offset <= SEGMENT_HEADER_SIZE) {   /* nothing left */
+    remove_segment (n);
+    return;
+  }
+  if ((write_offset < s->size) && (ftruncate (s->fd, write_offset) != 0))
+    perror ("acache ftruncate");
+  cache_bytes -= (s->size - write_offset);
+  s->size = write_offset;
+  if (sync_mode != ACACHE_SYNC_OS)
+    fsync (s->fd);
+  write_segment_index (n);
+}
+
+/* where the current pass of gc_step is */
+static uint64_t gc_next_seq = 0;
+
+/* compact the next segment in a pass over the segments from oldest to
+ * newest.  A whole pass deletes the same messages as compacting all the
+ * segments at once would, but each step only takes one segment */
+static void gc_step (int64_t max_size)
+{
+  if ((oldest_segment (0, 1) < 0) && (! start_segment ()))
+    return;   /* no segment that can be compacted */
+  int n = oldest_segment (gc_next_seq, 1);
+  if (n < 0)   /* start a new pass */
+    n = oldest_segment (0, 1);
+  if (n < 0)
+    return;
+  gc_next_seq = segments [n].seq + 1;
+  gc_segment (n, max_size);
+}
+
+/* most segments to compact each time a message is saved */
+#define GC_STEPS	4
+
+/* make room for extra more bytes and a hash entry, compacting at most
+ * GC_STEPS segments.  If that is not enough, drop the oldest segments,
+ * so the cache never grows much past max_size */
+static void gc (int64_t max_size, int extra)
+{
+  int steps = 0;
+  while (((cache_bytes + extra > max_size) || (! hash_has_space ())) &&
+         (steps++ < GC_STEPS))
+    gc_step (max_size);
+  while ((cache_bytes + extra > max_size + segment_size) ||
+         (! hash_has_space ())) {
+    int n = oldest_segment (0, 1);
+    if ((n < 0) &&   /* only the active segment, drop that */
+        ((active < 0) || (segment_used (active) <= SEGMENT_HEADER_SIZE) ||
+         (! start_segment ()) || ((n = oldest_segment (0, 1)) < 0)))
+      return;
+    drop_segment (n);
+  }
+}
+
+/* save the message entry, with header, at the end of the active segment */
+static void store_entry (int64_t max_size, char * entry, int fsize)
+{
+  char * message = entry + MESSAGE_ENTRY_HEADER_SIZE;
+  int msize = fsize - MESSAGE_ENTRY_HEADER_SIZE;
+  int id_off = readb16 (entry + MESSAGE_ENTRY_HEADER_IDOFF_OFFSET);
+  gc (max_size, fsize);
+  if (! hash_has_space ()) {
+    snprintf (log_buf, LOG_SIZE, "no space to save message of size %d\n",
+              msize);
+    log_print ();
+    return;
+  }
+  if (((active < 0) || (segment_used (active) + fsize > segment_size)) &&
+      (! start_segment ()))
+    return;
+  if (staging_used + fsize > STAGING_SIZE)
+    flush_staging ();
+  int64_t write_position = segment_position (active, segment_used (active));
+  if (staging_used == 0)
+    staging_start = write_position;
+  if (staging_deadline == 0)
+    staging_deadline = allnet_time_ms () + sync_ms;
+  memcpy (staging + staging_used, entry, fsize);
+  staging_used += fsize;
+  staging_count++;
+  cache_bytes += fsize;
+  hash_add_message (message, msize, message + id_off, write_position,
+                    entry + MESSAGE_ENTRY_HEADER_TIME_OFFSET);
+  hot_add (message + id_off, message, msize);
+#ifdef USING_MESSAGE_LIST
+  list_add_message (message + id_off);
+#endif /* USING_MESSAGE_LIST */
+  /* flush after adding to the hash table, so a failed write removes it */
+  if ((sync_mode == ACACHE_SYNC_PACKET) || (staging_count >= sync_packets))
+    flush_staging ();
 }
 
-static void cache_message (int fd, int max_size,
+static void cache_message (int64_t max_size,
                            int id_off, char * message, int msize, int priority)
 {
   if (id_off + MESSAGE_ID_SIZE > msize)
@@ -1022,7 +2061,7 @@ static void cache_message (int fd, int max_size,
   if ((fsize > max_size) || (fsize > MAX_MESSAGE_ENTRY_SIZE) || (fsize < 0)) {
     snprintf (log_buf, LOG_SIZE,
               "unable to save message of size %d/%d, max %d/%d\n",
-              msize, fsize, max_size, MAX_MESSAGE_ENTRY_SIZE);
+              msize, fsize, (int) max_size, MAX_MESSAGE_ENTRY_SIZE);
     log_print ();
     return;
   }
@@ -1032,35 +2071,10 @@ static void cache_message (int fd, int max_size,
   long long int now = allnet_time ();
   writeb64 (mbuffer + MESSAGE_ENTRY_HEADER_TIME_OFFSET, now);
   memcpy (mbuffer + MESSAGE_ENTRY_HEADER_SIZE, message, msize);
-  int count = 0;
-  while (! hash_has_space ()) { /* delete some entries in the hash table */
-    snprintf (log_buf, LOG_SIZE, "gc'ing to make space for hash: %d\n",
-              ++count);
-    log_print ();
-    if (count > 10)
-      exit (1);
-    gc (fd, max_size);
-  }
-  off_t write_position = fd_size (fd);
-  write_at_pos (fd, mbuffer, fsize, write_position);
-  fsync (fd);
-  hash_add_message (message, msize, message + id_off, write_position,
-                    mbuffer + MESSAGE_ENTRY_HEADER_TIME_OFFSET);
-#ifdef USING_MESSAGE_LIST
-  list_add_message (message + id_off);
-#endif /* USING_MESSAGE_LIST */
-snprintf (log_buf, LOG_SIZE, "saved message at position %d, hash index %d, ", (int) write_position, hash_index (message + id_off)); log_print (); print_stats (0, -1);
-  count = 0;
-  while (fd_size (fd) > max_size) {
-    snprintf (log_buf, LOG_SIZE, "gc'ing to reduce space from %d to %d: %d\n",
-              (int) (fd_size (fd)), max_size, ++count);
-    log_print ();
-    gc (fd, max_size);
-  }
+  store_entry (max_size, mbuffer, fsize);
 }
 
-static void remove_cached_message (int fd, int max_size, char * id,
-                                   int position, int msize)
+static void remove_cached_message (char * id, int64_t position, int msize)
 {
   static char buffer [MAX_MESSAGE_ENTRY_SIZE];
   int fsize = MESSAGE_ENTRY_HEADER_SIZE + msize;
@@ -1071,13 +2085,17 @@ static void remove_cached_message (int fd, int max_size, char * id,
     log_print ();
     return;   /* invalid call */
   }
+  /* id may point into the segment, which is about to be erased */
+  char id_copy [MESSAGE_ID_SIZE];
+  memcpy (id_copy, id, MESSAGE_ID_SIZE);
+  id = id_copy;
   /* read the entry, make sure the size matches */
-  int next = get_next_message (fd, max_size, position, NULL,
-                               NULL, NULL, NULL, NULL, NULL);
+  int64_t next = get_next_message (position, NULL,
+                                   NULL, NULL, NULL, NULL, NULL);
   if ((next != 0) && (next - position != fsize)) {
     snprintf (log_buf, LOG_SIZE,
-              "warning in acache: next %d - pos %d != fsize %d (%d)\n",
-              next, position, fsize, (int) (fd_size (fd)));
+              "warning in acache: next %" PRId64 " - pos %" PRId64
+              " != fsize %d\n", next, position, fsize);
     log_print ();
     buffer_to_string (id, MESSAGE_ID_SIZE, "id", MESSAGE_ID_SIZE, 1,
                       log_buf, LOG_SIZE);
@@ -1088,10 +2106,10 @@ static void remove_cached_message (int fd, int max_size, char * id,
                     log_buf, LOG_SIZE);
   log_print ();
   /* mark it as erased, but keep the size, so we can later skip */
+  forget_segment_index ((int) (position / segment_size));
   bzero (buffer, fsize);
   writeb16 (buffer + MESSAGE_ENTRY_HEADER_MSIZE_OFFSET, msize);
-  write_at_pos (fd, buffer, fsize, position);
-  fsync (fd);
+  msg_write_at_pos (buffer, fsize, position);
   remove_from_hash_table (id);
 #ifdef USING_MESSAGE_LIST
   list_remove_message (id);
@@ -1119,7 +2137,7 @@ static char * get_id (char * message, int size)
 }
 
 /* returns 1 if successful, 0 otherwise */
-static int save_packet (int fd, int max_size, char * message, int msize,
+static int save_packet (int64_t max_size, char * message, int msize,
                         int priority)
 {
 #ifdef DEBUG_PRINT
@@ -1127,7 +2145,8 @@ static int save_packet (int fd, int max_size, char * message, int msize,
   log_print ();
 #endif /* DEBUG_PRINT */
   char * id = get_id (message, msize);
-  if (id == NULL)   /* no sort of message or packet ID found */
+  if ((id == NULL) ||   /* no sort of message or packet ID found */
+      (! in_shard (id)))
     return 0;
 #ifdef DEBUG_PRINT
   buffer_to_string (id, MESSAGE_ID_SIZE, "id", MESSAGE_ID_SIZE, 1,
@@ -1142,82 +2161,464 @@ static int save_packet (int fd, int max_size, char * message, int msize,
 #endif /* DEBUG_PRINT */
     return 0;
   }
-  cache_message (fd, max_size, id - message, message, msize, priority);
+  cache_message (max_size, id - message, message, msize, priority);
   return 0;
 }
 
-/* to limit resource consumption, only respond to requests that are
- * local, or to at most 5 requests per second */
-static unsigned long long int limit_resources (int local_request) 
+/* requests from others are limited by a token bucket for each requester,
+ * identified by the first (up to 16) bits of the source address of the
+ * request, so requests with no source address share one bucket.  Each
+ * message sent in response uses up one token, and the tokens are refilled
+ * at ACACHE_RESPONSE_RATE per second, up to ACACHE_RESPONSE_BURST.
+ * A response that runs out of tokens waits for more, rather than
+ * being cut short.  Local requests are not limited. */
+#define MAX_REQUESTERS		64
+#define MAX_REQUESTER_RESPONSES	2     /* in progress at the same time */
+#define ACACHE_RESPONSE_RATE	100   /* messages per second */
+#define ACACHE_RESPONSE_BURST	400
+/* with shards, each shard allows its share of the rate */
+static double response_rate = ACACHE_RESPONSE_RATE;
+static double response_burst = ACACHE_RESPONSE_BURST;
+struct requester {
+  int in_use;
+  int nbits;
+  unsigned char source [2];
+  double tokens;
+  unsigned long long int last_update;   /* allnet_time_ms */
+  int responses;                        /* in progress */
+};
+static struct requester requesters [MAX_REQUESTERS];
+
+static void refill (struct requester * r, unsigned long long int now)
+{
+  if (now > r->last_update) {
+    r->tokens += (now - r->last_update) * response_rate / 1000.0;
+    if (r->tokens > response_burst)
+      r->tokens = response_burst;
+  }
+  r->last_update = now;
+}
+
+/* returns the requester for this source, creating it if necessary by
+ * replacing the least recent requester with no responses in progress */
+static int find_requester (unsigned char * source, int nbits,
+                           unsigned long long int now)
+{
+  if (nbits > 16)
+    nbits = 16;
+  if (nbits < 0)
+    nbits = 0;
+  unsigned char key [2] = { 0, 0 };
+  memcpy (key, source, (nbits + 7) / 8);
+  if ((nbits % 8) != 0)   /* clear the bits past nbits */
+    key [nbits / 8] &= (0xff << (8 - (nbits % 8))) & 0xff;
+  int replace = -1;
+  int i;
+  for (i = 0; i < MAX_REQUESTERS; i++) {
+    struct requester * r = requesters + i;
+    if ((r->in_use) && (r->nbits == nbits) &&
+        (memcmp (r->source, key, sizeof (key)) == 0))
+      return i;
+    if (r->responses != 0)
+      continue;
+    if ((replace < 0) || (! r->in_use) ||
+        ((requesters [replace].in_use) &&
+         (r->last_update < requesters [replace].last_update)))
+      replace = i;
+  }
+  if (replace < 0)   /* cannot happen, MAX_RESPONSES < MAX_REQUESTERS */
+    return -1;
+  struct requester * r = requesters + replace;
+  r->in_use = 1;
+  r->nbits = nbits;
+  memcpy (r->source, key, sizeof (key));
+  r->tokens = response_burst;
+  r->last_update = now;
+  return replace;
+}
+
+/* returns a new response for a request, or NULL if the request should
+ * not be answered now */
+static struct response * new_response (struct allnet_header * hp,
+                                       int local_request)
+{
+  if (responses_in_use >= MAX_RESPONSES)
+    return NULL;
+  int req = -1;
+  if (! local_request) {
+    unsigned long long int now = allnet_time_ms ();
+    req = find_requester (hp->source, hp->src_nbits, now);
+    if (req < 0)
+      return NULL;
+    struct requester * r = requesters + req;
+    refill (r, now);
+    if ((r->tokens < 1) || (r->responses >= MAX_REQUESTER_RESPONSES))
+      return NULL;   /* too many requests */
+    r->responses++;
+  }
+  int i;
+  for (i = 0; i < MAX_RESPONSES; i++) {
+    if (! responses [i].in_use) {
+      struct response * r = responses + i;
+      bzero (r, sizeof (struct response));
+      r->in_use = 1;
+      r->requester = req;
+      r->local_request = local_request;
+      r->priority = ALLNET_PRIORITY_CACHE_RESPONSE;
+      r->which = -1;
+      r->bucket = -1;
+      responses_in_use++;
+      return r;
+    }
+  }
+  return NULL;   /* not reached, since responses_in_use < MAX_RESPONSES */
+}
+
+static void end_response (struct response * r)
+{
+  if (r->request != NULL)
+    free (r->request);
+  if (r->ids != NULL)
+    free (r->ids);
+  if (r->requester >= 0)
+    requesters [r->requester].responses--;
+  r->request = NULL;
+  r->ids = NULL;
+  r->in_use = 0;
+  responses_in_use--;
+}
+
+/* returns the next entry to send in this response, or NULL when done */
+static struct hash_entry * response_next (struct response * r)
+{
+  if (r->ids != NULL) {
+    while (r->next_id < r->num_ids) {
+      struct hash_entry * entry =
+        hash_find (r->ids + (r->next_id++) * MESSAGE_ID_SIZE);
+      if (entry != NULL)   /* may have been removed since the request */
+        return entry;
+    }
+    return NULL;
+  }
+  while (1) {
+    struct hash_entry * entry = r->next;
+    if (r->which < 0) {   /* newest first, until reaching the request's time */
+      if ((entry == NULL) || (readb64u (entry->received_at) < r->since))
+        return NULL;
+    } else {
+      while (entry == NULL) {   /* go on to the next matching bucket */
+        r->bucket++;
+        if (r->bucket >= INDEX_BUCKETS)
+          return NULL;
+        struct request_details * rd = &(r->rd);
+        if ((index_counts [r->which] [r->bucket] > 0) &&
+            (index_bucket_matches (r->bucket,
+               ((r->which == INDEX_DST) ? rd->dpower_two : rd->spower_two),
+               ((r->which == INDEX_DST) ? rd->dbits : rd->sbits),
+               ((r->which == INDEX_DST) ? rd->dbitmap : rd->sbitmap))))
+          entry = index_buckets [r->which] [r->bucket];
+      }
+    }
+    r->next = following_entry (r, entry);
+    if (hash_matches (&(r->rd), entry))
+      return entry;
+  }
+}
+
+/* a response is ready if it may send at least one message now */
+static int response_ready (struct response * r, unsigned long long int now)
+{
+  if (r->requester < 0)
+    return 1;
+  refill (requesters + r->requester, now);
+  return (requesters [r->requester].tokens >= 1);
+}
+
+/* returns how long to wait before calling send_responses */
+static int responses_timeout ()
+{
+  if (responses_in_use <= 0)
+    return PIPE_MESSAGE_WAIT_FOREVER;
+  unsigned long long int now = allnet_time_ms ();
+  int timeout = PIPE_MESSAGE_WAIT_FOREVER;
+  int i;
+  for (i = 0; i < MAX_RESPONSES; i++) {
+    struct response * r = responses + i;
+    if (! r->in_use)
+      continue;
+    if (response_ready (r, now))
+      return PIPE_MESSAGE_NO_WAIT;
+    double missing = 1 - requesters [r->requester].tokens;
+    int ms = (int) (missing * 1000 / response_rate) + 1;
+    if ((timeout == PIPE_MESSAGE_WAIT_FOREVER) || (ms < timeout))
+      timeout = ms;
+  }
+  return timeout;
+}
+
+/* after a partition heals, many neighbors send nearly the same request at
+ * about the same time, and the responses go to all our neighbors.  So a
+ * request from elsewhere is not answered if every message it matches is
+ * also matched by a request being answered, or by one whose answer was
+ * finished within ACACHE_COALESCE_MS */
+#define RECENT_REQUESTS		16
+struct recent_request {
+  char * request;            /* NULL if not used, rd points into it */
+  struct request_details rd;
+  unsigned long long int finished;   /* allnet_time_ms */
+};
+static struct recent_request recent_requests [RECENT_REQUESTS];
+static int next_recent = 0;
+static unsigned long long int coalesced = 0;
+
+/* returns 1 if every address matched by bitmap is matched by covering */
+static int bitmap_covers (int cpower_two, int cbits, unsigned char * cbitmap,
+                          int power_two, int bits, unsigned char * bitmap)
+{
+  if ((cpower_two <= 0) || (cbits <= 0) || (cbitmap == NULL))
+    return 1;   /* an empty bitmap matches every address */
+  if ((power_two != cpower_two) || (bits != cbits) || (bitmap == NULL))
+    return 0;
+  int i;
+  for (i = 0; i < (bits + 7) / 8; i++)
+    if ((bitmap [i] & (~ (cbitmap [i]))) != 0)
+      return 0;
+  return 1;
+}
+
+/* returns 1 if every message matched by rd is matched by covering */
+static int request_covers (struct request_details * covering,
+                           struct request_details * rd)
 {
-  static unsigned long long int last_response = 0;
-  unsigned long long int start = allnet_time_ms ();
-  if (local_request)
-    return start + 1000;   /* up to 1s for local requests */
-  if ((last_response != 0) && (start <= last_response + 200))
-    return 0;              /* too many requests */
+  if ((covering->empty) || (rd->empty))  /* match on the requester address */
+    return ((covering->empty) && (rd->empty) &&
+            (covering->src_nbits <= rd->src_nbits) &&
+            (matches (covering->source, covering->src_nbits,
+                      rd->source, rd->src_nbits)));
+  if ((covering->since != NULL) &&
+      ((rd->since == NULL) ||
+       (readb64u (covering->since) > readb64u (rd->since))))
+    return 0;
+  return ((bitmap_covers (covering->dpower_two, covering->dbits,
+                          covering->dbitmap,
+                          rd->dpower_two, rd->dbits, rd->dbitmap)) &&
+          (bitmap_covers (covering->spower_two, covering->sbits,
+                          covering->sbitmap,
+                          rd->spower_two, rd->sbits, rd->sbitmap)));
+}
 
-  return start + 10;       /* allow 10ms */
+/* returns 1 if the request is already being answered, or was just answered */
+static int request_coalesced (struct request_details * rd,
+                              unsigned long long int now)
+{
+  int i;
+  for (i = 0; i < MAX_RESPONSES; i++) {
+    struct response * r = responses + i;
+    if ((r->in_use) && (! r->local_request) && (r->request != NULL) &&
+        (request_covers (&(r->rd), rd)))
+      return 1;
+  }
+  for (i = 0; i < RECENT_REQUESTS; i++) {
+    struct recent_request * recent = recent_requests + i;
+    if ((recent->request != NULL) &&
+        (recent->finished + ACACHE_COALESCE_MS > now) &&
+        (request_covers (&(recent->rd), rd)))
+      return 1;
+  }
+  return 0;
+}
+
+/* keep the request of a response that has sent all its messages */
+static void remember_request (struct response * r, unsigned long long int now)
+{
+  if ((r->local_request) || (r->request == NULL))
+    return;
+  struct recent_request * recent = recent_requests + next_recent;
+  next_recent = (next_recent + 1) % RECENT_REQUESTS;
+  if (recent->request != NULL)
+    free (recent->request);
+  recent->request = r->request;
+  recent->rd = r->rd;
+  recent->finished = now;
+  r->request = NULL;   /* so end_response does not free it */
 }
 
-static void resend_message (char * message, int msize, int64_t position,
-                            int *priorityp, int local_request, int sock)
+/* how many messages to send at once, and how many to take from each
+ * response before going on to the next one */
+#define RESPONSE_BATCH		32
+#define RESPONSE_QUANTUM	4
+
+/* send up to RESPONSE_BATCH messages from the responses in progress,
+ * taking turns so that a long response does not hold up the others.
+ * Called from main_loop, which receives more messages between batches */
+static void send_responses (int sock)
 {
-  int priority = *priorityp;
+  if (responses_in_use <= 0)
+    return;
+  /* messages are sent from where they are, in the hot cache, the staging
+   * buffer, or the segment mapping, none of which change until after the
+   * send.  They are only copied if read with pread, or so local requests
+   * can change max_hops */
+  static char buffers [RESPONSE_BATCH] [ALLNET_MTU];
+  const char * messages [RESPONSE_BATCH];
+  int mlens [RESPONSE_BATCH];
+  int priorities [RESPONSE_BATCH];
+  /* misses are only added to the hot cache after sending, since adding
+   * may evict hot entries still to be sent */
+  struct hash_entry * misses [RESPONSE_BATCH];
+  int miss_index [RESPONSE_BATCH];
+  int miss_local [RESPONSE_BATCH];
+  char * miss_data [RESPONSE_BATCH];   /* NULL if read with pread */
+  int num_misses = 0;
+  static int turn = 0;   /* the response that goes first */
+  unsigned long long int now = allnet_time_ms ();
+  int n = 0;
+  int progress = 1;
+  while ((progress) && (n < RESPONSE_BATCH)) {
+    progress = 0;
+    int i;
+    for (i = 0; (i < MAX_RESPONSES) && (n < RESPONSE_BATCH); i++) {
+      struct response * r = responses + ((turn + i) % MAX_RESPONSES);
+      int quantum = RESPONSE_QUANTUM;
+      while ((r->in_use) && (quantum > 0) && (n < RESPONSE_BATCH) &&
+             (response_ready (r, now))) {
+        struct hash_entry * entry = response_next (r);
+        if (entry == NULL) {
+          remember_request (r, now);
+          end_response (r);
+          break;
+        }
+        if ((! r->local_request) && (hot_sent_within ((char *) (entry->id),
+                                                      now)))
+          continue;   /* our neighbors just got it */
+        int msize;
+        char * message = hot_find ((char *) (entry->id), &msize);
+        int copy = r->local_request;
+        if (message == NULL) {
+          if ((assign_matching (entry, &message, &msize, NULL, NULL, NULL) < 0)
+              || (msize > ALLNET_MTU))
+            continue;
+          miss_data [num_misses] = message;
+          if (! msg_data_is_mapped (entry->file_position)) {
+            miss_data [num_misses] = NULL;
+            copy = 1;
+          }
+          misses [num_misses] = entry;
+          miss_local [num_misses] = r->local_request;
+          miss_index [num_misses++] = n;
+        } else if (! r->local_request) {
+          hot_mark_sent ((char *) (entry->id), now);
+        }
+        if (copy) {
+          memcpy (buffers [n], message, msize);
+          message = buffers [n];
+        }
+        if (r->local_request) {  /* only forward locally */
+          struct allnet_header * send_hp = (struct allnet_header *) message;
+          send_hp->max_hops = send_hp->hops;
+        }
+        messages [n] = message;
+        mlens [n] = msize;
+        priorities [n] = r->priority;
+        if (r->priority > ALLNET_PRIORITY_EPSILON)
+          r->priority--;
+        if (r->requester >= 0)
+          requesters [r->requester].tokens -= 1;
+        n++;
+        quantum--;
+        progress = 1;
+      }
+    }
+  }
+  turn = (turn + 1) % MAX_RESPONSES;
+  if (n <= 0)
+    return;
   snprintf (log_buf, LOG_SIZE,
-            "sending %d-byte cached response at [%" PRId64 "]\n",
-            msize, position);
+            "sending %d cached responses, %d responses in progress\n",
+            n, responses_in_use);
   log_print ();
-  struct allnet_header * send_hp = (struct allnet_header *) message;
-  int saved_max = send_hp->max_hops;
-  if (local_request)  /* only forward locally */
-    send_hp->max_hops = send_hp->hops;
-  /* send, no need to even check the return value of send_pipe_message */
-  send_pipe_message (sock, message, msize, priority);
-  if (local_request)  /* restore the packet as it was */
-    send_hp->max_hops = saved_max;
-  if (priority > ALLNET_PRIORITY_EPSILON)
-    *priorityp = priority - 1;
+  /* send, no need to even check the return value of send_pipe_multiple */
+  send_pipe_multiple (sock, n, messages, mlens, priorities);
+  int i;
+  for (i = 0; i < num_misses; i++) {
+    int m = miss_index [i];
+    char * message = miss_data [i];
+    int msize = mlens [m];
+    if ((message == NULL) &&   /* buffers [m] may have a changed max_hops */
+        (assign_matching (misses [i], &message, &msize, NULL, NULL, NULL) < 0))
+      continue;
+    hot_add ((char *) (misses [i]->id), message, msize);
+    if (! miss_local [i])
+      hot_mark_sent ((char *) (misses [i]->id), now);
+  }
 }
 
-/* returns the number of responses sent, or 0 */
-static int respond_to_request (int fd, int max_size, char * in_message,
-                               int in_msize, int sock)
+/* returns the number of messages that may be sent in response, or 0 */
+/* for a request that is not empty, the response only looks at the messages
+ * in the index with the fewest candidates: the messages received since the
+ * request's time, or the buckets matching its destination or source
+ * bitmap.  Empty requests look at all the messages, newest first */
+static int respond_to_request (char * in_message, int in_msize)
 {
-  int local_request = 0;
   struct allnet_header * hp = (struct allnet_header *) (in_message);
-  if (hp->hops == 0)   /* local request, do not forward elsewhere */
-    local_request = 1;
-  
-  unsigned long long int limit = limit_resources (local_request);
-  if (limit == 0)
+  if (hp->hops > 0) {
+    struct request_details in_rd;   /* points into in_message */
+    build_request_details (in_message, in_msize, &in_rd);
+    if (request_coalesced (&in_rd, allnet_time_ms ())) {
+      coalesced++;
+      snprintf (log_buf, LOG_SIZE,
+                "data request coalesced with an earlier one (%llu)\n",
+                coalesced);
+      log_print ();
+      return 0;
+    }
+  }
+  /* local request, do not forward elsewhere */
+  struct response * r = new_response (hp, (hp->hops == 0));
+  if (r == NULL)
     return 0;
-
-  struct request_details rd;
-  build_request_details (in_message, in_msize, &rd);
-  int count = 0;
-  int64_t position = 0;
-  char * message;
-  int msize = 0;
-  int priority = ALLNET_PRIORITY_CACHE_RESPONSE;
-  /* limit responses to 10ms.  There is probably a better way to do this */
-  while ((local_request || (allnet_time_ms () < limit)) &&
-         ((position = list_next_matching (fd, max_size, position, &rd,
-                                          &message, &msize)) > 0)) {
-    resend_message (message, msize, position, &priority, local_request, sock);
-    count++;
+  r->request = malloc_or_fail (in_msize, "respond_to_request");
+  memcpy (r->request, in_message, in_msize);
+  struct request_details * rd = &(r->rd);
+  build_request_details (r->request, in_msize, rd);
+  int best = entries_in_use;
+  if (! rd->empty) {
+    int n = index_candidates (INDEX_DST, rd->dpower_two, rd->dbits,
+                              rd->dbitmap);
+    if (n < best) {
+      r->which = INDEX_DST;
+      best = n;
+    }
+    n = index_candidates (INDEX_SRC, rd->spower_two, rd->sbits, rd->sbitmap);
+    if (n < best) {
+      r->which = INDEX_SRC;
+      best = n;
+    }
+    if (rd->since != NULL) {   /* count the newer messages, up to best */
+      uint64_t since = readb64u (rd->since);
+      struct hash_entry * entry = newest_entry;
+      for (n = 0; (n < best) && (entry != NULL) &&
+                  (readb64u (entry->received_at) >= since); n++)
+        entry = entry->older;
+      if (n < best) {
+        r->which = -1;
+        r->since = since;
+        best = n;
+      }
+    }
   }
-  snprintf (log_buf, LOG_SIZE, "respond_to_request: sent %d\n", count);
-  log_print ();
-  return count;
+  if (r->which < 0)
+    r->next = newest_entry;
+  if (best <= 0)
+    end_response (r);
+  return best;
 }
 
-/* returns the number of responses sent, or 0 */
+/* returns the number of messages that will be sent in response, or 0 */
 /* if any of the ids in the request are not found, also sends onwards
  * the message (unless it was sent locally and with max_hops > 0), with
  * only those ids that were not found */
-static int respond_to_id_request (int fd, int max_size, char * in_message,
-                                  int in_msize, int sock)
+static int respond_to_id_request (char * in_message, int in_msize, int sock)
 {
   struct allnet_header * in_hp = (struct allnet_header *) (in_message);
   struct allnet_mgmt_header * amhp = (struct allnet_mgmt_header *)
@@ -1236,27 +2637,22 @@ static int respond_to_id_request (int fd, int max_size, char * in_message,
     local_request = 1;
     sent_locally = (in_hp->max_hops == 0);
   }
-  unsigned long long int limit = limit_resources (local_request);
-  if (limit == 0)
-    return 0;
+  struct response * r = NULL;
+  if (! local_request) {
+    r = new_response (in_hp, 0);
+    if (r != NULL)
+      r->ids = malloc_or_fail (n * MESSAGE_ID_SIZE, "respond_to_id_request");
+  }
 
   int forward_missing = (! local_request) || sent_locally;
   int nmissing = 0;
-  int nsent = 0;
-  int priority = ALLNET_PRIORITY_CACHE_RESPONSE;
 
   int i;
   for (i = 0; i < n; i++) {
     char *id = (char *) (amirp->ids + i * MESSAGE_ID_SIZE);
-    char * message;
-    int msize = 0;
-    int position = 0;
-    if ((! local_request) && (allnet_time_ms () < limit) &&
-        ((position = hash_get_next (fd, max_size, 0, id, &message, &msize,
-                                    NULL, NULL, NULL)) >= 0)) {
-      resend_message (message, msize, position, &priority, local_request, sock);
-      nsent++;
-    } else if (forward_missing) {
+    if ((r != NULL) && (hash_find (id) != NULL)) {
+      memcpy (r->ids + (r->num_ids++) * MESSAGE_ID_SIZE, id, MESSAGE_ID_SIZE);
+    } else if ((forward_missing) && (in_shard (id))) {
       /* copy the id to the left, so we can send it as a shorter packet */
       memcpy (amirp->ids + nmissing * MESSAGE_ID_SIZE, id, MESSAGE_ID_SIZE);
       nmissing++;
@@ -1266,15 +2662,168 @@ static int respond_to_id_request (int fd, int max_size, char * in_message,
     writeb16u (amirp->n, nmissing);
     int send_size = ALLNET_ID_REQ_SIZE (in_hp->transport, nmissing);
   /* send, no need to even check the return value of send_pipe_message */
-    send_pipe_message (sock, in_message, send_size, priority);
+    send_pipe_message (sock, in_message, send_size,
+                       ALLNET_PRIORITY_CACHE_RESPONSE);
   }
-  return nsent;
+  if (r == NULL)
+    return 0;
+  int found = r->num_ids;
+  if (found <= 0)
+    end_response (r);
+  return found;
+}
+
+/* the size of the first summary we send, and how often we send it */
+#define ACACHE_SUMMARY_POWER	5
+#define ACACHE_SUMMARY_SECONDS	300
+
+/* send a summary of the IDs in the cache to our neighbors (max_hops 1).
+ * The summary covers all the shards, so only shard 0 sends it */
+static void send_id_summary (int power_two, int sock)
+{
+  if (shard != 0)
+    return;
+  int hsize = ALLNET_ID_SUMMARY_SIZE (0, power_two);
+  int size = 0;
+  struct allnet_header * hp =
+    create_packet (hsize - ALLNET_SIZE (0), ALLNET_TYPE_MGMT, 1,
+                   ALLNET_SIGTYPE_NONE, NULL, 0, NULL, 0, NULL, NULL, &size);
+  if ((hp == NULL) || (size != hsize)) {
+    snprintf (log_buf, LOG_SIZE,
+              "send_id_summary error: size %d, expected %d\n", size, hsize);
+    log_print ();
+    if (hp != NULL)
+      free (hp);
+    return;
+  }
+  char * packet = (char *) hp;
+  struct allnet_mgmt_header * mp =
+    (struct allnet_mgmt_header *) (packet + ALLNET_SIZE (hp->transport));
+  mp->mgmt_type = ALLNET_MGMT_ID_SUMMARY;
+  struct allnet_mgmt_id_summary * sp = (struct allnet_mgmt_id_summary *)
+    (packet + ALLNET_MGMT_HEADER_SIZE (hp->transport));
+  sp->power_two = power_two;
+  int csize = hsize - (((char *) (sp->cells)) - packet);
+  iblt_encode (power_two, (char *) (sp->cells), csize);
+  snprintf (log_buf, LOG_SIZE, "sending %d-byte summary of %d ids\n",
+            size, entries_in_use);
+  log_print ();
+  send_pipe_message_free (sock, packet, size, ALLNET_PRIORITY_CACHE_RESPONSE);
+}
+
+/* ask our neighbors for the messages with these ids */
+static void send_id_request (char * ids, int n, int sock)
+{
+  int hsize = ALLNET_ID_REQ_SIZE (0, n);
+  int size = 0;
+  struct allnet_header * hp =
+    create_packet (hsize - ALLNET_SIZE (0), ALLNET_TYPE_MGMT, 1,
+                   ALLNET_SIGTYPE_NONE, NULL, 0, NULL, 0, NULL, NULL, &size);
+  if ((hp == NULL) || (size != hsize)) {
+    snprintf (log_buf, LOG_SIZE,
+              "send_id_request error: size %d, expected %d\n", size, hsize);
+    log_print ();
+    if (hp != NULL)
+      free (hp);
+    return;
+  }
+  char * packet = (char *) hp;
+  struct allnet_mgmt_header * mp =
+    (struct allnet_mgmt_header *) (packet + ALLNET_SIZE (hp->transport));
+  mp->mgmt_type = ALLNET_MGMT_ID_REQUEST;
+  struct allnet_mgmt_id_request * amirp = (struct allnet_mgmt_id_request *)
+    (packet + ALLNET_MGMT_HEADER_SIZE (hp->transport));
+  writeb16u (amirp->n, n);
+  memcpy (amirp->ids, ids, n * MESSAGE_ID_SIZE);
+  send_pipe_message_free (sock, packet, size, ALLNET_PRIORITY_CACHE_RESPONSE);
+}
+
+/* returns the number of messages that will be sent in response, or 0 */
+/* a summary from a neighbor is compared to our own: we send the messages
+ * that only we have, and request the ones that only they have.  If the
+ * difference is too large, we reply with a larger summary of our own.
+ * An empty local summary means a local application wants us to send
+ * our summary now */
+static int respond_to_id_summary (char * in_message, int in_msize, int sock)
+{
+  struct allnet_header * in_hp = (struct allnet_header *) (in_message);
+  int hsize = ALLNET_MGMT_HEADER_SIZE (in_hp->transport);
+  if (in_msize < hsize + sizeof (struct allnet_mgmt_id_summary))
+    return 0;
+  struct allnet_mgmt_header * amhp =
+    (struct allnet_mgmt_header *) (in_message + ALLNET_SIZE (in_hp->transport));
+  if (amhp->mgmt_type != ALLNET_MGMT_ID_SUMMARY)
+    return 0;
+  struct allnet_mgmt_id_summary * sp =
+    (struct allnet_mgmt_id_summary *) (in_message + hsize);
+  int power_two = sp->power_two;
+  if (in_hp->hops == 0) {   /* local request */
+    if (in_msize == hsize + sizeof (struct allnet_mgmt_id_summary))
+      send_id_summary (ACACHE_SUMMARY_POWER, sock);
+    return 0;
+  }
+  if ((power_two < ALLNET_ID_SUMMARY_MIN_POWER) ||
+      (power_two > ALLNET_ID_SUMMARY_MAX_POWER) ||
+      (in_msize < ALLNET_ID_SUMMARY_SIZE (in_hp->transport, power_two)))
+    return 0;
+  struct response * r = new_response (in_hp, 0);
+  if (r == NULL)
+    return 0;
+#define MAX_DIFFERENCES	(ALLNET_ID_SUMMARY_PARTS << ALLNET_ID_SUMMARY_MAX_POWER)
+  static char only_here [MAX_DIFFERENCES * MESSAGE_ID_SIZE];
+  static char only_there [MAX_DIFFERENCES * MESSAGE_ID_SIZE];
+  int nhere = 0;
+  int nthere = 0;
+  char * cells = (char *) (sp->cells);
+  int found = iblt_decode (power_two, cells, in_msize - (cells - in_message),
+                           only_here, &nhere, only_there, &nthere,
+                           MAX_DIFFERENCES);
+#undef MAX_DIFFERENCES
+  if (found <= 0) {
+    snprintf (log_buf, LOG_SIZE, "unable to compare %d-cell summary (%d)\n",
+              ALLNET_ID_SUMMARY_PARTS << power_two, found);
+    log_print ();
+    if ((found == 0) && (power_two < ALLNET_ID_SUMMARY_MAX_POWER))
+      send_id_summary (power_two + 1, sock);
+    end_response (r);
+    return 0;
+  }
+  /* the summary covers all the shards, so only send the messages we
+   * have, and only request the IDs in our own shard */
+  int nsend = 0;
+  int nrequest = 0;
+  int i;
+  for (i = 0; i < nhere; i++) {
+    char * id = only_here + i * MESSAGE_ID_SIZE;
+    if (hash_find (id) != NULL)
+      memmove (only_here + (nsend++) * MESSAGE_ID_SIZE, id, MESSAGE_ID_SIZE);
+  }
+  for (i = 0; i < nthere; i++) {
+    char * id = only_there + i * MESSAGE_ID_SIZE;
+    if (in_shard (id))
+      memmove (only_there + (nrequest++) * MESSAGE_ID_SIZE, id,
+               MESSAGE_ID_SIZE);
+  }
+  nhere = nsend;
+  nthere = nrequest;
+  if (nhere > 0) {
+    r->ids = malloc_or_fail (nhere * MESSAGE_ID_SIZE, "respond_to_id_summary");
+    memcpy (r->ids, only_here, nhere * MESSAGE_ID_SIZE);
+    r->num_ids = nhere;
+  } else {
+    end_response (r);
+  }
+  if (nthere > 0)
+    send_id_request (only_there, nthere, sock);
+  snprintf (log_buf, LOG_SIZE,
+            "summary: sending %d, requested %d\n", nhere, nthere);
+  log_print ();
+  return nhere;
 }
 
 
 /* save the ack, and delete any matching packets */
-static void ack_packets (int msg_fd, int msg_size, int ack_fd,
-                         char * in_message, int in_msize)
+static void ack_packets (int ack_fd, char * in_message, int in_msize)
 {
   struct allnet_header * hp = (struct allnet_header *) in_message;
   char * ack = ALLNET_DATA_START (hp, hp->transport, in_msize);
@@ -1283,21 +2832,24 @@ static void ack_packets (int msg_fd, int msg_size, int ack_fd,
   while (in_msize >= MESSAGE_ID_SIZE) {
     char hash [MESSAGE_ID_SIZE];
     sha512_bytes (ack, MESSAGE_ID_SIZE, hash, MESSAGE_ID_SIZE);
-    ack_add (ack, hash, ack_fd);
-    /* delete any message corresponding to this ack */
-    int position = 0;
+    if (in_shard (hash))
+      ack_add (ack, hash, ack_fd);
+    /* delete any message corresponding to this ack, even in another
+     * shard, since it may have been saved before there were shards */
+    int64_t position = 0;
     char * message;
     int msize;
     int id_off;
     while ((position =
-              hash_get_next (msg_fd, msg_size, position, hash,
+              hash_get_next (position, hash,
                              &message, &msize, &id_off, NULL, NULL)) > 0) {
-      int current_pos = next_prev_position (position, msize);
+      int64_t current_pos = next_prev_position (position, msize);
       snprintf (log_buf, LOG_SIZE,
-                "acking %d-byte cached response at [%d]\n", msize, current_pos);
+                "acking %d-byte cached response at [%" PRId64 "]\n",
+                msize, current_pos);
       log_print ();
       char * id = message + id_off;
-      remove_cached_message (msg_fd, msg_size, id, current_pos, msize);
+      remove_cached_message (id, current_pos, msize);
       count++;
     }
     ack += MESSAGE_ID_SIZE;
@@ -1307,46 +2859,196 @@ static void ack_packets (int msg_fd, int msg_size, int ack_fd,
   log_print ();
 }
 
-static void init_msgs (int msg_fd, int max_msg_size)
+/* open the segments saved by an earlier run, and make the newest active */
+static void init_segments (int64_t max_size)
+{
+  segment_size = max_size / 16;
+  if (segment_size < MIN_SEGMENT_SIZE)
+    segment_size = MIN_SEGMENT_SIZE;
+  if (segment_size > MAX_SEGMENT_SIZE)
+    segment_size = MAX_SEGMENT_SIZE;
+  num_segments = 4 * (max_size / segment_size) + 4;
+  /* an earlier run with a larger max_size may have left more segments */
+  char * dir_name = segment_name (0);
+  char * slash = ((dir_name == NULL) ? NULL : strrchr (dir_name, '/'));
+  if (slash != NULL) {
+    *slash = '\0';
+    DIR * dir = opendir (dir_name);
+    struct dirent * ent;
+    while ((dir != NULL) && ((ent = readdir (dir)) != NULL)) {
+      int n;
+      char extra;
+      if ((sscanf (ent->d_name, "segment.%d%c", &n, &extra) == 1) &&
+          (n >= num_segments) && (n < 100000))
+        num_segments = n + 1;
+    }
+    if (dir != NULL)
+      closedir (dir);
+  }
+  if (dir_name != NULL)
+    free (dir_name);
+  segments = malloc_or_fail (sizeof (struct segment) * num_segments,
+                             "acache segments");
+  int n;
+  for (n = 0; n < num_segments; n++) {
+    struct segment * s = segments + n;
+    s->fd = -1;
+    s->seq = 0;
+    s->size = 0;
+    s->map = NULL;
+    s->unsynced = 0;
+    s->indexed = 0;
+    char * name = segment_name (n);
+    if (name == NULL)
+      continue;
+    int fd = open (name, O_RDWR);
+    char header [SEGMENT_HEADER_SIZE];
+    if ((fd >= 0) &&
+        (read_at_pos (fd, header, SEGMENT_HEADER_SIZE, 0) ==
+         SEGMENT_HEADER_SIZE)) {
+      s->fd = fd;
+      s->seq = readb64 (header);
+      s->size = fd_size (fd);
+      if (s->size > segment_size)   /* from a run with a larger max_size */
+        segment_size = s->size;
+      if (s->seq >= next_seq)
+        next_seq = s->seq + 1;
+      if ((active < 0) || (s->seq > segments [active].seq))
+        active = n;
+      cache_bytes += s->size;
+    } else if (fd >= 0) {   /* not a valid segment */
+      close (fd);
+      unlink (name);
+    }
+    free (name);
+  }
+  for (n = 0; n < num_segments; n++)
+    if (segments [n].fd >= 0)
+      map_segment (n);
+  snprintf (log_buf, LOG_SIZE,
+            "%d segments of up to %d bytes, %" PRId64 " bytes in use\n",
+            num_segments, (int) segment_size, cache_bytes);
+  log_print ();
+}
+
+/* the single message file used before there were segments.  It is
+ * opened before the shards start, so every shard can import the messages
+ * in its own shard, even after shard 0 has deleted the file */
+static int message_file_fd = -1;
+
+static void open_message_file ()
+{
+  char * name = NULL;
+  if (config_file_name ("acache", "messages", &name) < 0)
+    return;
+  message_file_fd = open (name, O_RDONLY);
+  free (name);
+}
+
+/* move the messages in this shard from the message file into the
+ * segments.  Shard 0 then deletes the file */
+static void import_message_file (int64_t max_size)
+{
+  int fd = message_file_fd;
+  if (fd >= 0) {
+    off_t size = fd_size (fd);
+    off_t position = 0;
+    int count = 0;
+    while (position + MESSAGE_ENTRY_HEADER_SIZE < size) {
+      char entry [MAX_MESSAGE_ENTRY_SIZE];
+      int r = read_at_pos (fd, entry, sizeof (entry), position);
+      int msize = readb16 (entry + MESSAGE_ENTRY_HEADER_MSIZE_OFFSET);
+      int id_off = readb16 (entry + MESSAGE_ENTRY_HEADER_IDOFF_OFFSET);
+      if ((r < MESSAGE_ENTRY_HEADER_SIZE) || (msize <= 0) ||
+          (msize > ALLNET_MTU) || (MESSAGE_ENTRY_HEADER_SIZE + msize > r))
+        break;
+      char * id = entry + MESSAGE_ENTRY_HEADER_SIZE + id_off;
+      if ((id_off != 0) && (id_off + MESSAGE_ID_SIZE <= msize) &&
+          (in_shard (id)) && (hash_find (id) == NULL)) {
+        store_entry (max_size, entry, MESSAGE_ENTRY_HEADER_SIZE + msize);
+        count++;
+      }
+      position += MESSAGE_ENTRY_HEADER_SIZE + msize;
+    }
+    close (fd);
+    message_file_fd = -1;
+    flush_staging ();
+    snprintf (log_buf, LOG_SIZE, "moved %d messages to segments\n", count);
+    log_print ();
+    char * name = NULL;
+    if ((shard == 0) && (config_file_name ("acache", "messages", &name) >= 0)) {
+      unlink (name);
+      free (name);
+    }
+  }
+}
+
+static void init_msgs (int64_t max_msg_size)
 {
   init_hash_table (max_msg_size);
-  int read_position = 0;
+  init_segments (max_msg_size);
   int count = 0;
   char * message;
   int msize;
   int id_off;
   int priority;
   char time [ALLNET_TIME_SIZE];
-  while ((read_position =
-            get_next_message (msg_fd, max_msg_size, read_position, NULL,
-                              &message, &msize, &id_off, &priority, time))
-         > 0) {
-    char *  id = message + id_off;
-    if ((msize > 0) && (msize <= ALLNET_MTU) && (id_off != 0) &&
-        (message_hash_free != NULL)) {
+  /* add the oldest segments first, so index_add finds each message's
+   * place in the time list right away */
+  uint64_t seq = 0;
+  int indexed = 0;
+  int n;
+  if (active >= 0)   /* more messages will be added, so no index */
+    unlink_segment_index (active);
+  while ((n = oldest_segment (seq, 0)) >= 0) {
+    seq = segments [n].seq + 1;
+    if (n != active) {
+      int loaded = load_segment_index (n);
+      if (loaded >= 0) {
+        count += loaded;
+        indexed++;
+        continue;
+      }
+    }
+    int64_t end = segment_position (n + 1, 0);
+    int64_t read_position = segment_position (n, 0);
+    while (((read_position =
+               get_next_message (read_position, NULL, &message, &msize,
+                                 &id_off, &priority, time)) > 0) &&
+           (next_prev_position (read_position, msize) < end)) {
+      char *  id = message + id_off;
+      if ((message_has_id (message, msize, id_off)) &&
+          (message_hash_free != NULL)) {
 #ifdef USING_MESSAGE_LIST
-      list_add_message (id);
+        list_add_message (id);
 #endif /* USING_MESSAGE_LIST */
-      hash_add_message (message, msize, id,
-                        next_prev_position (read_position, msize), time);
-      count++;
+        hash_add_message (message, msize, id,
+                          next_prev_position (read_position, msize), time);
+        count++;
+      }
     }
+    write_segment_index (n);   /* so the next startup can use the index */
   }
-  snprintf (log_buf, LOG_SIZE, "init almost done, %d %d %d, ",
-            msg_fd, (int) (fd_size (msg_fd)), max_msg_size);
+  snprintf (log_buf, LOG_SIZE, "%d segments loaded from their index\n",
+            indexed);
+  log_print ();
+  snprintf (log_buf, LOG_SIZE, "init almost done, %" PRId64 " %" PRId64 ", ",
+            cache_bytes, max_msg_size);
   log_print ();
   print_stats (0, count);
-  while (fd_size (msg_fd) > max_msg_size) {
-    snprintf (log_buf, LOG_SIZE, "message file %d, max %d, gc'ing",
-              (int) (fd_size (msg_fd)), max_msg_size);
+  import_message_file (max_msg_size);
+  int passes = 0;
+  while ((cache_bytes > max_msg_size) && (passes++ < num_segments)) {
+    snprintf (log_buf, LOG_SIZE, "messages %" PRId64 ", max %" PRId64
+              ", gc'ing\n", cache_bytes, max_msg_size);
     log_print ();
-    gc (msg_fd, max_msg_size);
+    gc (max_msg_size, 0);
   }
   snprintf (log_buf, LOG_SIZE, "after init, ");
   print_stats (0, -1);
 }
 
-static void init_acache (int * msg_fd, int * max_msg_size,
+static void init_acache (int64_t * max_msg_size,
                          int * ack_fd, int * max_acks, int * local_caching)
 {
   /* either read or create ~/.allnet/acache/sizes */
@@ -1378,7 +3080,7 @@ static void init_acache (int * msg_fd, int * max_msg_size,
     if ((n > 0) && (n < sizeof (buffer))) {
       char yesno [10] = "no";
       buffer [n] = '\0';
-      sscanf (buffer, "%d\n%d\n %c", max_msg_size, max_acks, yesno);
+      sscanf (buffer, "%" SCNd64 "\n%d\n %c", max_msg_size, max_acks, yesno);
       *local_caching = 1;
       if (tolower (yesno [0]) == 'n')
         *local_caching = 0;
@@ -1392,33 +3094,67 @@ static void init_acache (int * msg_fd, int * max_msg_size,
     }
   }
   close (fd);
-  /* open (and possibly create) ~/.allnet/acache/messages and acks */
-  *msg_fd = open_rw_config ("acache", "messages", 1);
-  *ack_fd = open_rw_config ("acache", "acks", 1);
-  if ((*msg_fd < 0) || (*ack_fd < 0)) {
-    snprintf (log_buf, LOG_SIZE,
-              "error, message FD %d, ack FD %d\n", *msg_fd, *ack_fd);
+  if (num_shards > 1) {
+    *max_msg_size /= num_shards;
+    *max_acks /= num_shards;
+    response_rate /= num_shards;
+    response_burst /= num_shards;
+    snprintf (log_buf, LOG_SIZE, "shard %d of %d, in %s\n",
+              shard, num_shards, acache_dir);
+    log_print ();
+  }
+  init_durability ();
+  /* open (and possibly create) ~/.allnet/acache/acks and the segments */
+  *ack_fd = open_rw_config (acache_dir, "acks", 1);
+  if (*ack_fd < 0) {
+    snprintf (log_buf, LOG_SIZE, "error, ack FD %d\n", *ack_fd);
     log_print ();
-    printf ("error, message FD %d, ack FD %d\n", *msg_fd, *ack_fd);
+    printf ("error, ack FD %d\n", *ack_fd);
   }
   if (*ack_fd >= 0)
     init_acks (*ack_fd, *max_acks);
-  if (*msg_fd >= 0)
-    init_msgs (*msg_fd, *max_msg_size);
+  init_msgs (*max_msg_size);
 }
 
+/* how often to log the statistics */
+#define ACACHE_STATS_SECONDS	600
+
 static void main_loop (int sock)
 {
-  int msg_fd;
-  int max_msg_size;
+  int64_t max_msg_size;
   int ack_fd;
   int max_acks;
   int local_caching = 0;
-  init_acache (&msg_fd, &max_msg_size, &ack_fd, &max_acks, &local_caching);
+  init_acache (&max_msg_size, &ack_fd, &max_acks, &local_caching);
+  unsigned long long int next_summary = allnet_time_ms ();
+  time_t next_stats = time (NULL) + ACACHE_STATS_SECONDS;
   while (1) {
     char * message;
     int priority;
-    int result = receive_pipe_message (sock, &message, &priority);
+    /* wait for a message, until the staged messages must be written,
+     * until it is time to send our summary, or until more responses
+     * can be sent */
+    unsigned long long int now = allnet_time_ms ();
+    if (now >= next_summary) {
+      send_id_summary (ACACHE_SUMMARY_POWER, sock);
+      next_summary = now + ACACHE_SUMMARY_SECONDS * 1000;
+    }
+    int timeout = next_summary - now;
+    if (staging_deadline != 0) {
+      if (now >= staging_deadline) {
+        flush_staging ();
+      } else if (staging_deadline - now < timeout) {
+        timeout = staging_deadline - now;
+      }
+    }
+    send_responses (sock);
+    int response_timeout = responses_timeout ();
+    if ((response_timeout != PIPE_MESSAGE_WAIT_FOREVER) &&
+        (response_timeout < timeout))
+      timeout = response_timeout;
+    int result = receive_pipe_message_any (timeout, &message, NULL, &priority);
+    if (result == 0)
+      continue;   /* flushed or sent at the top of the loop */
     struct allnet_header * hp = (struct allnet_header *) message;
     /* unless we save it, free the message */
     int mfree = 1;
@@ -1426,6 +3162,7 @@ static void main_loop (int sock)
       snprintf (log_buf, LOG_SIZE, "ad pipe %d closed, result %d\n",
                 sock, result);
       log_print ();
+      flush_staging ();
       /* mfree = 0;  not useful */
       break;
     } else if ((result >= ALLNET_HEADER_SIZE) &&
@@ -1436,25 +3173,26 @@ priority = ALLNET_PRIORITY_EPSILON;
 }
       /* valid message from ad: save, respond, or ignore */
       if (hp->message_type == ALLNET_TYPE_DATA_REQ) { /* respond */
-        if (respond_to_request (msg_fd, max_msg_size, message, result, sock))
+        if (respond_to_request (message, result))
           snprintf (log_buf, LOG_SIZE, "responded to data request packet\n");
         else
           snprintf (log_buf, LOG_SIZE, "no response to data request packet\n");
       } else if (hp->message_type == ALLNET_TYPE_MGMT) {
-        if (respond_to_id_request (msg_fd, max_msg_size, message, result, sock))
+        if (respond_to_id_request (message, result, sock))
           snprintf (log_buf, LOG_SIZE, "responded to id request packet\n");
+        else if (respond_to_id_summary (message, result, sock))
+          snprintf (log_buf, LOG_SIZE, "responded to id summary packet\n");
         else
-          snprintf (log_buf, LOG_SIZE, "no response to id request packet\n");
+          snprintf (log_buf, LOG_SIZE, "no response to management packet\n");
       } else {   /* not a data request */
         if (hp->message_type == ALLNET_TYPE_ACK) {
           /* erase the message and save the ack */
-          ack_packets (msg_fd, max_msg_size, ack_fd, message, result);
+          ack_packets (ack_fd, message, result);
         } else if ((! local_caching) && (hp->hops == 0)) {
           snprintf (log_buf, LOG_SIZE, "not saving local packet\n");
         } else if (hp->transport & ALLNET_TRANSPORT_DO_NOT_CACHE) {
           snprintf (log_buf, LOG_SIZE, "did not save non-cacheable packet\n");
-        } else if (save_packet (msg_fd, max_msg_size,
-                                message, result, priority)) {
+        } else if (save_packet (max_msg_size, message, result, priority)) {
           mfree = 0;   /* saved, so do not free */
           snprintf (log_buf, LOG_SIZE, "saved packet type %d size %d pr %d\n",
                     hp->message_type, result, priority);
@@ -1470,14 +3208,69 @@ priority = ALLNET_PRIORITY_EPSILON;
       log_print ();
     }
     if (mfree)
-      free (message);
+      release_pipe_message (message);
+    if (time (NULL) >= next_stats) {
+      hot_log_stats ();
+      next_stats = time (NULL) + ACACHE_STATS_SECONDS;
+    }
+  }
+}
+
+/* reads the number of shards from ~/.allnet/acache/shards, if any */
+static int read_shards ()
+{
+  int fd = open_read_config ("acache", "shards", 0);
+  if (fd < 0)
+    return 1;
+  char buffer [100];
+  int n = read (fd, buffer, sizeof (buffer) - 1);
+  close (fd);
+  if (n <= 0)
+    return 1;
+  buffer [n] = '\0';
+  int shards = 1;
+  if ((sscanf (buffer, "%d", &shards) != 1) || (shards < 1))
+    return 1;
+  if (shards > MAX_SHARDS)
+    shards = MAX_SHARDS;
+  return shards;
+}
+
+/* start a process for each shard after the first, and set up this
+ * process as shard 0.  Each shard connects to ad on its own, and ends
+ * when ad closes the connection */
+static void start_shards ()
+{
+  int shards = read_shards ();
+  if ((shards <= 1) || (! iblt_init_shards (shards)))
+    return;
+  num_shards = shards;
+  int n;
+  for (n = 1; n < shards; n++) {
+    pid_t child = fork ();
+    if (child < 0) {
+      perror ("acache fork");
+      snprintf (log_buf, LOG_SIZE, "unable to start shard %d\n", n);
+      log_print ();
+      continue;   /* the IDs in this shard will not be cached */
+    }
+    if (child == 0) {
+      static char dir [100];
+      snprintf (dir, sizeof (dir), "acache/shard%d", n);
+      acache_dir = dir;
+      shard = n;
+      break;
+    }
   }
+  iblt_set_shard (shard);
 }
 
 void acache_main (char * pname)
 {
   /* printf ("sizeof struct hash_entry = %zd\n", sizeof (struct hash_entry));
               sizeof struct hash_entry = 56 */
+  open_message_file ();
+  start_shards ();
   int sock = connect_to_local ("acache", pname);
   main_loop (sock);
   snprintf (log_buf, LOG_SIZE, "end of acache\n");
@@ -4,12 +4,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "lib/packet.h"
 #include "lib/mgmt.h"
 #include "social.h"
 #include "track.h"
 #include "record.h"
+#include "verify.h"
+#include "adstats.h"
 #include "lib/pipemsg.h"
 #include "lib/priority.h"
 #include "lib/log.h"
@@ -19,28 +22,48 @@
 #define PROCESS_PACKET_LOCAL	2  /* only forward to alocal */
 #define PROCESS_PACKET_OUT	3  /* only forward to aip and the abc's */
 #define PROCESS_PACKET_ALL	4  /* forward to alocal, aip, and the abc's */
+#define PROCESS_PACKET_DEFERRED	5  /* being verified, will be forwarded later */
 
-/* compute a forwarding priority for non-local packets */
+/* signature verification threads, and the most packets queued for each */
+#define AD_VERIFY_MAX_THREADS	8
+#define AD_VERIFY_QUEUE		64
+static int verify_pipe = -1;   /* results from the verification threads */
+
+/* how often to log the statistics */
+#define AD_STATS_SECONDS	600
+/* the number of packets with each PROCESS_PACKET_ outcome */
+static unsigned long long int outcomes [PROCESS_PACKET_DEFERRED + 1];
+
+static int print_outcomes (char * buffer, int bsize)
+{
+  int n = snprintf (buffer, bsize,
+                    "outcomes: drop %llu, local %llu, out %llu, all %llu, "
+                    "deferred %llu\n",
+                    outcomes [PROCESS_PACKET_DROP],
+                    outcomes [PROCESS_PACKET_LOCAL],
+                    outcomes [PROCESS_PACKET_OUT],
+                    outcomes [PROCESS_PACKET_ALL],
+                    outcomes [PROCESS_PACKET_DEFERRED]);
+  if (n > bsize)
+    n = bsize;
+  return n;
+}
+
+static void log_stats ()
+{
+  print_outcomes (log_buf, LOG_SIZE);
+  log_print ();
+  record_print_stats (log_buf, LOG_SIZE);
+  log_print ();
+  adstats_log ();
+}
+
+/* compute a forwarding priority for non-local packets, given the result
+ * of verifying the signature, if any */
 static int packet_priority (char * packet, struct allnet_header * hp, int size,
-                            struct social_info * soc)
+                            int social_distance, int valid)
 {
-  int sig_size = 0;
-  if (hp->sig_algo != ALLNET_SIGTYPE_NONE)
-    sig_size = ((packet [size - 2] & 0xff) << 8) + (packet [size - 1] & 0xff);
-  int valid = 0;
-  int social_distance = UNKNOWN_SOCIAL_TIER;
   int rate_fraction = largest_rate ();
-  int hsize = ALLNET_SIZE (hp->transport);
-snprintf (log_buf, LOG_SIZE, "packet_priority (%d, %d + %d + 2 = %d <? %d)\n",
-hp->sig_algo, hsize, sig_size, (hsize + sig_size + 2), size); log_print ();
-  if ((sig_size > 0) && (hsize + sig_size + 2 < size)) {
-    char * verify = packet + hsize; 
-    int vsize = size - (hsize + sig_size + 2);
-    char * sig = packet + hsize + vsize;
-    social_distance =
-       social_connection (soc, verify, vsize, hp->source, hp->src_nbits,
-                          hp->sig_algo, sig, sig_size, &valid);
-  }
   if (valid)
     rate_fraction = track_rate (hp->source, hp->src_nbits, size);
   else
@@ -75,7 +98,8 @@ static int process_mgmt (char * message, int msize, int is_local,
   case ALLNET_MGMT_PEERS:
   case ALLNET_MGMT_DHT:
   case ALLNET_MGMT_ID_REQUEST:
-    if (is_local) {               /* from DHT daemon (idrq: acache or client) */
+  case ALLNET_MGMT_ID_SUMMARY:
+    if (is_local) {   /* from DHT daemon (idrq: acache or client, ids: acache) */
       return PROCESS_PACKET_OUT;  /* forward to the internet */
     } else {
       return PROCESS_PACKET_LOCAL;/* only forward to the DHT */
@@ -96,6 +120,9 @@ static int process_mgmt (char * message, int msize, int is_local,
     } else {
       return PROCESS_PACKET_OUT;          /* local packet, forward out */
     }
+  case ALLNET_MGMT_STATS_REQ:     /* local requests are answered earlier */
+  case ALLNET_MGMT_STATS:
+    return PROCESS_PACKET_DROP;   /* only for this machine */
   default:
     snprintf (log_buf, LOG_SIZE, "unknown management message type %d\n",
               ahm->mgmt_type);
@@ -105,33 +132,12 @@ static int process_mgmt (char * message, int msize, int is_local,
   }
 }
 
-/* return 0 to drop the packet (do nothing), 1 to process as a request packet,
- * 2 to forward only to local destinations, and 3 to forward everywhere */
-/* if returning 3, fills in priority */
-static int process_packet (char * packet, int size, int is_local,
+/* decide where to forward a packet whose priority is known */
+static int forward_packet (char * packet, int size, int is_local,
                            struct social_info * soc, int * priority)
 {
-  if (! is_valid_message (packet, size))
-    return PROCESS_PACKET_DROP;
-
-/* skip the hop count in the hash, since it changes at each hop */
-#define HEADER_SKIP	3
-  /* have we received this packet in the last minute?  if so, drop it */
-  int time = record_packet_time (packet + HEADER_SKIP, size - HEADER_SKIP, 0);
-#undef HEADER_SKIP
-  if ((time > 0) && (time < 60)) {
-    snprintf (log_buf, LOG_SIZE, 
-              "packet received in the last %d seconds, dropping\n", time);
-    log_print ();
-    return PROCESS_PACKET_DROP;     /* duplicate, ignore */
-  }
-
-  /* should be valid */
   struct allnet_header * ah = (struct allnet_header *) packet;
-
-  /* compute a forwarding priority for non-local packets */
   if (! is_local) {
-    *priority = packet_priority (packet, ah, size, soc);
     /* before forwarding, increment the number of hops seen */
     if (ah->hops < 255)   /* do not increment 255 to 0 */
       ah->hops++;
@@ -140,7 +146,9 @@ static int process_packet (char * packet, int size, int is_local,
   log_print ();
 
   if (ah->message_type == ALLNET_TYPE_MGMT) {     /* AllNet management */
+    unsigned long long int start = adstats_now ();
     int r = process_mgmt (packet, size, is_local, priority, soc);
+    adstats_time (AD_STAGE_MGMT, start);
     return r;
   }
 
@@ -161,8 +169,67 @@ static int process_packet (char * packet, int size, int is_local,
   return PROCESS_PACKET_ALL;
 }
 
+/* returns one of the PROCESS_PACKET_ codes, and fills in priority */
+/* signed packets are given to the verification threads, in which case
+ * PROCESS_PACKET_DEFERRED is returned */
+static int process_packet (char * packet, int size, int is_local,
+                           struct social_info * soc, int * priority)
+{
+  if (! is_valid_message (packet, size))
+    return PROCESS_PACKET_DROP;
+
+/* skip the hop count in the hash, since it changes at each hop */
+#define HEADER_SKIP	3
+  /* have we received this packet in the last minute?  if so, drop it */
+  unsigned long long int start = adstats_now ();
+  int time = record_packet_time (packet + HEADER_SKIP, size - HEADER_SKIP, 0);
+  adstats_time (AD_STAGE_RECORD, start);
+#undef HEADER_SKIP
+  if ((time > 0) && (time < 60)) {
+    snprintf (log_buf, LOG_SIZE, 
+              "packet received in the last %d seconds, dropping\n", time);
+    log_print ();
+    return PROCESS_PACKET_DROP;     /* duplicate, ignore */
+  }
+
+  /* should be valid */
+  struct allnet_header * ah = (struct allnet_header *) packet;
+
+  /* compute a forwarding priority for non-local packets */
+  if (! is_local) {
+    start = adstats_now ();
+    int social_distance = UNKNOWN_SOCIAL_TIER;
+    int valid = 0;
+    if (verify_pipe < 0) {   /* no verification threads, verify it here */
+      social_distance = verify_packet (soc, packet, size, &valid);
+    } else if (verify_needed (packet, size)) {
+      if (verify_submit (packet, size, *priority)) {
+        adstats_time (AD_STAGE_PRIORITY, start);
+        return PROCESS_PACKET_DEFERRED;
+      }
+      /* the queue is full, forward it as if it were not signed */
+      snprintf (log_buf, LOG_SIZE, "verification queue full\n");
+      log_print ();
+    }
+    *priority = packet_priority (packet, ah, size, social_distance, valid);
+    adstats_time (AD_STAGE_PRIORITY, start);
+  }
+  return forward_packet (packet, size, is_local, soc, priority);
+}
+
+/* for timing each pipe that send_all sends to */
+static int send_all_first = 0;   /* index of the first pipe sent to */
+static unsigned long long int send_all_start = 0;
+
+static void send_all_sent (int index)
+{
+  adstats_pipe_time (send_all_first + index, send_all_start);
+  send_all_start = adstats_now ();
+}
+
+/* first is the index in ad's pipes of write_pipes [0] */
 static void send_all (char * packet, int psize, int priority,
-                      int * write_pipes, int nwrite, char * desc)
+                      int * write_pipes, int nwrite, int first, char * desc)
 {
   int n = snprintf (log_buf, LOG_SIZE,
                     "send_all (%s) sending %d bytes priority %d to %d pipes: ",
@@ -172,15 +239,134 @@ static void send_all (char * packet, int psize, int priority,
     n += snprintf (log_buf + n, LOG_SIZE - n, "%d%s", write_pipes [i],
                    (((i + 1) < nwrite) ? ", " : "\n"));
   log_print ();
-  for (i = 0; i < nwrite; i++) {
-    if (! send_pipe_message (write_pipes [i], packet, psize, priority)) {
-      snprintf (log_buf, LOG_SIZE, "write_pipes [%d] = %d is no longer valid\n",
-                i, write_pipes [i]);
-      log_print ();
-    }
+  /* a slow pipe only fills its own queue, and does not hold up the others */
+  send_all_first = first;
+  send_all_start = adstats_now ();
+  int sent = send_pipe_message_all (write_pipes, nwrite, packet, psize,
+                                    priority, send_all_sent);
+  if (sent < nwrite) {
+    snprintf (log_buf, LOG_SIZE, "send_all (%s) only sent to %d of %d pipes\n",
+              desc, sent, nwrite);
+    log_print ();
+  }
+}
+
+static void send_packet (int p, char * packet, int psize, int priority,
+                         int npipes, int * write_pipes)
+{
+  if ((p > 0) && (p <= PROCESS_PACKET_DEFERRED))
+    outcomes [p]++;
+  unsigned long long int start = adstats_now ();
+  switch (p) {
+  case PROCESS_PACKET_ALL:
+    log_packet ("sending to all", packet, psize);
+    send_all (packet, psize, priority, write_pipes, npipes, 0, "all");
+    adstats_time (AD_STAGE_SEND_ALL, start);
+    break;
+  case PROCESS_PACKET_OUT:
+    log_packet ("sending out", packet, psize);
+/* alocal should be the first pipe, so just skip it */
+    send_all (packet, psize, priority, write_pipes + 1, npipes - 1, 1,
+              "out");
+    adstats_time (AD_STAGE_SEND_OUT, start);
+    break;
+  /* all the rest are not forwarded, so priority does not matter */
+  case PROCESS_PACKET_LOCAL:   /* send only to alocal */ 
+    log_packet ("sending to alocal", packet, psize);
+/* alocal should be the first pipe, so only write to that */
+    send_all (packet, psize, 0, write_pipes, 1, 0, "local");
+    adstats_time (AD_STAGE_SEND_LOCAL, start);
+    break;
+  case PROCESS_PACKET_DROP:    /* do not forward */
+    log_packet ("dropping packet", packet, psize);
+    /* do nothing */
+    break;
+  }
+}
+
+/* returns 1 for a stats request from a local application */
+static int is_stats_request (char * packet, int psize)
+{
+  struct allnet_header * hp = (struct allnet_header *) packet;
+  if ((! is_valid_message (packet, psize)) ||
+      (hp->message_type != ALLNET_TYPE_MGMT) ||
+      (psize < ALLNET_MGMT_HEADER_SIZE (hp->transport)))
+    return 0;
+  struct allnet_mgmt_header * mp =
+    (struct allnet_mgmt_header *) (packet + ALLNET_SIZE (hp->transport));
+  return (mp->mgmt_type == ALLNET_MGMT_STATS_REQ);
+}
+
+/* send the statistics to the local applications */
+static void send_stats (int * write_pipes)
+{
+  static char text [ALLNET_MTU / 2];
+  int tsize = print_outcomes (text, sizeof (text));
+  tsize += record_print_stats (text + tsize, sizeof (text) - tsize);
+  tsize += adstats_print (text + tsize, sizeof (text) - tsize);
+  int hsize = ALLNET_MGMT_HEADER_SIZE (0);
+  int size = 0;
+  struct allnet_header * hp =
+    create_packet (hsize + tsize - ALLNET_SIZE (0), ALLNET_TYPE_MGMT, 1,
+                   ALLNET_SIGTYPE_NONE, NULL, 0, NULL, 0, NULL, NULL, &size);
+  if ((hp == NULL) || (size != hsize + tsize)) {
+    snprintf (log_buf, LOG_SIZE, "send_stats error: size %d, expected %d\n",
+              size, hsize + tsize);
+    log_print ();
+    if (hp != NULL)
+      free (hp);
+    return;
   }
+  char * packet = (char *) hp;
+  struct allnet_mgmt_header * mp =
+    (struct allnet_mgmt_header *) (packet + ALLNET_SIZE (hp->transport));
+  mp->mgmt_type = ALLNET_MGMT_STATS;
+  memcpy (packet + hsize, text, tsize);
+  send_all (packet, size, ALLNET_PRIORITY_LOCAL, write_pipes, 1, 0, "stats");
+  free (packet);
 }
 
+static void handle_packet (char * packet, int psize, int is_local,
+                           int priority, struct social_info * soc,
+                           int npipes, int * write_pipes)
+{
+  /* answered before checking for duplicates, since requests are identical */
+  if ((is_local) && (is_stats_request (packet, psize))) {
+    send_stats (write_pipes);
+    return;
+  }
+  int p = process_packet (packet, psize, is_local, soc, &priority);
+  if (p != PROCESS_PACKET_DEFERRED)
+    send_packet (p, packet, psize, priority, npipes, write_pipes);
+  else
+    outcomes [p]++;
+}
+
+/* a packet from the verification threads is never local */
+static void handle_verified (char * message, int msize,
+                             struct social_info * soc,
+                             int npipes, int * write_pipes)
+{
+  struct verify_result * r = verify_result (message, msize);
+  if (r == NULL) {
+    snprintf (log_buf, LOG_SIZE, "bad verification result, size %d\n", msize);
+    log_print ();
+    return;
+  }
+  adstats_time (AD_STAGE_VERIFIED, r->submitted);
+  struct allnet_header * hp = (struct allnet_header *) (r->packet);
+  unsigned long long int start = adstats_now ();
+  int priority = packet_priority (r->packet, hp, r->psize,
+                                  r->social_distance, r->valid);
+  adstats_time (AD_STAGE_PRIORITY, start);
+  int p = forward_packet (r->packet, r->psize, 0, soc, &priority);
+  send_packet (p, r->packet, r->psize, priority, npipes, write_pipes);
+  verify_done (r);
+}
+
+/* how many messages to receive at once */
+#define AD_BATCH_MESSAGES	32
+
 /* runs forever, and only returns in case of error. */
 /* the first read_pipe and the first write_pipe are from/to alocal.
  * the second read_pipe and write_pipe are from/to aip
@@ -189,7 +375,8 @@ static void send_all (char * packet, int psize, int priority,
  * three and doesn't require the same number of read and write pipes
  */
 static void main_loop (int npipes, int * read_pipes, int * write_pipes,
-                       int update_seconds, int max_social_bytes, int max_checks)
+                       int update_seconds, int max_social_bytes, int max_checks,
+                       int verify_threads)
 {
   int i;
   for (i = 0; i < npipes; i++)
@@ -199,53 +386,62 @@ static void main_loop (int npipes, int * read_pipes, int * write_pipes,
 /* snprintf (log_buf, LOG_SIZE, "ad calling update_social\n"); log_print (); */
   time_t next_update = update_social (soc, update_seconds);
 /* snprintf (log_buf, LOG_SIZE, "ad finished update_social\n"); log_print ();*/
+  adstats_init_pipes (npipes);
+  verify_pipe = verify_start (soc, verify_threads, AD_VERIFY_QUEUE);
+  if (verify_pipe >= 0)
+    add_pipe (verify_pipe);
+
+  time_t next_stats = time (NULL) + AD_STATS_SECONDS;
 
+  static struct pipe_message msgs [AD_BATCH_MESSAGES];
+  static char arena [AD_BATCH_MESSAGES * ALLNET_MTU];
   while (1) {
     /* read messages from each of the pipes */
-    char * packet = NULL;
-    int from_pipe;
- /* incoming priorities ignored unless from local */
-    int priority = ALLNET_PRIORITY_EPSILON;
-    int psize = receive_pipe_message_any (PIPE_MESSAGE_WAIT_FOREVER,
-                                          &packet, &from_pipe, &priority);
-snprintf (log_buf, LOG_SIZE, "ad received %d, fd %d\n", psize, from_pipe);
-log_print ();
-    if (psize <= 0) { /* for now exit */
+    unsigned long long int start = adstats_now ();
+    int count = receive_pipe_messages_batch (PIPE_MESSAGE_WAIT_FOREVER, msgs,
+                                             AD_BATCH_MESSAGES,
+                                             arena, sizeof (arena));
+    adstats_time (AD_STAGE_RECEIVE, start);
+    if (count <= 0) { /* for now exit */
       snprintf (log_buf, LOG_SIZE,
-                "error: received %d from receive_pipe_message_any, pipe %d\n%s",
-                psize, from_pipe, "  exiting\n");
+                "error: received %d from receive_pipe_messages_batch\n%s",
+                count, "  exiting\n");
       log_print ();
       return;
     }
-    /* packets generated by alocal are local */
-    int is_local = (from_pipe == read_pipes [0]);
-    int p = process_packet (packet, psize, is_local, soc, &priority);
-    switch (p) {
-    case PROCESS_PACKET_ALL:
-      log_packet ("sending to all", packet, psize);
-      send_all (packet, psize, priority, write_pipes, npipes, "all");
-      break;
-    case PROCESS_PACKET_OUT:
-      log_packet ("sending out", packet, psize);
-/* alocal should be the first pipe, so just skip it */
-      send_all (packet, psize, priority, write_pipes + 1, npipes - 1, "out");
-      break;
-    /* all the rest are not forwarded, so priority does not matter */
-    case PROCESS_PACKET_LOCAL:   /* send only to alocal */ 
-      log_packet ("sending to alocal", packet, psize);
-/* alocal should be the first pipe, so only write to that */
-      send_all (packet, psize, 0, write_pipes, 1, "local");
-      break;
-    case PROCESS_PACKET_DROP:    /* do not forward */
-      log_packet ("dropping packet", packet, psize);
-      /* do nothing */
-      break;
+    int m;
+    for (m = 0; m < count; m++) {
+      char * packet = msgs [m].message;
+      int psize = msgs [m].mlen;
+      int from_pipe = msgs [m].from_pipe;
+snprintf (log_buf, LOG_SIZE, "ad received %d, fd %d\n", psize, from_pipe);
+log_print ();
+      if (psize <= 0) { /* for now exit */
+        snprintf (log_buf, LOG_SIZE,
+                  "error: received %d from receive_pipe_messages_batch, "
+                  "pipe %d\n%s", psize, from_pipe, "  exiting\n");
+        log_print ();
+        return;
+      }
+      if (from_pipe == verify_pipe) {
+        handle_verified (packet, psize, soc, npipes, write_pipes);
+        continue;
+      }
+      /* packets generated by alocal are local */
+      int is_local = (from_pipe == read_pipes [0]);
+      /* incoming priorities ignored unless from local */
+      handle_packet (packet, psize, is_local, msgs [m].priority, soc,
+                     npipes, write_pipes);
     }
-    free (packet);  /* was allocated by receive_pipe_message_any */
+    /* the messages are in the arena, so there is nothing to free */
 
     /* about once every next_update seconds, re-read social connections */
     if (time (NULL) >= next_update)
       next_update = update_social (soc, update_seconds);
+    if (time (NULL) >= next_stats) {
+      log_stats ();
+      next_stats = time (NULL) + AD_STATS_SECONDS;
+    }
   }
 }
 
@@ -269,7 +465,13 @@ void ad_main (int npipes, int * rpipes, int * wpipes)
               i, rpipes [i], i, wpipes [i]);
     log_print ();
   }
-  main_loop (npipes, rpipes, wpipes, 30, 30000, 5);
+  /* leave one processor for ad's own thread */
+  int verify_threads = (int) sysconf (_SC_NPROCESSORS_ONLN) - 1;
+  if (verify_threads < 1)
+    verify_threads = 1;
+  if (verify_threads > AD_VERIFY_MAX_THREADS)
+    verify_threads = AD_VERIFY_MAX_THREADS;
+  main_loop (npipes, rpipes, wpipes, 30, 30000, 5, verify_threads);
   snprintf (log_buf, LOG_SIZE, "ad error: main loop returned, exiting\n");
   log_print ();
 }
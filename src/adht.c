@@ -384,8 +384,10 @@ void adht_main (char * pname)
 #ifdef DEBUG_PRINT
     print_packet (message, found, "received", 1);
 #endif /* DEBUG_PRINT */
-    respond_to_dht (sock, message, found);
-    free (message);
+    if (found > 0) {
+      respond_to_dht (sock, message, found);
+      release_pipe_message (message);
+    }
   }
 }
 
@@ -0,0 +1,157 @@
+/* adstats.c: measure how long ad spends in each stage of forwarding */
+/* each stage has a histogram of its times, in buckets that are powers of
+ * two microseconds, so recording a time is just a few additions */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lib/log.h"
+#include "adstats.h"
+
+/* bucket 0 is for times under 1us, bucket i for times under 2^i us,
+ * and the last bucket for everything longer (over 16s) */
+#define HISTOGRAM_BUCKETS	26
+
+struct stage_stats {
+  unsigned long long int count;
+  unsigned long long int total_ns;
+  unsigned long long int max_ns;
+  unsigned long long int buckets [HISTOGRAM_BUCKETS];
+};
+
+static struct stage_stats stages [AD_NUM_STAGES];
+
+/* one for each output pipe, so a slow pipe can be found */
+static struct stage_stats * pipes = NULL;
+static int num_pipes = 0;
+
+static const char * stage_names [AD_NUM_STAGES] =
+  { "receive", "record", "priority", "verified", "mgmt",
+    "send_all", "send_out", "send_local" };
+
+unsigned long long int adstats_now ()
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return ((unsigned long long int) now.tv_sec) * 1000000000LL + now.tv_nsec;
+}
+
+static void record_time (struct stage_stats * s, unsigned long long int start)
+{
+  unsigned long long int now = adstats_now ();
+  unsigned long long int ns = ((now > start) ? (now - start) : 0);
+  s->count++;
+  s->total_ns += ns;
+  if (ns > s->max_ns)
+    s->max_ns = ns;
+  unsigned long long int us = ns / 1000;
+  int bucket = 0;
+  while ((us > 0) && (bucket + 1 < HISTOGRAM_BUCKETS)) {
+    us = us / 2;
+    bucket++;
+  }
+  s->buckets [bucket]++;
+}
+
+void adstats_time (int stage, unsigned long long int start)
+{
+  if ((stage < 0) || (stage >= AD_NUM_STAGES))
+    return;
+  record_time (stages + stage, start);
+}
+
+void adstats_init_pipes (int npipes)
+{
+  if (pipes != NULL)
+    free (pipes);
+  num_pipes = 0;
+  pipes = calloc (npipes, sizeof (struct stage_stats));
+  if (pipes != NULL)
+    num_pipes = npipes;
+}
+
+void adstats_pipe_time (int index, unsigned long long int start)
+{
+  if ((index < 0) || (index >= num_pipes))
+    return;
+  record_time (pipes + index, start);
+}
+
+/* print the line for one stage or pipe, returning the number of characters */
+static int print_stats (const char * name, struct stage_stats * s,
+                        char * buffer, int bsize)
+{
+  int n = snprintf (buffer, bsize,
+                    "%s: %llu, avg %lluus, max %lluus;", name,
+                    s->count, s->total_ns / s->count / 1000,
+                    s->max_ns / 1000);
+  int i;
+  for (i = 0; (i < HISTOGRAM_BUCKETS) && (n < bsize); i++) {
+    if (s->buckets [i] == 0)
+      continue;
+    if (i + 1 < HISTOGRAM_BUCKETS)
+      n += snprintf (buffer + n, bsize - n, " <%lluus %llu",
+                     1ULL << i, s->buckets [i]);
+    else
+      n += snprintf (buffer + n, bsize - n, " more %llu", s->buckets [i]);
+  }
+  if (n < bsize)
+    n += snprintf (buffer + n, bsize - n, "\n");
+  if (n > bsize)
+    n = bsize;
+  return n;
+}
+
+static const char * pipe_name (int index, char * buffer, int bsize)
+{
+  if (index == 0)
+    return "pipe alocal";
+  if (index == 1)
+    return "pipe aip";
+  snprintf (buffer, bsize, "pipe abc %d", index - 2);
+  return buffer;
+}
+
+/* stats for the stages, then for the pipes */
+static struct stage_stats * stats_line (int line, const char ** name,
+                                        char * buffer, int bsize)
+{
+  if (line < AD_NUM_STAGES) {
+    *name = stage_names [line];
+    return stages + line;
+  }
+  *name = pipe_name (line - AD_NUM_STAGES, buffer, bsize);
+  return pipes + (line - AD_NUM_STAGES);
+}
+
+int adstats_print (char * buffer, int bsize)
+{
+  int n = 0;
+  int i;
+  for (i = 0; (i < AD_NUM_STAGES + num_pipes) && (n < bsize); i++) {
+    char name_buffer [30];
+    const char * name;
+    struct stage_stats * s = stats_line (i, &name, name_buffer,
+                                         sizeof (name_buffer));
+    if (s->count > 0)
+      n += print_stats (name, s, buffer + n, bsize - n);
+  }
+  return n;
+}
+
+void adstats_log ()
+{
+  int i;
+  for (i = 0; i < AD_NUM_STAGES + num_pipes; i++) {
+    char name_buffer [30];
+    const char * name;
+    struct stage_stats * s = stats_line (i, &name, name_buffer,
+                                         sizeof (name_buffer));
+    if (s->count > 0) {
+      print_stats (name, s, log_buf, LOG_SIZE);
+      log_print ();
+    }
+  }
+}
@@ -0,0 +1,39 @@
+/* adstats.h: measure how long ad spends in each stage of forwarding */
+
+#ifndef ADSTATS_H
+#define ADSTATS_H
+
+#define AD_STAGE_RECEIVE	0  /* receiving, including waiting for input */
+#define AD_STAGE_RECORD		1  /* checking for duplicates */
+#define AD_STAGE_PRIORITY	2  /* verifying or queueing, then priority */
+#define AD_STAGE_VERIFIED	3  /* queued until verified by a thread */
+#define AD_STAGE_MGMT		4  /* deciding where mgmt packets go */
+#define AD_STAGE_SEND_ALL	5  /* send_all to every pipe */
+#define AD_STAGE_SEND_OUT	6  /* send_all to every pipe except alocal */
+#define AD_STAGE_SEND_LOCAL	7  /* send_all to alocal only */
+#define AD_NUM_STAGES		8
+
+/* returns the current time in nanoseconds.  Only useful to compute
+ * differences, since the starting point is arbitrary */
+extern unsigned long long int adstats_now ();
+
+/* records that a stage took from start (a value from adstats_now) until now.
+ * Only one thread may call adstats_time */
+extern void adstats_time (int stage, unsigned long long int start);
+
+/* also keeps times for each of ad's npipes output pipes, the first to
+ * alocal, the second to aip, and the rest to the abc's */
+extern void adstats_init_pipes (int npipes);
+
+/* records that sending to output pipe index took from start until now.
+ * Only one thread may call adstats_pipe_time */
+extern void adstats_pipe_time (int index, unsigned long long int start);
+
+/* prints a line for each stage and each output pipe that has been timed, with its histogram,
+ * into the buffer.  Returns the number of characters printed */
+extern int adstats_print (char * buffer, int bsize);
+
+/* logs the same lines printed by adstats_print */
+extern void adstats_log ();
+
+#endif /* ADSTATS_H */
@@ -104,7 +104,7 @@ static void wait_for_response (int sock, char * phrase, char * ahra,
     }
     if (handle_packet (message, found, ahra, debug))
       return;
-    free (message);
+    release_pipe_message (message);
   }
 }
 
@@ -1059,9 +1059,14 @@ log_print ();
   return 0;   /* no peer connection established, or no valid DHT msg */
 }
 
+/* how many messages to receive at once */
+#define AIP_BATCH_MESSAGES	32
+
 static void main_loop (int rpipe, int wpipe, struct listen_info * info,
                        void * addr_cache, void * dht_cache)
 {
+  static struct pipe_message msgs [AIP_BATCH_MESSAGES];
+  static char arena [AIP_BATCH_MESSAGES * ALLNET_MTU];
   int udp = udp_socket ();
   void * udp_cache = NULL;
   udp_cache = cache_init (128, free);
@@ -1082,101 +1087,105 @@ static void main_loop (int rpipe, int wpipe, struct listen_info * info,
       send_keepalive (udp_cache, udp, listener_fds, NUM_LISTENERS);
       last_keepalive = time (NULL);
     }
-    int fd = -1;
-    int priority;
-    char * message;
-    struct sockaddr_storage sockaddr;
-    struct sockaddr * sap = (struct sockaddr *) (&sockaddr);
-    socklen_t sasize = sizeof (sockaddr);
-    int result = receive_pipe_message_fd (1000, &message, udp, sap, &sasize,
-                                          &fd, &priority);
+    int count = receive_pipe_messages_batch_fd (1000, udp, msgs,
+                                                AIP_BATCH_MESSAGES,
+                                                arena, sizeof (arena));
+    int m;
+    for (m = 0; m < count; m++) {
+      int fd = msgs [m].from_pipe;
+      int priority = msgs [m].priority;
+      char * message = msgs [m].message;
+      int result = msgs [m].mlen;
+      struct sockaddr * sap = (struct sockaddr *) (&(msgs [m].sa));
+      socklen_t sasize = msgs [m].salen;
 if ((result > 0) && (fd == udp)&&(sap->sa_family != AF_INET) && (sap->sa_family != AF_INET6)) {
 snprintf (log_buf, LOG_SIZE, "00: fd %d/%d, result %d/%d/%zd, bad afamily %d\n",
-udp, fd, result, sasize, sizeof (sockaddr), sap->sa_family); log_print (); }
-    if (result < 0) {
+udp, fd, result, sasize, sizeof (msgs [m].sa), sap->sa_family); log_print (); }
+      if (result < 0) {
 if ((sap->sa_family != AF_INET) && (sap->sa_family != AF_INET6)) {
 snprintf (log_buf, LOG_SIZE, "0/%d: fd %d/%d, bad address family %d\n", result, udp, fd,
 sap->sa_family); log_print (); }
-      if ((fd == rpipe) || (fd == udp)) {
-        snprintf (log_buf, LOG_SIZE, "aip %s %d closed\n",
-                  ((fd == rpipe) ? "ad pipe" : "udp socket"), fd);
-        log_print ();
-        break;  /* exit the loop and the program */
-      }
+        if ((fd == rpipe) || (fd == udp)) {
+          snprintf (log_buf, LOG_SIZE, "aip %s %d closed\n",
+                    ((fd == rpipe) ? "ad pipe" : "udp socket"), fd);
+          log_print ();
+          return;  /* exit the loop and the program */
+        }
 #ifdef DEBUG_PRINT
-      printf ("aip: error %d on file descriptor %d, closing\n", result, fd);
+        printf ("aip: error %d on file descriptor %d, closing\n", result, fd);
 #endif /* DEBUG_PRINT */
-      snprintf (log_buf, LOG_SIZE,
-                "aip: error %d on file descriptor %d, closing\n", result, fd);
-      log_print ();
-      remove_listener (fd, info, addr_cache);
-      removed_listener = 1;
-    } else if (result > 0) {
+        snprintf (log_buf, LOG_SIZE,
+                  "aip: error %d on file descriptor %d, closing\n", result, fd);
+        log_print ();
+        remove_listener (fd, info, addr_cache);
+        removed_listener = 1;
+      } else if (result > 0) {
 if ((fd == udp)&&(sap->sa_family != AF_INET) && (sap->sa_family != AF_INET6)) {
 snprintf (log_buf, LOG_SIZE, "1: fd %d/%d, result %d/%d, bad addr family %d\n",
 udp, fd, result, sasize, sap->sa_family); log_print (); }
-      if (fd == rpipe) {    /* message from ad, send to IP neighbors */
-        snprintf (log_buf, LOG_SIZE, "got %d-byte message from ad\n", result);
-        log_print ();
-        forward_message (info->fds + 1, info->num_fds - 1, udp, udp_cache,
-                         addr_cache, message, result, priority, 10);
-      } else {
-        int off = snprintf (log_buf, LOG_SIZE,
-                            "got %d bytes from Internet on fd %d",
-                            result, fd);
-        if (fd == udp) {
+        if (fd == rpipe) {    /* message from ad, send to IP neighbors */
+          snprintf (log_buf, LOG_SIZE, "got %d-byte message from ad\n", result);
+          log_print ();
+          forward_message (info->fds + 1, info->num_fds - 1, udp, udp_cache,
+                           addr_cache, message, result, priority, 10);
+        } else {
+          int off = snprintf (log_buf, LOG_SIZE,
+                              "got %d bytes from Internet on fd %d",
+                              result, fd);
+          if (fd == udp) {
 if ((sap->sa_family != AF_INET) && (sap->sa_family != AF_INET6)) {
 snprintf (log_buf, LOG_SIZE, "2: fd %d/%d, bad address family %d\n", udp, fd,
 sap->sa_family); log_print (); }
-          standardize_ip (sap, sasize);
+            standardize_ip (sap, sasize);
 if ((sap->sa_family != AF_INET) && (sap->sa_family != AF_INET6)) {
 snprintf (log_buf, LOG_SIZE, "3: fd %d/%d, bad address family %d\n", udp, fd,
 sap->sa_family); log_print (); }
 #ifdef DEBUG_PRINT
-          off += snprintf (log_buf + off, LOG_SIZE - off, "/udp, saving ");
-          off += print_sockaddr_str (sap, sasize, 0,
-                                     log_buf + off, LOG_SIZE - off);
+            off += snprintf (log_buf + off, LOG_SIZE - off, "/udp, saving ");
+            off += print_sockaddr_str (sap, sasize, 0,
+                                       log_buf + off, LOG_SIZE - off);
 #else /* DEBUG_PRINT */
-          off += snprintf (log_buf + off, LOG_SIZE - off, "/udp\n");
+            off += snprintf (log_buf + off, LOG_SIZE - off, "/udp\n");
 #endif /* DEBUG_PRINT */
-          log_print ();
+            log_print ();
 if ((sap->sa_family != AF_INET) && (sap->sa_family != AF_INET6)) {
 snprintf (log_buf, LOG_SIZE, "4: fd %d/%d, bad address family %d\n", udp, fd,
 sap->sa_family); log_print (); }
-          add_sockaddr_to_cache (udp_cache, sap, sasize);
-        } else {
-          struct addr_info * ai = listen_fd_addr (info, fd);
-          if (ai != NULL)
-            if (ai_to_sockaddr (ai, sap))
-              sasize = sizeof (struct sockaddr_in6);
+            add_sockaddr_to_cache (udp_cache, sap, sasize);
+          } else {
+            struct addr_info * ai = listen_fd_addr (info, fd);
+            if (ai != NULL)
+              if (ai_to_sockaddr (ai, sap))
+                sasize = sizeof (struct sockaddr_in6);
 #ifdef DEBUG_PRINT
-          off += snprintf (log_buf + off, LOG_SIZE - off, ", ");
-          off += print_sockaddr_str (sap, sasize, 1,
-                                     log_buf + off, LOG_SIZE - off);
+            off += snprintf (log_buf + off, LOG_SIZE - off, ", ");
+            off += print_sockaddr_str (sap, sasize, 1,
+                                       log_buf + off, LOG_SIZE - off);
 #else /* DEBUG_PRINT */
-          off += snprintf (log_buf + off, LOG_SIZE - off, "\n");
+            off += snprintf (log_buf + off, LOG_SIZE - off, "\n");
 #endif /* DEBUG_PRINT */
-          log_print ();
-        }
-        if (handle_mgmt (listener_fds, NUM_LISTENERS, fd, message,
-                         &result, udp, sap, sasize)) {
-          /* handled, no action needed */
-          /* if not handled, the message may be changed (for the better!) */
-        } else {              /* message from a client, send to ad */
-          /* send the message to ad.  Often ad will just send it back,
-           * with a new priority */
-          if (! send_pipe_message (wpipe, message, result,
-                                   ALLNET_PRIORITY_EPSILON)) {
-            snprintf (log_buf, LOG_SIZE,
-                      "error sending to ad pipe %d\n", wpipe);
             log_print ();
-            break;
           }
+          if (handle_mgmt (listener_fds, NUM_LISTENERS, fd, message,
+                           &result, udp, sap, sasize)) {
+            /* handled, no action needed */
+            /* if not handled, the message may be changed (for the better!) */
+          } else {              /* message from a client, send to ad */
+            /* send the message to ad.  Often ad will just send it back,
+             * with a new priority */
+            if (! send_pipe_message (wpipe, message, result,
+                                     ALLNET_PRIORITY_EPSILON)) {
+              snprintf (log_buf, LOG_SIZE,
+                        "error sending to ad pipe %d\n", wpipe);
+              log_print ();
+              return;
+            }
+          }
+          listen_record_usage (info, fd);   /* this fd was used */
         }
-        listen_record_usage (info, fd);   /* this fd was used */
+        /* the message is in the arena, so there is nothing to free */
       }
-      free (message);   /* allocated by receive_pipe_message_fd */
-    }   /* else result is zero, timed out, try again */
+    }   /* if count is zero, timed out, try again */
   }
 }
 
@@ -1198,7 +1207,8 @@ void aip_main (int rpipe, int wpipe, char * addr_socket_name)
     return;
   }
   struct listen_info info;
-  listen_init_info (&info, 256, "aip", ALLNET_PORT, 0, 1, 0, listen_callback);
+  listen_init_info (&info, PIPE_MESSAGE_MAX_FDS, "aip", ALLNET_PORT, 0, 1, 0,
+                    listen_callback);
 
   listen_add_fd (&info, rpipe, NULL);
   int i;
@@ -23,12 +23,55 @@
 #include "listen.h"
 #include "lib/log.h"
 
+/* send the message to every fd except the one it came from */
+static void forward_message (int rpipe, int wpipe, struct listen_info * info,
+                             int fd, char * message, int result, int priority)
+{
+  int i;
+  pthread_mutex_lock (&(info->mutex));
+  if (fd != rpipe)
+    listen_record_usage (info, fd);  /* make it most recently used */
+  for (i = 0; i < info->num_fds; i++) {
+    int xfd = info->fds [i];
+    int same = (fd == xfd);
+    if (xfd == rpipe)
+      xfd = wpipe;
+    same = (same || (fd == xfd));
+    if (! same) {
+      if (! send_pipe_message (xfd, message, result, priority)) {
+        snprintf (log_buf, LOG_SIZE,
+                  "error sending to info pipe %d/%d at %d\n",
+                  info->fds [i], xfd, i);
+        log_print ();
+        /* listen_remove_fd (info, info->fds [i]);  now only on recv err */
+      } else {
+#ifdef DEBUG_PRINT
+        snprintf (log_buf, LOG_SIZE,
+                  "sent to fd %d/%d at %d %d bytes, prio %08x\n",
+                  info->fds [i], xfd, i, result, priority);
+        log_print ();
+#endif /* DEBUG_PRINT */
+      }
+    } else {  /* else same pipe, do not send back */
+#ifdef DEBUG_PRINT
+      snprintf (log_buf, LOG_SIZE,
+                "not sending on same info pipe %d/%d at %d\n",
+                info->fds [i], xfd, i);
+      log_print ();
+#endif /* DEBUG_PRINT */
+    }
+  }
+  pthread_mutex_unlock (&(info->mutex));
+}
+
+/* how many messages to receive at once */
+#define ALOCAL_BATCH_MESSAGES	32
+
 static void main_loop (int rpipe, int wpipe, struct listen_info * info)
 {
+  static struct pipe_message msgs [ALOCAL_BATCH_MESSAGES];
+  static char arena [ALOCAL_BATCH_MESSAGES * ALLNET_MTU];
   while (1) {
-    int fd;
-    int priority;
-    char * message;
 /* the sleep time is arbitrarily set to 50ms.  The major thing that may
  * happen while we sleep is a new socket being added.  We don't listen to
  * it until the next time we call receive_pipe_message_any.  To give good
@@ -36,69 +79,40 @@ static void main_loop (int rpipe, int wpipe, struct listen_info * info)
  * to 1ms, but then alocal took a little more CPU time than I liked.
  * If this value is changed, should change the corresponding value in
  * app_util.c */
-    int result = receive_pipe_message_any (50, &message, &fd, &priority);
+    int count = receive_pipe_messages_batch (50, msgs, ALOCAL_BATCH_MESSAGES,
+                                             arena, sizeof (arena));
+    int m;
+    for (m = 0; m < count; m++) {
+      int fd = msgs [m].from_pipe;
+      int priority = msgs [m].priority;
+      int result = msgs [m].mlen;
 #define DEBUG_PRINT
 #ifdef DEBUG_PRINT
-    if (result != 0) {
-      snprintf (log_buf, LOG_SIZE, "receive_pipe_message_any returns %d\n",
-                result);
-      log_print ();
-    }
-#endif /* DEBUG_PRINT */
-#undef DEBUG_PRINT
-    if (result < 0) {
-      if (fd == rpipe) {
-        snprintf (log_buf, LOG_SIZE, "ad pipe %d closed\n", rpipe);
-        log_print ();
-        break;
-      }
-      snprintf (log_buf, LOG_SIZE,
-                "error on file descriptor %d, closing\n", fd);
-      log_print ();
-      listen_remove_fd (info, fd);
-      close (fd);       /* remove from kernel */
-    } else if (result > 0) {
       snprintf (log_buf, LOG_SIZE,
-                "got %d bytes from %s (fd %d, priority %d)\n", result,
-                (fd == rpipe) ? "ad" : "client", fd, priority);
+                "receive_pipe_messages_batch returns %d\n", result);
       log_print ();
-      int i;
-      pthread_mutex_lock (&(info->mutex));
-      if (fd != rpipe)
-        listen_record_usage (info, fd);  /* make it most recently used */
-      for (i = 0; i < info->num_fds; i++) {
-        int xfd = info->fds [i];
-        int same = (fd == xfd);
-        if (xfd == rpipe)
-          xfd = wpipe;
-        same = (same || (fd == xfd));
-        if (! same) {
-          if (! send_pipe_message (xfd, message, result, priority)) {
-            snprintf (log_buf, LOG_SIZE,
-                      "error sending to info pipe %d/%d at %d\n",
-                      info->fds [i], xfd, i);
-            log_print ();
-            /* listen_remove_fd (info, info->fds [i]);  now only on recv err */
-          } else {
-#ifdef DEBUG_PRINT
-            snprintf (log_buf, LOG_SIZE,
-                      "sent to fd %d/%d at %d %d bytes, prio %08x\n",
-                      info->fds [i], xfd, i, result, priority);
-            log_print ();
 #endif /* DEBUG_PRINT */
-          }
-        } else {  /* else same pipe, do not send back */
-#ifdef DEBUG_PRINT
-          snprintf (log_buf, LOG_SIZE,
-                    "not sending on same info pipe %d/%d at %d\n",
-                    info->fds [i], xfd, i);
+#undef DEBUG_PRINT
+      if (result < 0) {
+        if (fd == rpipe) {
+          snprintf (log_buf, LOG_SIZE, "ad pipe %d closed\n", rpipe);
           log_print ();
-#endif /* DEBUG_PRINT */
+          return;
         }
+        snprintf (log_buf, LOG_SIZE,
+                  "error on file descriptor %d, closing\n", fd);
+        log_print ();
+        listen_remove_fd (info, fd);
+        close (fd);       /* remove from kernel */
+      } else {
+        snprintf (log_buf, LOG_SIZE,
+                  "got %d bytes from %s (fd %d, priority %d)\n", result,
+                  (fd == rpipe) ? "ad" : "client", fd, priority);
+        log_print ();
+        forward_message (rpipe, wpipe, info, fd, msgs [m].message, result,
+                         priority);
       }
-      pthread_mutex_unlock (&(info->mutex));
-      free (message);
-    }   /* else result is zero, timed out, try again */
+    }   /* if count is zero, timed out, try again */
   }
 }
 
@@ -115,7 +129,8 @@ void alocal_main (int rpipe, int wpipe)
   struct listen_info info;
   snprintf (log_buf, LOG_SIZE, "calling listen_init_info\n");
   log_print ();
-  listen_init_info (&info, 256, "alocal", ALLNET_LOCAL_PORT, 1, 1, 1, NULL);
+  listen_init_info (&info, PIPE_MESSAGE_MAX_FDS, "alocal", ALLNET_LOCAL_PORT,
+                    1, 1, 1, NULL);
   snprintf (log_buf, LOG_SIZE, "calling listen_add_fd\n");
   log_print ();
   listen_add_fd (&info, rpipe, NULL);
@@ -23,6 +23,7 @@
 #include "lib/util.h"
 #include "lib/log.h"
 #include "lib/packet.h"
+#include "lib/pipemsg.h"
 
 extern void ad_main (int npipes, int * rpipes, int * wpipes);
 extern void alocal_main (int pipe1, int pipe2);
@@ -36,6 +37,9 @@ extern void keyd_generate (char * pname);
 
 static const char * daemon_name = "astart";
 
+/* size of each shared-memory ring, if astart is called with -s */
+#define PIPE_RING_SIZE	(1024 * 1024)
+
 static void stop_all ();
 /* if astart is called as root, abc should run as root, and everything
  * else should be run as the calling user, if any, and otherwise,
@@ -96,7 +100,7 @@ static void set_nonblock (int fd)
     printf ("unable to set nonblocking on fd %d\n", fd);
 }
 
-static void init_pipes (int * pipes, int num_pipes)
+static void init_pipes (int * pipes, int num_pipes, int use_rings)
 {
   int i;
   for (i = 0; i < num_pipes; i++) {
@@ -112,6 +116,9 @@ static void init_pipes (int * pipes, int num_pipes)
     set_nonblock (pipefd [1]);
     pipes [i] = pipefd [0];
     pipes [i + num_pipes] = pipefd [1];
+    if ((use_rings) && (! add_pipe_ring (pipefd [0], pipefd [1],
+                                         PIPE_RING_SIZE)))
+      printf ("unable to create ring for pipe set %d, using the pipe\n", i);
 /*  printf ("pipes [%d] is %d, pipes [%d] is %d\n",
             i, pipes [i], i + num_pipes, pipes [i + num_pipes]); */
   }
@@ -286,6 +293,7 @@ static void my_call1 (char * argv, int alen, char * program,
 {
   pid_t child = fork ();
   if (child == 0) {
+    keep_pipe_rings (0, NULL, NULL);
     replace_command (argv, alen, program);
     snprintf (log_buf, LOG_SIZE, "calling %s\n", program);
     log_print ();
@@ -316,6 +324,7 @@ static void my_call_alocal (char * argv, int alen, int rpipe, int wpipe, int fd)
   char * program = "alocal";
   pid_t child = fork ();
   if (child == 0) {
+    keep_pipe_rings (1, &rpipe, &wpipe);
     replace_command (argv, alen, program);
     snprintf (log_buf, LOG_SIZE, "calling %s (%d %d)\n", program, rpipe, wpipe);
     log_print ();
@@ -339,6 +348,7 @@ static void my_call_aip (char * argv, int alen, char * program,
 {
   pid_t child = fork ();
   if (child == 0) {
+    keep_pipe_rings (1, &rpipe, &wpipe);
     replace_command (argv, alen, program);
     snprintf (log_buf, LOG_SIZE, "calling %s %d %d %s\n",
               program, rpipe, wpipe, extra);
@@ -371,6 +381,7 @@ static void my_call_abc (char * argv, int alen, char * program,
      * again, which is no big deal */
     close (ppipe1);
     close (ppipe2);
+    keep_pipe_rings (1, &rpipe, &wpipe);
     abc_main (rpipe, wpipe, ifopts);
     child_return (program);
   } else {  /* parent, close the child pipes */
@@ -404,6 +415,7 @@ static pid_t my_call_ad (char * argv, int alen, int num_pipes, int * rpipes,
       rpipes [i] = rpipes [2 * i + 1];
       wpipes [i] = wpipes [2 * i    ];  /* may be the same */
     }
+    keep_pipe_rings (num_pipes / 2, rpipes, wpipes);
 /*  printf ("calling ad (%d, read", num_pipes / 2);
     for (i = 0; i < num_pipes / 2; i++)
       printf (" %d", rpipes [i]);
@@ -497,6 +509,8 @@ static void find_path (char * arg, char ** path, char ** program)
 int astart_main (int argc, char ** argv)
 {
   log_to_output (get_option ('v', &argc, argv));
+  /* -s: use shared-memory rings between ad and the daemons it talks to */
+  int use_rings = get_option ('s', &argc, argv);
   int alen = strlen (argv [0]);
   char * path;
   char * pname;
@@ -523,7 +537,7 @@ int astart_main (int argc, char ** argv)
   int num_pipes = NUM_FIXED_PIPES + NUM_INTERFACE_PIPES * num_interfaces;
   /* note: two file descriptors (ints) per pipe */
   int * pipes = malloc_or_fail (num_pipes * 2 * sizeof (int), "astart pipes");
-  init_pipes (pipes, num_pipes);
+  init_pipes (pipes, num_pipes, use_rings);
   int * rpipes = pipes;
   int * wpipes = pipes + num_pipes;
   pid_t * abc_pids =
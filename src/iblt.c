@@ -0,0 +1,248 @@
+/* iblt.c: a summary of the IDs of cached messages, to compare with others */
+/* the summary is an invertible Bloom lookup table, in the format described
+ * with struct allnet_mgmt_id_summary in mgmt.h.  We only keep the largest
+ * summary.  A smaller one is computed by adding together the cells whose
+ * indices have the same low bits, which gives the same result as adding
+ * each ID to the smaller summary.
+ * To compare, subtract the other summary from ours.  A cell holding
+ * exactly one ID (count 1 or -1, and the check matches the ID) tells us
+ * one of the differences, which is then removed from its other cells,
+ * possibly leaving more cells with a single ID.  If all the cells end up
+ * empty, we have found all the differences.
+ * When acache is split into shards, each shard process updates its own
+ * table in memory shared by all the shards, and the summary is the sum
+ * of the tables.  A table read while another shard is updating it may
+ * give a wrong cell, which at worst makes a comparison fail or finds an
+ * ID that is not actually cached, and is corrected by the next summary. */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "iblt.h"
+#include "lib/packet.h"
+#include "lib/mgmt.h"
+#include "lib/util.h"
+
+#define IBLT_PARTS	ALLNET_ID_SUMMARY_PARTS
+#define IBLT_CELLS	(1 << ALLNET_ID_SUMMARY_MAX_POWER)
+
+struct iblt_cell {
+  int count;
+  char id_sum [MESSAGE_ID_SIZE];
+  uint32_t check_sum;
+};
+
+typedef struct iblt_cell iblt_table [IBLT_PARTS] [IBLT_CELLS];
+
+static iblt_table single_table;
+static iblt_table * tables = &single_table;   /* one for each shard */
+static int num_tables = 1;
+static int own_table = 0;                     /* the one we update */
+
+/* must be called before the shards are started, and before any updates.
+ * Returns 1 for success, 0 if the shared memory cannot be allocated, in
+ * which case there is only one table and the shards should not be used */
+int iblt_init_shards (int shards)
+{
+  if (shards <= 1)
+    return 1;
+  void * shared = mmap (NULL, shards * sizeof (iblt_table),
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                        -1, 0);
+  if (shared == MAP_FAILED) {
+    perror ("iblt_init_shards mmap");
+    return 0;
+  }
+  tables = (iblt_table *) shared;
+  num_tables = shards;
+  return 1;
+}
+
+/* called in each shard process to select the table it updates */
+void iblt_set_shard (int shard)
+{
+  if ((shard >= 0) && (shard < num_tables))
+    own_table = shard;
+}
+
+/* 32-bit FNV-1a, which is cheap, and unlike the xor of ids, not linear */
+static uint32_t id_check (const char * id)
+{
+  uint32_t hash = 2166136261U;
+  int i;
+  for (i = 0; i < MESSAGE_ID_SIZE; i++)
+    hash = (hash ^ ((unsigned char) (id [i]))) * 16777619U;
+  return hash;
+}
+
+static int cell_index (const char * id, int part, int power_two)
+{
+  return readb32 (id + 4 * part) & ((1 << power_two) - 1);
+}
+
+static void cell_update (struct iblt_cell * cell, const char * id,
+                         uint32_t check, int delta)
+{
+  int i;
+  cell->count += delta;
+  for (i = 0; i < MESSAGE_ID_SIZE; i++)
+    cell->id_sum [i] ^= id [i];
+  cell->check_sum ^= check;
+}
+
+/* add (delta = 1) or remove (delta = -1) an ID of MESSAGE_ID_SIZE bytes */
+void iblt_update (const char * id, int delta)
+{
+  uint32_t check = id_check (id);
+  int part;
+  for (part = 0; part < IBLT_PARTS; part++)
+    cell_update (tables [own_table] [part] +
+                   cell_index (id, part, ALLNET_ID_SUMMARY_MAX_POWER),
+                 id, check, delta);
+}
+
+static int valid_power (int power_two)
+{
+  return ((power_two >= ALLNET_ID_SUMMARY_MIN_POWER) &&
+          (power_two <= ALLNET_ID_SUMMARY_MAX_POWER));
+}
+
+/* the first (1 << power_two) cells of each part of result are set
+ * to the sum of all the tables */
+static void fold (int power_two, struct iblt_cell result [] [IBLT_CELLS])
+{
+  int mask = (1 << power_two) - 1;
+  int part;
+  for (part = 0; part < IBLT_PARTS; part++) {
+    memcpy (result [part], tables [0] [part],
+            (mask + 1) * sizeof (struct iblt_cell));
+    int t;
+    int i;
+    for (t = 0; t < num_tables; t++) {
+      for (i = ((t == 0) ? (mask + 1) : 0); i < IBLT_CELLS; i++) {
+        struct iblt_cell * from = tables [t] [part] + i;
+        cell_update (result [part] + (i & mask), from->id_sum,
+                     from->check_sum, from->count);
+      }
+    }
+  }
+}
+
+/* write the cells of the summary with ALLNET_ID_SUMMARY_PARTS << power_two
+ * cells, in the format of struct allnet_mgmt_id_summary_cell (mgmt.h).
+ * Returns the number of bytes written, or 0 if power_two is not valid
+ * or the buffer is too small */
+int iblt_encode (int power_two, char * buffer, int bsize)
+{
+  int ncells = IBLT_PARTS << power_two;
+  int csize = sizeof (struct allnet_mgmt_id_summary_cell);
+  if ((! valid_power (power_two)) || (bsize < ncells * csize))
+    return 0;
+  static struct iblt_cell folded [IBLT_PARTS] [IBLT_CELLS];
+  fold (power_two, folded);
+  struct allnet_mgmt_id_summary_cell * out =
+    (struct allnet_mgmt_id_summary_cell *) buffer;
+  int part;
+  for (part = 0; part < IBLT_PARTS; part++) {
+    int i;
+    for (i = 0; i < (1 << power_two); i++) {
+      struct iblt_cell * cell = folded [part] + i;
+      writeb32u (out->count, (unsigned long int) cell->count);
+      memcpy (out->id_sum, cell->id_sum, MESSAGE_ID_SIZE);
+      writeb32u (out->check_sum, cell->check_sum);
+      out++;
+    }
+  }
+  return ncells * csize;
+}
+
+/* a cell is pure if it holds exactly one ID, on either side.  The ID
+ * must also belong in this cell, or peeling it would leave the cell
+ * unchanged, and a crafted or colliding cell could be peeled forever */
+static int is_pure (struct iblt_cell * cell, int part, int index,
+                    int power_two)
+{
+  return (((cell->count == 1) || (cell->count == -1)) &&
+          (id_check (cell->id_sum) == cell->check_sum) &&
+          (cell_index (cell->id_sum, part, power_two) == index));
+}
+
+static int is_empty (struct iblt_cell * cell)
+{
+  static const char zero [MESSAGE_ID_SIZE];
+  return ((cell->count == 0) && (cell->check_sum == 0) &&
+          (memcmp (cell->id_sum, zero, MESSAGE_ID_SIZE) == 0));
+}
+
+/* compare a summary received from elsewhere (in the same format) to ours.
+ * up to max IDs that only we have are copied to only_here, and up to max
+ * that only they have to only_there, each MESSAGE_ID_SIZE bytes, and the
+ * numbers copied are saved in *nhere and *nthere.
+ * Returns 1 if all the differences were found, 0 if the difference is
+ * too large for a summary of this size, and -1 for an invalid summary */
+int iblt_decode (int power_two, const char * cells, int csize,
+                 char * only_here, int * nhere,
+                 char * only_there, int * nthere, int max)
+{
+  *nhere = 0;
+  *nthere = 0;
+  int ncells = 1 << power_two;
+  if ((! valid_power (power_two)) ||
+      (csize < IBLT_PARTS * ncells *
+               sizeof (struct allnet_mgmt_id_summary_cell)))
+    return -1;
+  static struct iblt_cell diff [IBLT_PARTS] [IBLT_CELLS];
+  fold (power_two, diff);
+  const struct allnet_mgmt_id_summary_cell * in =
+    (const struct allnet_mgmt_id_summary_cell *) cells;
+  int part;
+  int i;
+  for (part = 0; part < IBLT_PARTS; part++) {
+    for (i = 0; i < ncells; i++) {
+      cell_update (diff [part] + i, (const char *) (in->id_sum),
+                   (uint32_t) readb32u (in->check_sum),
+                   - (int32_t) readb32u (in->count));
+      in++;
+    }
+  }
+  /* each pass peels every pure cell, and usually makes more cells pure.
+   * A valid difference has at most one ID per cell, so more peels than
+   * cells means the summary is bad */
+  int max_peels = IBLT_PARTS * ncells;
+  int peels = 0;
+  int peeled = 1;
+  while (peeled) {
+    peeled = 0;
+    for (part = 0; part < IBLT_PARTS; part++) {
+      for (i = 0; i < ncells; i++) {
+        struct iblt_cell * cell = diff [part] + i;
+        if (! is_pure (cell, part, i, power_two))
+          continue;
+        if (++peels > max_peels)
+          return 0;
+        char id [MESSAGE_ID_SIZE];
+        memcpy (id, cell->id_sum, MESSAGE_ID_SIZE);
+        int sign = cell->count;
+        if ((sign > 0) && (*nhere < max))
+          memcpy (only_here + ((*nhere)++) * MESSAGE_ID_SIZE, id,
+                  MESSAGE_ID_SIZE);
+        else if ((sign < 0) && (*nthere < max))
+          memcpy (only_there + ((*nthere)++) * MESSAGE_ID_SIZE, id,
+                  MESSAGE_ID_SIZE);
+        uint32_t check = id_check (id);
+        int p;
+        for (p = 0; p < IBLT_PARTS; p++)
+          cell_update (diff [p] + cell_index (id, p, power_two), id, check,
+                       - sign);
+        peeled = 1;
+      }
+    }
+  }
+  for (part = 0; part < IBLT_PARTS; part++)
+    for (i = 0; i < ncells; i++)
+      if (! is_empty (diff [part] + i))
+        return 0;
+  return 1;
+}
@@ -0,0 +1,33 @@
+/* iblt.h: a summary of the IDs of cached messages, to compare with others */
+
+#ifndef IBLT_H
+#define IBLT_H
+
+/* when acache is split into shards, must be called before the shards
+ * are started, to allocate a table for each shard in shared memory.
+ * Returns 1 for success, 0 if the shards cannot share a summary */
+extern int iblt_init_shards (int shards);
+
+/* called in each shard process to select the table it updates */
+extern void iblt_set_shard (int shard);
+
+/* add (delta = 1) or remove (delta = -1) an ID of MESSAGE_ID_SIZE bytes */
+extern void iblt_update (const char * id, int delta);
+
+/* write the cells of the summary with ALLNET_ID_SUMMARY_PARTS << power_two
+ * cells, in the format of struct allnet_mgmt_id_summary_cell (mgmt.h).
+ * Returns the number of bytes written, or 0 if power_two is not valid
+ * or the buffer is too small */
+extern int iblt_encode (int power_two, char * buffer, int bsize);
+
+/* compare a summary received from elsewhere (in the same format) to ours.
+ * up to max IDs that only we have are copied to only_here, and up to max
+ * that only they have to only_there, each MESSAGE_ID_SIZE bytes, and the
+ * numbers copied are saved in *nhere and *nthere.
+ * Returns 1 if all the differences were found, 0 if the difference is
+ * too large for a summary of this size, and -1 for an invalid summary */
+extern int iblt_decode (int power_two, const char * cells, int csize,
+                        char * only_here, int * nhere,
+                        char * only_there, int * nthere, int max);
+
+#endif /* IBLT_H */
@@ -306,7 +306,8 @@ static void * receive_ignore (void * arg)
     int priority;
     int n = receive_pipe_message (*sockp, &message, &priority);
     /* ignore the message and recycle the storage */
-    free (message);
+    if (n > 0)
+      release_pipe_message (message);
     if (n < 0)
       break;
   }
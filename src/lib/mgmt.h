@@ -176,6 +176,41 @@ struct allnet_mgmt_id_request {
   unsigned char ids [MESSAGE_ID_SIZE * 0];  /* really, MESSAGE_ID_SIZE * n */
 };
 
+/* an ID summary lets two neighbors find which cached messages only one of
+ * them has, without listing all the IDs.  It is an invertible Bloom lookup
+ * table (IBLT) of the IDs of the messages in the sender's cache, with
+ * ALLNET_ID_SUMMARY_PARTS parts of 2^power_two cells each.  Every ID is
+ * added to one cell in each part: in part p, the cell given by the low
+ * power_two bits of the big-endian 32-bit number at byte 4p of the ID.
+ * A receiver subtracts the same-size summary of its own cache, and recovers
+ * the IDs that only one of them has: it sends those messages it has, and
+ * requests the others with an ALLNET_MGMT_ID_REQUEST.  If the difference
+ * is too large to recover, the receiver instead replies with its own
+ * summary with twice as many cells, up to ALLNET_ID_SUMMARY_MAX_POWER.
+ * A summary with no cells, sent by a local application, asks the local
+ * cache to send its summary to its neighbors. */
+#define ALLNET_ID_SUMMARY_PARTS		3
+#define ALLNET_ID_SUMMARY_MIN_POWER	3
+#define ALLNET_ID_SUMMARY_MAX_POWER	7
+struct allnet_mgmt_id_summary_cell {
+  unsigned char count [4];            /* signed, big-endian */
+  unsigned char id_sum [MESSAGE_ID_SIZE];  /* xor of the IDs */
+  unsigned char check_sum [4];        /* xor of the 32-bit FNV-1a hash
+                                       * of each ID */
+};
+
+struct allnet_mgmt_id_summary {
+  unsigned char power_two;            /* each part has 2^power_two cells */
+  unsigned char pad [7];              /* always send as 0s */
+  struct allnet_mgmt_id_summary_cell cells [0];
+                              /* really, ALLNET_ID_SUMMARY_PARTS << power_two */
+};
+
+/* a stats request has no content, and is only answered by the local ad,
+ * never forwarded.  The reply is sent only to the local applications,
+ * and has as content a text description of how long ad takes to process
+ * packets, one line per item (not null terminated) */
+
 /* the header that precedes each of the management messages */
 struct allnet_mgmt_header {
   /* specify the kind of management message */
@@ -189,6 +224,9 @@ struct allnet_mgmt_header {
 #define ALLNET_MGMT_TRACE_REPLY		8	/* response to trace req */
 #define ALLNET_MGMT_KEEPALIVE		9	/* to keep connection open */
 #define ALLNET_MGMT_ID_REQUEST		10	/* request specific IDs */
+#define ALLNET_MGMT_STATS_REQ		11	/* request ad statistics */
+#define ALLNET_MGMT_STATS		12	/* ad statistics, local only */
+#define ALLNET_MGMT_ID_SUMMARY		13	/* IDs of cached messages */
   unsigned char mgmt_type;   /* every management packet has this */
   char mpad [7];
 };
@@ -223,4 +261,10 @@ struct allnet_mgmt_header {
          (sizeof (struct allnet_mgmt_id_request)) + \
 	 (n) * MESSAGE_ID_SIZE)
 
+#define ALLNET_ID_SUMMARY_SIZE(t, power_two)	\
+	(ALLNET_MGMT_HEADER_SIZE(t) +   \
+         (sizeof (struct allnet_mgmt_id_summary)) + \
+	 (((ALLNET_ID_SUMMARY_PARTS) << (power_two)) * \
+          sizeof (struct allnet_mgmt_id_summary_cell)))
+
 #endif /* MGMT_H */
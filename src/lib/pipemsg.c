@@ -14,13 +14,23 @@
 #include <signal.h>
 #include <errno.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/select.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#define USE_EPOLL   /* scales to many more fds than select */
+#include <sys/epoll.h>
+#endif /* __linux__ */
 
 #include "packet.h"
 #include "priority.h"
 #include "pipemsg.h"
 #include "util.h"
 #include "log.h"
+#include "shmring.h"
+#include "pktpool.h"
 
 #define MAGIC_STRING	"MAGICPIE"  /* magic pipe, squeezed into 8 chars */
 
@@ -30,18 +40,102 @@
 #define LENGTH_SIZE	4
 #define HEADER_SIZE	(MAGIC_SIZE + PRIORITY_SIZE + LENGTH_SIZE)
 
+/* send_pipe_multiple sends up to this many messages per system call,
+ * well under the limit (IOV_MAX, normally 1024) on iovecs per call */
+#define SEND_MULTIPLE_BATCH	64
+/* the most queued messages flush_queue sends per system call */
+#define FLUSH_IOVECS	64
+
 static int num_pipes = 0;
 
+/* bytes are read from each pipe as they become available, and kept in
+ * the pipe's buffer until a complete message can be returned.  A single
+ * read may bring in several messages, which are then returned without
+ * any more system calls. */
 struct allnet_pipe_info {
   int pipe_fd;	   /* file descriptor for input */
-  int in_header;
-  char header [HEADER_SIZE];
-  char * buffer;   /* may be null */
-  int filled;      /* how many bytes does the buffer or header already have */
-  int bsize;       /* how many bytes do we receive before we are done? */
+  char * buffer;   /* may be null if nothing is buffered */
+  int bsize;       /* how many bytes are allocated for the buffer */
+  int start;       /* index of the first byte not yet returned */
+  int end;         /* index after the last byte received */
+  int pending;     /* 1 if this pipe is on the pending list */
 };
 
+/* a pipe that is holding at least the start of a complete message is
+ * on the pending list, since select/epoll will not report it as ready */
+static int * pending = NULL;
+static int num_pending = 0;
+static int pending_size = 0;
+
+/* read at least this much, so we usually get the entire message at once */
+#define PIPE_READ_SIZE	(HEADER_SIZE + ALLNET_MTU)
+/* with more than this many pipes, free the buffers when they are empty */
+#define KEEP_BUFFER_PIPES	64
+
 static struct allnet_pipe_info * buffers = NULL;
+static int buffers_size = 0;    /* number of entries allocated in buffers */
+
+/* fd_index [fd] is the index of fd in buffers, or -1 if not there.
+ * this makes pipe_index constant-time no matter how many pipes we have */
+static int * fd_index = NULL;
+static int fd_index_size = 0;
+
+/* listen threads may add and remove pipes while the main thread receives */
+static pthread_mutex_t pipes_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef USE_EPOLL
+static int epoll_fd = -1;
+static int epoll_extra = -1;    /* the extra fd, if any, in the epoll set */
+#endif /* USE_EPOLL */
+
+/* optional shared-memory rings, set up by add_pipe_ring.  Each ring
+ * carries the same header + message framing that would otherwise be
+ * written to the pipe, and the pipe itself only carries wakeups. */
+#define MAX_PIPE_RINGS	64
+struct allnet_pipe_ring {
+  int read_fd;     /* -1 if this process does not read from this ring */
+  int write_fd;    /* -1 if this process does not write to this ring */
+  struct shm_ring * ring;
+};
+
+static struct allnet_pipe_ring rings [MAX_PIPE_RINGS];
+static int num_rings = 0;
+/* the most fds all_available returns at once */
+#define MAX_READY_FDS	64
+
+/* after this many consecutive messages from rings, check the other fds */
+#define MAX_RING_BURST	16
+static int ring_burst = 0;
+
+/* output queues for send_pipe_message_all.  A frame (header + message)
+ * is built once, and shared by every queue that holds it */
+struct queued_frame {
+  int refs;
+  int size;
+  char data [0];
+};
+
+#define PIPE_QUEUE_FRAMES	1024
+struct pipe_queue {
+  int pipe;
+  struct queued_frame * frames [PIPE_QUEUE_FRAMES];  /* circular */
+  int first;
+  int count;
+  int offset;      /* how much of the first frame has already been sent */
+  int bytes;       /* how many bytes are queued, including offset */
+  int watched;     /* whether the pipe is being watched for writability */
+};
+
+static struct pipe_queue * queues = NULL;
+static int num_queues = 0;
+static int queue_limit = PIPE_QUEUE_DEFAULT_LIMIT;
+static pthread_mutex_t queues_mutex = PTHREAD_MUTEX_INITIALIZER;
+#ifdef USE_EPOLL
+/* holds the pipes with queued data, waiting for them to be writable.
+ * It is itself in the main epoll set, to wake up all_available */
+static int out_epoll_fd = -1;
+static int out_epoll_added = 0;  /* whether out_epoll_fd is in epoll_fd */
+#endif /* USE_EPOLL */
 
 static int do_not_print = 1;
 static void print_pipes (const char * desc, int pipe)
@@ -57,10 +151,10 @@ static void print_pipes (const char * desc, int pipe)
   int i;
   for (i = 0; i < num_pipes; i++) {
     snprintf (log_buf, LOG_SIZE,
-              "  [%d]: pipe %d, %shdr, h %p b %p, filled %d bsize %d\n", i,
-              buffers [i].pipe_fd, ((buffers [i].in_header) ? "" : "not "),
-              buffers [i].header, buffers [i].buffer,
-              buffers [i].filled, buffers [i].bsize);
+              "  [%d]: pipe %d, %spending, b %p, %d-%d bsize %d\n", i,
+              buffers [i].pipe_fd, ((buffers [i].pending) ? "" : "not "),
+              buffers [i].buffer, buffers [i].start, buffers [i].end,
+              buffers [i].bsize);
    log_print ();
   }
 }
@@ -68,68 +162,203 @@ static void print_pipes (const char * desc, int pipe)
 /* returns the pipe index if present, -1 otherwise */
 static int pipe_index (int pipe)
 {
+  if ((pipe < 0) || (pipe >= fd_index_size))
+    return -1;
+  return fd_index [pipe];
+}
+
+/* pending_remove and pending_add should be called with pipes_mutex held */
+static void pending_remove (struct allnet_pipe_info * bp)
+{
+  if (! bp->pending)
+    return;
+  int i;
+  for (i = 0; i < num_pending; i++) {
+    if (pending [i] == bp->pipe_fd) {
+      pending [i] = pending [num_pending - 1];
+      num_pending--;
+      break;
+    }
+  }
+  bp->pending = 0;
+}
+
+static void pending_add (struct allnet_pipe_info * bp)
+{
+  if (bp->pending)
+    return;
+  if (num_pending >= pending_size) {
+    int new_size = ((pending_size == 0) ? 16 : pending_size * 2);
+    int * new_pending = realloc (pending, new_size * sizeof (int));
+    if (new_pending == NULL) {   /* message will be delivered later */
+      snprintf (log_buf, LOG_SIZE, "unable to allocate %d pending\n",
+                new_size);
+      log_print ();
+      return;
+    }
+    pending = new_pending;
+    pending_size = new_size;
+  }
+  pending [num_pending++] = bp->pipe_fd;
+  bp->pending = 1;
+}
+
+/* returns 1 for success, 0 if unable to allocate memory */
+static int set_pipe_index (int pipe, int index)
+{
+  if (pipe >= fd_index_size) {
+    int new_size = ((fd_index_size == 0) ? 64 : fd_index_size);
+    while (new_size <= pipe)
+      new_size = new_size * 2;
+    int * new_index = realloc (fd_index, new_size * sizeof (int));
+    if (new_index == NULL) {
+      snprintf (log_buf, LOG_SIZE,
+                "unable to allocate %d-entry index for pipe %d\n",
+                new_size, pipe);
+      log_print ();
+      return 0;
+    }
+    int i;
+    for (i = fd_index_size; i < new_size; i++)
+      new_index [i] = -1;
+    fd_index = new_index;
+    fd_index_size = new_size;
+  }
+  fd_index [pipe] = index;
+  return 1;
+}
+
+#ifdef USE_EPOLL
+static void epoll_add_fd (int fd)
+{
+  struct epoll_event ev;
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if ((epoll_ctl (epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) &&
+      (errno != EEXIST)) {
+    perror ("epoll_ctl add");
+    snprintf (log_buf, LOG_SIZE, "unable to add fd %d to epoll set %d\n",
+              fd, epoll_fd);
+    log_print ();
+  }
+}
+
+static void epoll_remove_fd (int fd)
+{
+  struct epoll_event ev;   /* not used, but needed by older kernels */
+  /* closed fds are removed automatically, so errors are not a problem */
+  epoll_ctl (epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+/* a forked child shares the parent's epoll set, so it must make its own */
+static void epoll_after_fork ()
+{
+  if (epoll_fd >= 0)
+    close (epoll_fd);
+  epoll_fd = -1;
+  epoll_extra = -1;
+  out_epoll_added = 0;
+}
+
+/* create the epoll set (if needed), with all the pipes in it */
+static int get_epoll_fd ()
+{
+  static int atfork_registered = 0;
+  if (epoll_fd >= 0)
+    return epoll_fd;
+  if (! atfork_registered) {
+    pthread_atfork (NULL, NULL, epoll_after_fork);
+    atfork_registered = 1;
+  }
+  epoll_fd = epoll_create (1024);  /* the size is only a hint */
+  if (epoll_fd < 0) {
+    perror ("epoll_create");
+    snprintf (log_buf, LOG_SIZE, "unable to create epoll set, aborting\n");
+    log_print ();
+    exit (1);
+  }
+  fcntl (epoll_fd, F_SETFD, FD_CLOEXEC);
   int i;
   for (i = 0; i < num_pipes; i++)
-    if (buffers [i].pipe_fd == pipe)
-      return i;
-  return -1;
+    epoll_add_fd (buffers [i].pipe_fd);
+  return epoll_fd;
 }
+#endif /* USE_EPOLL */
 
 void add_pipe (int pipe)
 {
+  pthread_mutex_lock (&pipes_mutex);
   if (pipe_index (pipe) != -1) {
     snprintf (log_buf, LOG_SIZE,
               "adding pipe %d already in data structure [%d]\n",
               pipe, pipe_index (pipe));
     log_print ();
+    pthread_mutex_unlock (&pipes_mutex);
     return;
   }
-  int total = num_pipes + 1;
-  size_t size = total * sizeof (struct allnet_pipe_info);
-  struct allnet_pipe_info * new_buffer =
-    (struct allnet_pipe_info *) malloc (size);
-  if (new_buffer == NULL) {
-    snprintf (log_buf, LOG_SIZE,
-              "unable to allocate %zd bytes for %d slots\n", size, total);
-    log_print ();
+  if (num_pipes >= buffers_size) {  /* double the size of the array */
+    int total = ((buffers_size == 0) ? 16 : buffers_size * 2);
+    size_t size = total * sizeof (struct allnet_pipe_info);
+    struct allnet_pipe_info * new_buffer =
+      (struct allnet_pipe_info *) realloc (buffers, size);
+    if (new_buffer == NULL) {
+      snprintf (log_buf, LOG_SIZE,
+                "unable to allocate %zd bytes for %d slots\n", size, total);
+      log_print ();
+      pthread_mutex_unlock (&pipes_mutex);
+      return;
+    }
+    buffers = new_buffer;
+    buffers_size = total;
+  }
+  if (! set_pipe_index (pipe, num_pipes)) {
+    pthread_mutex_unlock (&pipes_mutex);
     return;
   }
-  int i;
-  for (i = 0; i < num_pipes; i++) {
-    new_buffer [i] = buffers [i];
-    if (new_buffer [i].in_header)  /* update the pointer */
-      new_buffer [i].buffer = new_buffer [i].header;
-  }
-  new_buffer [num_pipes].pipe_fd = pipe;
-  new_buffer [num_pipes].in_header = 1;/* always start by reading the header */
-  new_buffer [num_pipes].buffer = new_buffer [num_pipes].header;
-  new_buffer [num_pipes].bsize = HEADER_SIZE;
-  new_buffer [num_pipes].filled = 0;
-
-  if (buffers != NULL)
-    free (buffers);
-  buffers = new_buffer;
-  num_pipes = total;
+  buffers [num_pipes].pipe_fd = pipe;
+  buffers [num_pipes].buffer = NULL;
+  buffers [num_pipes].bsize = 0;
+  buffers [num_pipes].start = 0;
+  buffers [num_pipes].end = 0;
+  buffers [num_pipes].pending = 0;
+  num_pipes++;
+#ifdef USE_EPOLL
+  if (pipe == epoll_extra)   /* now registered as a pipe, not as extra */
+    epoll_extra = -1;
+  else if (epoll_fd >= 0)    /* otherwise, added when epoll_fd is created */
+    epoll_add_fd (pipe);
+#endif /* USE_EPOLL */
   print_pipes ("added", pipe);
+  pthread_mutex_unlock (&pipes_mutex);
 }
 
 void remove_pipe (int pipe)
 {
+  pthread_mutex_lock (&pipes_mutex);
   int index = pipe_index (pipe);
-  if (index == -1)  /* nothing to delete */
+  if (index == -1) {  /* nothing to delete */
+    pthread_mutex_unlock (&pipes_mutex);
     return;
+  }
   snprintf (log_buf, LOG_SIZE,
             "removing pipe %d from data structure [%d]\n", pipe, index);
   log_print ();
-  if ((! buffers [index].in_header) && (buffers [index].buffer != NULL))
+  pending_remove (buffers + index);
+  if (buffers [index].buffer != NULL)
     free (buffers [index].buffer);
   if (index + 1 < num_pipes) {
     buffers [index] = buffers [num_pipes - 1];
-    if (buffers [index].in_header)  /* update the pointer */
-      buffers [index].buffer = buffers [index].header;
+    fd_index [buffers [index].pipe_fd] = index;
   }
+  fd_index [pipe] = -1;
   num_pipes--;
+#ifdef USE_EPOLL
+  if (epoll_fd >= 0)
+    epoll_remove_fd (pipe);
+#endif /* USE_EPOLL */
   print_pipes ("removed", pipe);
+  pthread_mutex_unlock (&pipes_mutex);
 }
 
 static inline void write_big_endian32 (char * array, int value)
@@ -146,39 +375,121 @@ static inline int read_big_endian32 (char * array)
           (array [2] & 0xff) <<  8 | (array [3] & 0xff));
 }
 
-static int send_pipe_message_orig (int pipe, const char * message, int mlen,
-                                   int priority)
+int add_pipe_ring (int read_fd, int write_fd, int size)
 {
-  snprintf (log_buf, LOG_SIZE, "warning: send_pipe_message_orig\n");
-  log_print ();  /* normally should not happen */
-  char header [HEADER_SIZE];
-  memcpy (header, MAGIC_STRING, MAGIC_SIZE);
-  write_big_endian32 (header + MAGIC_SIZE, priority);
-  write_big_endian32 (header + MAGIC_SIZE + 4, mlen);
-
-  int w = write (pipe, header, HEADER_SIZE); 
-  if (w != HEADER_SIZE) {
-    perror ("send_pipe_msg(1) write");
-    snprintf (log_buf, LOG_SIZE, "(1) pipe number %d, result %d\n", pipe, w);
+  if (num_rings >= MAX_PIPE_RINGS) {
+    snprintf (log_buf, LOG_SIZE, "unable to add ring for pipe %d/%d, %d\n",
+              read_fd, write_fd, num_rings);
     log_print ();
     return 0;
   }
+  struct shm_ring * ring = shm_ring_create (size);
+  if (ring == NULL)
+    return 0;
+  rings [num_rings].read_fd = read_fd;
+  rings [num_rings].write_fd = write_fd;
+  rings [num_rings].ring = ring;
+  num_rings++;
+  return 1;
+}
 
-  w = write (pipe, message, mlen); 
-  if (w != mlen) {
-    perror ("send_pipe_msg(2) write");
-    snprintf (log_buf, LOG_SIZE,
-              "(2) pipe number %d, wrote %d instead of %d\n", pipe, w, mlen);
-    log_print ();
+static int in_fd_array (int fd, int num_fds, const int * fds)
+{
+  int i;
+  for (i = 0; i < num_fds; i++)
+    if (fds [i] == fd)
+      return 1;
+  return 0;
+}
+
+void keep_pipe_rings (int num_fds, const int * read_fds, const int * write_fds)
+{
+  int i = 0;
+  while (i < num_rings) {
+    if (! in_fd_array (rings [i].read_fd, num_fds, read_fds))
+      rings [i].read_fd = -1;
+    if (! in_fd_array (rings [i].write_fd, num_fds, write_fds))
+      rings [i].write_fd = -1;
+    if ((rings [i].read_fd == -1) && (rings [i].write_fd == -1)) {
+      shm_ring_destroy (rings [i].ring);
+      rings [i] = rings [num_rings - 1];
+      num_rings--;
+    } else {
+      i++;
+    }
+  }
+}
+
+/* returns the ring this process writes for the given pipe, or NULL */
+static struct shm_ring * write_ring (int pipe)
+{
+  int i;
+  for (i = 0; i < num_rings; i++)
+    if (rings [i].write_fd == pipe)
+      return rings [i].ring;
+  return NULL;
+}
+
+/* returns the ring this process reads for the given pipe, or NULL */
+static struct shm_ring * read_ring (int pipe)
+{
+  int i;
+  for (i = 0; i < num_rings; i++)
+    if (rings [i].read_fd == pipe)
+      return rings [i].ring;
+  return NULL;
+}
+
+/* the header has already been filled in.  Returns 1 for success, and
+ * 0 if the ring is full (the same as a pipe that would block) or
+ * the pipe used for wakeups has been closed */
+static int send_ring (int pipe, struct shm_ring * ring,
+                      const char * header, const char * message, int mlen)
+{
+  if (! shm_ring_write (ring, header, HEADER_SIZE, message, mlen)) {
+    static int full_printed = -1;
+    if (full_printed != pipe) {
+      snprintf (log_buf, LOG_SIZE,
+                "ring for pipe %d is full, dropping %d-byte message\n",
+                pipe, mlen);
+      log_print ();
+      full_printed = pipe;
+    }
     return 0;
   }
+  if (shm_ring_consumer_waiting (ring)) {
+    char wakeup = 0;
+    /* if the write fails with EAGAIN, the pipe already has wakeups in it */
+    if ((write (pipe, &wakeup, 1) < 0) && (errno == EPIPE))
+      return 0;
+  }
   return 1;
 }
 
-static int send_buffer (int pipe, char * buffer, int blen, int do_free)
+/* the header for each message is filled in at the given location */
+static void fill_header (char * header, int priority, int mlen)
+{
+  memcpy (header, MAGIC_STRING, MAGIC_SIZE);
+  write_big_endian32 (header + MAGIC_SIZE, priority);
+  write_big_endian32 (header + MAGIC_SIZE + 4, mlen);
+}
+
+void pipe_message_header (char * header, int priority, int mlen)
+{
+  fill_header (header, priority, mlen);
+}
+
+/* sends all of the iovecs with a single system call, so the headers
+ * and messages are not copied into a separate buffer first.
+ * blen is the total number of bytes in the iovecs */
+static int send_iov (int pipe, struct iovec * iov, int iovcnt, int blen)
 {
   int result = 1;
-  int w = send (pipe, buffer, blen, MSG_DONTWAIT); 
+  struct msghdr mh;
+  memset (&mh, 0, sizeof (mh));
+  mh.msg_iov = iov;
+  mh.msg_iovlen = iovcnt;
+  int w = sendmsg (pipe, &mh, MSG_DONTWAIT); 
   int save_errno = errno;
   int is_send = 1;
 /* If it was a partial send, we just want to discard the packet,
@@ -203,24 +514,18 @@ static int send_buffer (int pipe, char * buffer, int blen, int do_free)
     }
     result = 0;
   } else {
-    /* try to send with write -- I don't think this has ever been used */
+    /* pipes (as opposed to sockets) need writev rather than sendmsg */
     if ((w < 0) && (errno == ENOTSOCK)) {
-static int notsock_printed = -1;
-if (notsock_printed != pipe) {
-snprintf (log_buf, LOG_SIZE, "trying write instead of send on fd %d\n", pipe);
-log_print ();
-notsock_printed = pipe;
-}
-      w = write (pipe, buffer, blen); 
+      w = writev (pipe, iov, iovcnt); 
       is_send = 0;
     }
     if (w != blen) {
       static int badwrite_printed = -1;
       if (badwrite_printed != pipe) {
         badwrite_printed = pipe;
-        char * name = "send_pipe_msg write";
+        char * name = "send_pipe_msg writev";
         if (is_send)
-          name = "send_pipe_msg send";
+          name = "send_pipe_msg sendmsg";
 #ifdef DEBUG_PRINT
         if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
           perror (name);
@@ -238,19 +543,16 @@ notsock_printed = pipe;
     }
   }
 #ifdef DEBUG_PRINT
-  snprintf (log_buf, LOG_SIZE, "send_buffer sent %d/%d bytes on %s %d\n",
+  snprintf (log_buf, LOG_SIZE, "send_iov sent %d/%d bytes on %s %d\n",
             blen, w, ((is_send) ? "socket" : "pipe"), pipe);
   log_print ();
 #endif /* DEBUG_PRINT */
-  if (do_free)
-    free (buffer);
   return result;
 }
 
 static int send_header_data (int pipe, const char * message, int mlen,
                              int priority)
 {
-  char packet [HEADER_SIZE + ALLNET_MTU];
   if (mlen > ALLNET_MTU) {
 /* I think this should never happen.  If it does, print it to log and screen */
     snprintf (log_buf, LOG_SIZE,
@@ -266,18 +568,21 @@ static int send_header_data (int pipe, const char * message, int mlen,
     log_print ();
     return 0; /* and return as an error */
   }
-/* send_pipe_message_orig is simpler, but sometimes stalls for ~35ms-40ms
- * on the second send, so it is faster if we only call write once */
-  if (packet == NULL)   /* unable to malloc, use the slow strategy */
-    return send_pipe_message_orig (pipe, message, mlen, priority);
-
-  char * header = packet;
-  memcpy (header, MAGIC_STRING, MAGIC_SIZE);
-  write_big_endian32 (header + MAGIC_SIZE, priority);
-  write_big_endian32 (header + MAGIC_SIZE + 4, mlen);
-  memcpy (header + HEADER_SIZE, message, mlen);
-
-  return send_buffer (pipe, packet, HEADER_SIZE + mlen, 0);
+  char header [HEADER_SIZE];
+  fill_header (header, priority, mlen);
+  if (num_rings > 0) {
+    struct shm_ring * ring = write_ring (pipe);
+    if (ring != NULL)   /* copy directly to the ring, no system call */
+      return send_ring (pipe, ring, header, message, mlen);
+  }
+/* sending the header and the message separately sometimes stalls for
+ * ~35ms-40ms on the second send, so send both with one system call */
+  struct iovec iov [2];
+  iov [0].iov_base = header;
+  iov [0].iov_len = HEADER_SIZE;
+  iov [1].iov_base = (char *) message;
+  iov [1].iov_len = mlen;
+  return send_iov (pipe, iov, 2, HEADER_SIZE + mlen);
 }
 
 int send_pipe_message (int pipe, const char * message, int mlen, int priority)
@@ -306,33 +611,44 @@ static int send_multiple_packets (int pipe, int num_messages,
   if (num_messages <= 0)
     return 0;
   int i;
-  int total = 0;
-  for (i = 0; i < num_messages; i++)
-    total += HEADER_SIZE + mlens [i];
   int result = 1;
 
-  char * packet = malloc (total);
-  if (packet == NULL) {  /* unable to malloc, use the slow strategy */
-    snprintf (log_buf, LOG_SIZE,
-              "unable to malloc %d bytes for %d packets, falling back\n",
-              total, num_messages);
-    log_print ();
+  struct shm_ring * ring = NULL;
+  if (num_rings > 0)
+    ring = write_ring (pipe);
+  if (ring != NULL) {   /* no need to combine the messages */
+    char header [HEADER_SIZE];
     for (i = 0; i < num_messages; i++) {
-      if (! send_pipe_message (pipe, messages [i], mlens [i], priorities [i]))
+      fill_header (header, priorities [i], mlens [i]);
+      if (! send_ring (pipe, ring, header, messages [i], mlens [i]))
         result = 0;
     }
     return result;
   }
-  char * header = packet;
-  for (i = 0; i < num_messages; i++) {
-    memcpy (header, MAGIC_STRING, MAGIC_SIZE);
-    write_big_endian32 (header + MAGIC_SIZE, priorities [i]);
-    write_big_endian32 (header + MAGIC_SIZE + 4, mlens [i]);
-    memcpy (header + HEADER_SIZE, messages [i], mlens [i]);
-    header += HEADER_SIZE + mlens [i];
-  }
 
-  return send_buffer (pipe, packet, total, 1);
+  /* each system call sends up to SEND_MULTIPLE_BATCH messages, directly
+   * from the callers' buffers, with the headers in between */
+  char headers [SEND_MULTIPLE_BATCH * HEADER_SIZE];
+  struct iovec iov [2 * SEND_MULTIPLE_BATCH];
+  int first;
+  for (first = 0; (result) && (first < num_messages);
+       first += SEND_MULTIPLE_BATCH) {
+    int count = num_messages - first;
+    if (count > SEND_MULTIPLE_BATCH)
+      count = SEND_MULTIPLE_BATCH;
+    int total = 0;
+    for (i = 0; i < count; i++) {
+      char * header = headers + i * HEADER_SIZE;
+      fill_header (header, priorities [first + i], mlens [first + i]);
+      iov [2 * i].iov_base = header;
+      iov [2 * i].iov_len = HEADER_SIZE;
+      iov [2 * i + 1].iov_base = (char *) (messages [first + i]);
+      iov [2 * i + 1].iov_len = mlens [first + i];
+      total += HEADER_SIZE + mlens [first + i];
+    }
+    result = send_iov (pipe, iov, 2 * count, total);
+  }
+  return result;
 }
 
 /* send multiple messages at once, again to avoid the mysterious system
@@ -379,6 +695,371 @@ int send_pipe_message_free (int pipe, char * message, int mlen, int priority)
   return result;
 }
 
+static void release_frame (struct queued_frame * frame)
+{
+  frame->refs--;
+  if (frame->refs <= 0)
+    free (frame);
+}
+
+/* writes as much as it can without blocking.  Returns the number of
+ * bytes written, 0 if the pipe is full, or -1 for errors */
+static int write_some (int pipe, struct iovec * iov, int iovcnt)
+{
+  struct msghdr mh;
+  memset (&mh, 0, sizeof (mh));
+  mh.msg_iov = iov;
+  mh.msg_iovlen = iovcnt;
+  int w = sendmsg (pipe, &mh, MSG_DONTWAIT);
+  if ((w < 0) && (errno == ENOTSOCK))   /* the pipe should be nonblocking */
+    w = writev (pipe, iov, iovcnt);
+  if (w >= 0)
+    return w;
+  if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+    return 0;
+  return -1;
+}
+
+static void drop_queue (struct pipe_queue * q)
+{
+  while (q->count > 0) {
+    release_frame (q->frames [q->first]);
+    q->first = (q->first + 1) % PIPE_QUEUE_FRAMES;
+    q->count--;
+  }
+  q->first = 0;
+  q->offset = 0;
+  q->bytes = 0;
+}
+
+/* a forked child must not send what its parent had queued */
+static void queues_after_fork ()
+{
+  int i;
+  for (i = 0; i < num_queues; i++)
+    drop_queue (queues + i);
+  num_queues = 0;
+#ifdef USE_EPOLL
+  if (out_epoll_fd >= 0)
+    close (out_epoll_fd);
+  out_epoll_fd = -1;
+  out_epoll_added = 0;
+#endif /* USE_EPOLL */
+}
+
+/* must be called with queues_mutex held */
+static struct pipe_queue * find_queue (int pipe, int create)
+{
+  int i;
+  for (i = 0; i < num_queues; i++)
+    if (queues [i].pipe == pipe)
+      return queues + i;
+  if (! create)
+    return NULL;
+  static int atfork_registered = 0;
+  if (! atfork_registered) {
+    pthread_atfork (NULL, NULL, queues_after_fork);
+    atfork_registered = 1;
+  }
+  struct pipe_queue * new_queues =
+    realloc (queues, (num_queues + 1) * sizeof (struct pipe_queue));
+  if (new_queues == NULL) {
+    snprintf (log_buf, LOG_SIZE, "unable to allocate queue for pipe %d\n",
+              pipe);
+    log_print ();
+    return NULL;
+  }
+  queues = new_queues;
+  struct pipe_queue * q = queues + num_queues;
+  num_queues++;
+  memset (q, 0, sizeof (struct pipe_queue));
+  q->pipe = pipe;
+  return q;
+}
+
+/* start or stop waiting for the pipe to become writable */
+static void watch_queue (struct pipe_queue * q, int watch)
+{
+  if (q->watched == watch)
+    return;
+#ifdef USE_EPOLL
+  if (out_epoll_fd < 0) {
+    out_epoll_fd = epoll_create (16);
+    if (out_epoll_fd < 0) {
+      perror ("watch_queue epoll_create");
+      return;  /* queues will only be flushed by the send calls */
+    }
+    fcntl (out_epoll_fd, F_SETFD, FD_CLOEXEC);
+  }
+  struct epoll_event ev;
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLOUT;
+  ev.data.fd = q->pipe;
+  epoll_ctl (out_epoll_fd, ((watch) ? EPOLL_CTL_ADD : EPOLL_CTL_DEL),
+             q->pipe, &ev);
+#endif /* USE_EPOLL */
+  q->watched = watch;
+}
+
+/* returns 1 if the queue is now empty, 0 if the pipe is full, and
+ * -1 for errors, in which case everything queued has been dropped */
+static int flush_queue (struct pipe_queue * q)
+{
+  while (q->count > 0) {
+    struct iovec iov [FLUSH_IOVECS];
+    int n = 0;
+    int i;
+    for (i = 0; (i < q->count) && (n < FLUSH_IOVECS); i++) {
+      struct queued_frame * f = q->frames [(q->first + i) % PIPE_QUEUE_FRAMES];
+      int skip = ((i == 0) ? q->offset : 0);
+      iov [n].iov_base = f->data + skip;
+      iov [n].iov_len = f->size - skip;
+      n++;
+    }
+    int w = write_some (q->pipe, iov, n);
+    if (w < 0) {
+      snprintf (log_buf, LOG_SIZE,
+                "pipe %d: error %d, dropping %d queued messages (%d bytes)\n",
+                q->pipe, errno, q->count, q->bytes);
+      log_print ();
+      drop_queue (q);
+      watch_queue (q, 0);
+      return -1;
+    }
+    if (w == 0)
+      return 0;
+    q->bytes -= w;
+    w += q->offset;   /* remove the frames that were completely sent */
+    while ((q->count > 0) && (w >= q->frames [q->first]->size)) {
+      w -= q->frames [q->first]->size;
+      release_frame (q->frames [q->first]);
+      q->first = (q->first + 1) % PIPE_QUEUE_FRAMES;
+      q->count--;
+    }
+    q->offset = w;
+  }
+  q->first = 0;
+  q->offset = 0;
+  watch_queue (q, 0);
+  return 1;
+}
+
+int flush_pipe_queues ()
+{
+  int total = 0;
+  pthread_mutex_lock (&queues_mutex);
+  int i;
+  for (i = 0; i < num_queues; i++) {
+    if (queues [i].count > 0)
+      flush_queue (queues + i);
+    total += queues [i].bytes;
+  }
+  pthread_mutex_unlock (&queues_mutex);
+  return total;
+}
+
+void set_pipe_queue_limit (int bytes)
+{
+  queue_limit = bytes;
+}
+
+/* sends or queues the frame on one pipe, returning 1 if the message was
+ * sent or queued, and 0 otherwise.  Called with queues_mutex held */
+static int send_or_queue (int pipe, char * header, const char * message,
+                          int mlen, struct queued_frame ** frame)
+{
+  struct pipe_queue * q = find_queue (pipe, 0);
+  if ((q != NULL) && (q->count > 0) && (flush_queue (q) < 0))
+    return 0;
+  int offset = 0;
+  if ((q == NULL) || (q->count == 0)) {   /* try to send it right away */
+    struct iovec iov [2];
+    iov [0].iov_base = header;
+    iov [0].iov_len = HEADER_SIZE;
+    iov [1].iov_base = (char *) message;
+    iov [1].iov_len = mlen;
+    int w = write_some (pipe, iov, 2);
+    if (w < 0) {
+      static int error_printed = -1;
+      if (error_printed != pipe) {
+        snprintf (log_buf, LOG_SIZE, "pipe %d: unable to send, errno %d\n",
+                  pipe, errno);
+        log_print ();
+        error_printed = pipe;
+      }
+      return 0;
+    }
+    if (w == HEADER_SIZE + mlen)
+      return 1;
+    offset = w;   /* the rest of the frame must be queued */
+    if (q == NULL)
+      q = find_queue (pipe, 1);
+    if (q == NULL)
+      return 0;
+  }
+  /* once part of a frame is sent, the rest must be queued */
+  if ((offset == 0) &&
+      ((q->count >= PIPE_QUEUE_FRAMES) ||
+       (q->bytes + HEADER_SIZE + mlen > queue_limit))) {
+    static int full_printed = -1;
+    if (full_printed != pipe) {
+      snprintf (log_buf, LOG_SIZE,
+                "queue for pipe %d is full (%d, %d bytes), dropping message\n",
+                pipe, q->count, q->bytes);
+      log_print ();
+      full_printed = pipe;
+    }
+    return 0;
+  }
+  if (*frame == NULL) {
+    *frame = malloc (sizeof (struct queued_frame) + HEADER_SIZE + mlen);
+    if (*frame == NULL) {
+      snprintf (log_buf, LOG_SIZE, "unable to allocate %d-byte frame\n",
+                (int) (HEADER_SIZE + mlen));
+      log_print ();
+      return 0;
+    }
+    (*frame)->refs = 1;   /* for the caller, released when it finishes */
+    (*frame)->size = HEADER_SIZE + mlen;
+    memcpy ((*frame)->data, header, HEADER_SIZE);
+    memcpy ((*frame)->data + HEADER_SIZE, message, mlen);
+  }
+  (*frame)->refs++;
+  q->frames [(q->first + q->count) % PIPE_QUEUE_FRAMES] = *frame;
+  if (q->count == 0)
+    q->offset = offset;
+  q->count++;
+  q->bytes += (*frame)->size - offset;
+  watch_queue (q, 1);
+  return 1;
+}
+
+int send_pipe_message_all (const int * pipes, int num_pipes,
+                           const char * message, int mlen, int priority,
+                           void (* sent_to) (int))
+{
+  if ((mlen < 0) || (mlen > ALLNET_MTU)) {
+    snprintf (log_buf, LOG_SIZE,
+              "send_pipe_message_all: mlen %d > ALLNET_MTU %d\n",
+              mlen, ALLNET_MTU);
+    log_print ();
+    return 0;
+  }
+  /* avoid SIGPIPE signals when writing to a closed pipe */
+  struct sigaction sa;
+  sa.sa_handler = SIG_IGN;
+  sa.sa_flags = 0;
+  sigemptyset (&(sa.sa_mask));
+  struct sigaction old_sa;
+  sigaction (SIGPIPE, &sa, &old_sa);
+
+  char header [HEADER_SIZE];
+  fill_header (header, priority, mlen);
+  struct queued_frame * frame = NULL;   /* only built if needed */
+  int sent = 0;
+  pthread_mutex_lock (&queues_mutex);
+  int i;
+  for (i = 0; i < num_pipes; i++) {
+    struct shm_ring * ring = NULL;
+    if (num_rings > 0)
+      ring = write_ring (pipes [i]);
+    if (ring != NULL)   /* rings never block, so need no queue */
+      sent += send_ring (pipes [i], ring, header, message, mlen);
+    else
+      sent += send_or_queue (pipes [i], header, message, mlen, &frame);
+    if (sent_to != NULL)
+      sent_to (i);
+  }
+  if (frame != NULL)
+    release_frame (frame);
+  pthread_mutex_unlock (&queues_mutex);
+
+  sigaction (SIGPIPE, &old_sa, NULL);
+  return sent;
+}
+
+/* how much longer all_available should wait, after a wakeup that only
+ * flushed output queues */
+static int remaining_timeout (int timeout, unsigned long long int start)
+{
+  if (timeout == PIPE_MESSAGE_WAIT_FOREVER)
+    return timeout;
+  unsigned long long int elapsed = allnet_time_ms () - start;
+  if (elapsed >= (unsigned long long int) timeout)
+    return PIPE_MESSAGE_NO_WAIT;
+  return timeout - (int) elapsed;
+}
+
+#ifdef USE_EPOLL
+
+/* fills in up to max available file descriptors, and returns how many,
+ * or 0 in case of timeout */
+/* timeout is in milliseconds, or one of PIPE_MESSAGE_WAIT_FOREVER or
+ * PIPE_MESSAGE_NO_WAIT, which have the same meaning for epoll_wait */
+/* epoll keeps ready fds on a list, and moves an fd to the end of the list
+ * each time it is returned, so asking for a few events at a time still
+ * gives every ready fd its turn */
+static int all_available (int extra, int timeout, int * fds, int max)
+{
+#ifdef DEBUG_PRINT
+  snprintf (log_buf, LOG_SIZE, "all_available (%d, %d)\n", extra, timeout);
+  log_print ();
+#endif /* DEBUG_PRINT */
+  pthread_mutex_lock (&pipes_mutex);
+  int efd = get_epoll_fd ();
+  if (extra != epoll_extra) {   /* only change the set when extra changes */
+    if ((epoll_extra != -1) && (pipe_index (epoll_extra) < 0))
+      epoll_remove_fd (epoll_extra);
+    epoll_extra = -1;
+    if ((extra != -1) && (pipe_index (extra) < 0)) {
+      epoll_add_fd (extra);
+      epoll_extra = extra;
+    }
+  }
+  if ((out_epoll_fd >= 0) && (! out_epoll_added)) {
+    epoll_add_fd (out_epoll_fd);
+    out_epoll_added = 1;
+  }
+  pthread_mutex_unlock (&pipes_mutex);
+  struct epoll_event events [MAX_READY_FDS];
+  if (max > MAX_READY_FDS)
+    max = MAX_READY_FDS;
+  unsigned long long int start = allnet_time_ms ();
+  while (1) {
+    int s = epoll_wait (efd, events, max, timeout);
+    if (s < 0) {
+      if (errno == EINTR)   /* interrupted by a signal, treat as a timeout */
+        return 0;
+      if (! do_not_print)
+        perror ("all_available/epoll_wait");
+      snprintf (log_buf, LOG_SIZE, "some error in epoll_wait, aborting\n");
+      log_print ();
+      exit (1);
+    }
+    int count = 0;
+    int writable = 0;
+    int i;
+    for (i = 0; i < s; i++) {
+      if ((out_epoll_fd >= 0) && (events [i].data.fd == out_epoll_fd))
+        writable = 1;     /* some pipe with queued output is writable */
+      else
+        fds [count++] = events [i].data.fd;
+    }
+    if (writable)
+      flush_pipe_queues ();
+#ifdef DEBUG_PRINT
+    snprintf (log_buf, LOG_SIZE, "all_available returning %d, first %d\n",
+              count, ((count > 0) ? fds [0] : -1));
+    log_print ();
+#endif /* DEBUG_PRINT */
+    if ((count > 0) || (! writable) || (timeout == PIPE_MESSAGE_NO_WAIT))
+      return count;
+    timeout = remaining_timeout (timeout, start);
+  }
+}
+
+#else /* USE_EPOLL */
+
 static void add_fd_to_bitset (fd_set * set, int fd, int * max)
 {
   FD_SET (fd, set);
@@ -411,17 +1092,23 @@ static struct timeval * set_timeout (int timeout, struct timeval * tvp)
   return tvp;
 }
 
-/* returns exactly one fd, choosing extra first, and then fds appearing
+/* returns up to max fds, choosing extra first, and then fds appearing
  * earlier in the buffers array.  The order is probably not a big deal */
-/* returns -1 (and prints some messages) if nothing found */
-static int find_fd (fd_set * set, int extra, int select_result, int max_pipe)
+/* returns 0 (and prints some messages) if nothing found */
+static int find_fds (fd_set * set, int extra, int select_result, int max_pipe,
+                     int * fds, int max)
 {
+  int count = 0;
   if ((extra != -1) && (FD_ISSET (extra, set)))
-    return extra;
+    fds [count++] = extra;
   int i;
-  for (i = 0; i < num_pipes; i++)
+  pthread_mutex_lock (&pipes_mutex);
+  for (i = 0; (i < num_pipes) && (count < max); i++)
     if (FD_ISSET (buffers [i].pipe_fd, set))
-      return buffers [i].pipe_fd;
+      fds [count++] = buffers [i].pipe_fd;
+  pthread_mutex_unlock (&pipes_mutex);
+  if (count > 0)
+    return count;
   /* we hope not to hit the rest of this code -- mostly debugging */
   int x = snprintf (log_buf, LOG_SIZE,
                     "find_fd: strange, s is %d but no pipes found\n",
@@ -443,16 +1130,17 @@ static int find_fd (fd_set * set, int extra, int select_result, int max_pipe)
     }
   }
   print_pipes ("not found", found_set);
-  return -1;
+  return 0;
 }
 
-/* returns the first available file descriptor, or -1 in case of timeout */
+/* fills in up to max available file descriptors, and returns how many,
+ * or 0 in case of timeout */
 /* timeout is in milliseconds, or one of PIPE_MESSAGE_WAIT_FOREVER or
  * PIPE_MESSAGE_NO_WAIT */
-static int next_available (int extra, int timeout)
+static int all_available (int extra, int timeout, int * fds, int max)
 {
 #ifdef DEBUG_PRINT
-  snprintf (log_buf, LOG_SIZE, "next_available (%d, %d)\n", extra, timeout);
+  snprintf (log_buf, LOG_SIZE, "all_available (%d, %d)\n", extra, timeout);
   log_print ();
 #endif /* DEBUG_PRINT */
   /* set up the readfd bitset */
@@ -460,58 +1148,95 @@ static int next_available (int extra, int timeout)
   int max_pipe = 0;
   fd_set receiving;
   FD_ZERO (&receiving);
+  pthread_mutex_lock (&pipes_mutex);
   for (i = 0; i < num_pipes; i++)
     add_fd_to_bitset (&receiving, buffers [i].pipe_fd, &max_pipe);
+  pthread_mutex_unlock (&pipes_mutex);
   if (extra != -1)
     add_fd_to_bitset (&receiving, extra, &max_pipe);
+  fd_set all_receiving = receiving;  /* select changes receiving */
+
+  unsigned long long int start = allnet_time_ms ();
+  int s;
+  while (1) {
+    receiving = all_receiving;
+    /* pipes with queued output are flushed when they become writable */
+    int max_fd = max_pipe;
+    fd_set sending;
+    FD_ZERO (&sending);
+    pthread_mutex_lock (&queues_mutex);
+    for (i = 0; i < num_queues; i++)
+      if (queues [i].count > 0)
+        add_fd_to_bitset (&sending, queues [i].pipe, &max_fd);
+    pthread_mutex_unlock (&queues_mutex);
 
-  /* set up the timeout, if any */
-  struct timeval tv;
-  struct timeval * tvp = set_timeout (timeout, &tv);
+    /* set up the timeout, if any */
+    struct timeval tv;
+    struct timeval * tvp = set_timeout (timeout, &tv);
 
-  /* call select */
-  int s = select (max_pipe + 1, &receiving, NULL, NULL, tvp);
+    /* call select */
+    s = select (max_fd + 1, &receiving, &sending, NULL, tvp);
 #ifdef DEBUG_PRINT
-  snprintf (log_buf, LOG_SIZE, "select done, pipe %d/%d\n", s, num_pipes);
-  log_print ();
-#endif /* DEBUG_PRINT */
-  if (s < 0) {
-    if (! do_not_print)
-      perror ("next_available/select");
-    print_pipes ("current", max_pipe);
-    snprintf (log_buf, LOG_SIZE, "some error in select, aborting\n");
+    snprintf (log_buf, LOG_SIZE, "select done, pipe %d/%d\n", s, num_pipes);
     log_print ();
-    exit (1);
+#endif /* DEBUG_PRINT */
+    if (s < 0) {
+      if (! do_not_print)
+        perror ("all_available/select");
+      print_pipes ("current", max_pipe);
+      snprintf (log_buf, LOG_SIZE, "some error in select, aborting\n");
+      log_print ();
+      exit (1);
+    }
+    int writable = 0;
+    for (i = 0; i <= max_fd; i++)
+      if (FD_ISSET (i, &sending))
+        writable++;
+    if (writable > 0)
+      flush_pipe_queues ();
+    s -= writable;
+    if (s > 0)
+      break;
+    if ((writable == 0) || (timeout == PIPE_MESSAGE_NO_WAIT))
+      return 0;
+    timeout = remaining_timeout (timeout, start);
   }
-  if (s == 0)
-    return -1;
   /* s > 0 */
-  int found = find_fd (&receiving, extra, s, max_pipe);
+  int found = find_fds (&receiving, extra, s, max_pipe, fds, max);
 #ifdef DEBUG_PRINT
-  snprintf (log_buf, LOG_SIZE, "next_available returning %d\n", found);
+  snprintf (log_buf, LOG_SIZE, "all_available returning %d\n", found);
   log_print ();
 #endif /* DEBUG_PRINT */
   return found;
 }
 
+#endif /* USE_EPOLL */
+
+/* returns the first available file descriptor, or -1 in case of timeout */
+static int next_available (int extra, int timeout)
+{
+  int fd;
+  if (all_available (extra, timeout, &fd, 1) > 0)
+    return fd;
+  return -1;
+}
+
 /* returns 1 if the fd is ready to receive, 0 otherwise (including
  * in case of errors) */
 static int fd_can_recv (int fd, int wait_forever)
 {
-  fd_set receiving;
-  FD_ZERO (&receiving);
-  FD_SET (fd, &receiving);
-  struct timeval tv = {0, 0};   /* do not wait, just check the fd */
-  struct timeval * tvp = &tv;
-  if (wait_forever)
-    tvp = NULL;
-  int s = select (fd + 1, &receiving, NULL, NULL, tvp);
+  /* poll, unlike select, works for any fd, no matter how large */
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  int s = poll (&pfd, 1, ((wait_forever) ? -1 : 0));
   if (s > 0)
     return 1;
   if (s < 0) { 
-    perror ("fd_can_recv/select");
+    perror ("fd_can_recv/poll");
     snprintf (log_buf, LOG_SIZE,
-              "fd_can_recv (%d): select returned %d\n", fd, s);
+              "fd_can_recv (%d): poll returned %d\n", fd, s);
     log_print ();
   }
   return 0;
@@ -582,9 +1307,212 @@ static void shift_header (char * header)
     header [i] = header [i + 1];
 }
 
+/* gets a message from the given ring, if one is available.
+ * returns the size of the message, 0 if none is available,
+ * and -1 in case of errors */
+static int receive_one_ring (int pipe, struct shm_ring * ring,
+                             char ** message, int * priority)
+{
+  int available = shm_ring_available (ring);
+  if (available < HEADER_SIZE)
+    return 0;
+  char header [HEADER_SIZE];
+  shm_ring_read (ring, header, HEADER_SIZE);
+  int received_len = parse_header (header, pipe, priority);
+  /* the writer always adds complete messages, so this should never fail */
+  if ((received_len < 0) || (received_len > available - HEADER_SIZE)) {
+    snprintf (log_buf, LOG_SIZE, "ring for pipe %d is corrupted (%d/%d)\n",
+              pipe, received_len, available);
+    log_print ();
+    return -1;
+  }
+  if (received_len == 0)  /* nothing to return */
+    return 0;
+  char * buffer = pkt_pool_alloc (received_len);
+  if (buffer == NULL) {
+    snprintf (log_buf, LOG_SIZE,
+              "unable to allocate %d bytes for ring message\n", received_len);
+    log_print ();
+    return -1;
+  }
+  shm_ring_read (ring, buffer, received_len);
+  *message = buffer;
+  return received_len;
+}
+
+/* returns the first message available on any of the rings for which
+ * this process has called add_pipe on the read fd.  Returns 0 if no
+ * message is available, -1 for errors, otherwise the message size */
+static int receive_ring_message (char ** message, int * from_pipe,
+                                 int * priority)
+{
+  static int next_ring = 0;   /* round-robin among the rings */
+  int i;
+  for (i = 0; i < num_rings; i++) {
+    int index = (next_ring + i) % num_rings;
+    int pipe = rings [index].read_fd;
+    pthread_mutex_lock (&pipes_mutex);
+    int added = ((pipe >= 0) && (pipe_index (pipe) >= 0));
+    pthread_mutex_unlock (&pipes_mutex);
+    if (! added)
+      continue;
+    int r = receive_one_ring (pipe, rings [index].ring, message, priority);
+    if (r != 0) {
+      if (from_pipe != NULL) *from_pipe = pipe;
+      next_ring = index + 1;
+      return r;
+    }
+  }
+  return 0;
+}
+
+/* sets or clears the waiting flag on all the rings we receive from.
+ * when setting, returns the number of bytes available in these rings */
+static int set_rings_waiting (int waiting)
+{
+  int result = 0;
+  int i;
+  pthread_mutex_lock (&pipes_mutex);
+  for (i = 0; i < num_rings; i++)
+    if ((rings [i].read_fd >= 0) && (pipe_index (rings [i].read_fd) >= 0))
+      result += shm_ring_set_waiting (rings [i].ring, waiting);
+  pthread_mutex_unlock (&pipes_mutex);
+  return result;
+}
+
+/* reads the wakeups written to a pipe that has a ring.
+ * returns 0 normally, or -1 if the pipe has been closed */
+static int drain_ring_wakeups (int pipe)
+{
+  char buffer [64];
+  int r = read (pipe, buffer, sizeof (buffer));
+  if (r == 0) {
+    snprintf (log_buf, LOG_SIZE, "ring pipe %d is closed\n", pipe);
+    log_print ();
+    return -1;
+  }
+  if ((r < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) &&
+      (errno != EINTR))
+    return -1;
+  return 0;
+}
+
+/* reads whatever is available on the pipe into its buffer.  Should only
+ * be called when the pipe is ready to read, since it may block otherwise.
+ * returns the number of bytes read (0 if nothing was available),
+ * or -1 if the pipe is closed or has an error */
+static int pipe_fill (struct allnet_pipe_info * bp)
+{
+  int pipe = bp->pipe_fd;
+  if (bp->start > 0) {   /* move any partial message to the front */
+    memmove (bp->buffer, bp->buffer + bp->start, bp->end - bp->start);
+    bp->end -= bp->start;
+    bp->start = 0;
+  }
+  int wanted = bp->end + PIPE_READ_SIZE;
+  if (bp->end >= HEADER_SIZE) {  /* make room for all of a large message */
+    int mlen = parse_header (bp->buffer, pipe, NULL);
+    if ((mlen > 0) && (HEADER_SIZE + mlen > wanted))
+      wanted = HEADER_SIZE + mlen;
+  }
+  if (bp->bsize < wanted) {
+    char * new_buffer = realloc (bp->buffer, wanted);
+    if (new_buffer == NULL) {
+      snprintf (log_buf, LOG_SIZE,
+                "unable to allocate %d bytes to receive on pipe %d\n",
+                wanted, pipe);
+      log_print ();
+      return -1;
+    }
+    bp->buffer = new_buffer;
+    bp->bsize = wanted;
+  }
+  int r = read (pipe, bp->buffer + bp->end, bp->bsize - bp->end);
+  if (r == 0) {
+    snprintf (log_buf, LOG_SIZE, "pipe_fill: pipe %d is closed\n", pipe);
+    log_print ();
+    return -1;
+  }
+  if (r < 0) {
+    if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+      return 0;
+#ifdef DEBUG_PRINT
+    perror ("pipemsg.c pipe_fill read");
+#endif /* DEBUG_PRINT */
+    snprintf (log_buf, LOG_SIZE, "pipe_fill: error %d on pipe %d\n",
+              errno, pipe);
+    log_print ();
+    return -1;
+  }
+  bp->end += r;
+  return r;
+}
+
+/* if the buffer holds a complete message, sets *message to point to it
+ * and returns its size.  Otherwise returns 0.  The message is in the
+ * pipe's buffer, so it must be used before calling pipe_done */
+static int pipe_next_frame (struct allnet_pipe_info * bp, char ** message,
+                            int * priority)
+{
+  while (bp->end - bp->start >= HEADER_SIZE) {
+    char * header = bp->buffer + bp->start;
+    int prio;
+    int mlen = parse_header (header, bp->pipe_fd, &prio);
+    if (mlen < 0) {   /* unsynchronized, skip a byte and try again */
+      bp->start++;
+      continue;
+    }
+    if (bp->end - bp->start - HEADER_SIZE < mlen)
+      return 0;       /* have not received all of it yet */
+    bp->start += HEADER_SIZE + mlen;
+    if (mlen > 0) {   /* nothing to return for empty messages */
+      *message = header + HEADER_SIZE;
+      if (priority != NULL)
+        *priority = prio;
+      return mlen;
+    }
+  }
+  return 0;
+}
+
+/* called when done with the messages returned by pipe_next_frame.
+ * puts the pipe on the pending list if another message can be returned
+ * right away, and frees an empty buffer if we have many pipes */
+static void pipe_done (struct allnet_pipe_info * bp)
+{
+  int available = bp->end - bp->start;
+  if (available == 0) {
+    bp->start = bp->end = 0;
+    if ((num_pipes > KEEP_BUFFER_PIPES) && (bp->buffer != NULL)) {
+      free (bp->buffer);
+      bp->buffer = NULL;
+      bp->bsize = 0;
+    }
+    pending_remove (bp);
+    return;
+  }
+  int complete = 0;
+  if (available >= HEADER_SIZE) {
+    char * header = bp->buffer + bp->start;
+    if (memcmp (header, MAGIC_STRING, MAGIC_SIZE) != 0) {
+      complete = 1;   /* let pipe_next_frame resynchronize */
+    } else {
+      int mlen = read_big_endian32 (header + MAGIC_SIZE + PRIORITY_SIZE);
+      complete = ((mlen < 0) || (available - HEADER_SIZE >= mlen));
+    }
+  }
+  if (complete)
+    pending_add (bp);
+  else
+    pending_remove (bp);
+}
+
 /* similar to receive_pipe_message but may return 0 if no message
  * is immediately ready to return.  returns -1 in case of error */
-static int receive_pipe_message_poll (int pipe, char ** message, int * priority)
+/* only reads the pipe if do_read is nonzero, otherwise only returns
+ * a message that is already buffered.  Call with pipes_mutex held */
+static int receive_pipe_message_poll (int pipe, char ** message,
+                                      int * priority, int do_read)
 {
   *message = NULL;
   int index = pipe_index (pipe);
@@ -600,54 +1528,68 @@ static int receive_pipe_message_poll (int pipe, char ** message, int * priority)
   }
   struct allnet_pipe_info * bp = buffers + index;
 
-  int offset = bp->filled;
-  int read = receive_bytes (pipe, bp->buffer + offset, bp->bsize - offset, 0);
-  if (read <= 0) {
-    return -1;
+  char * data = NULL;
+  int mlen = pipe_next_frame (bp, &data, priority);
+  if ((mlen == 0) && (do_read)) {
+    if (pipe_fill (bp) < 0)
+      return -1;
+    mlen = pipe_next_frame (bp, &data, priority);
   }
-  offset += read;
-  if (offset == bp->bsize) {
-   /* received all we were looking for, either allocate new buffer or return */
-    if (bp->in_header) {
-      int received_len = parse_header (bp->header, pipe, priority);
-      if (received_len != -1) {  /* successfully read a header */
-        bp->buffer = malloc (received_len);
-        if (bp->buffer == NULL) {
-          snprintf (log_buf, LOG_SIZE,
-                    "failed to allocate %d for receive_pipe_message_poll\n",
-                    received_len);
-          log_print ();
-          return -1;
-        }
-        bp->bsize = received_len;
-        bp->in_header = 0;
-        bp->filled = 0;
-      } else {  /* failed to parse, i.e. no magic_string at start of header */
-        shift_header (bp->header);            /* shift header and try again */
-        if (bp->filled > 0)
-          bp->filled = bp->filled - 1;
-      }
-      /* we stopped because the header was filled.  Try again, for either
-         the next attempt to match, or the actual data */
-/* printf ("recursive call rpmp (%d, %p, %d)\n", pipe, *message, *priority); */
-      return receive_pipe_message_poll (pipe, message, priority);
-    } else {    /* not reading header and buffer is full, so we are done. */
-      *message = bp->buffer;
-      int result = bp->bsize;
-      bp->in_header = 1;  /* next time read a new header */
-      bp->buffer = bp->header;
-      bp->bsize = HEADER_SIZE;
-      bp->filled = 0;
-      return result;
-    }
-  } /* else buffer is not filled, just return to caller */
-  return 0;
+  if (mlen > 0) {
+    *message = pkt_pool_alloc (mlen);
+    if (*message == NULL) {
+      snprintf (log_buf, LOG_SIZE,
+                "failed to allocate %d for receive_pipe_message_poll\n",
+                mlen);
+      log_print ();
+      return -1;
+    }
+    memcpy (*message, data, mlen);
+  }
+  pipe_done (bp);
+  return mlen;
+}
+
+void release_pipe_message (char * message)
+{
+  pkt_pool_release (message);
 }
 
 /* receives the message into a buffer it allocates for the purpose. */
-/* the caller is responsible for freeing the buffer. */
+/* the caller is responsible for releasing the buffer. */
 int receive_pipe_message (int pipe, char ** message, int * priority)
 {
+  struct shm_ring * ring = NULL;
+  if (num_rings > 0)
+    ring = read_ring (pipe);
+  while (ring != NULL) {   /* wait until the ring has a message */
+    int r = receive_one_ring (pipe, ring, message, priority);
+    if (r != 0)
+      return r;
+    if (shm_ring_set_waiting (ring, 1) == 0)
+      fd_can_recv (pipe, 1);
+    shm_ring_set_waiting (ring, 0);
+    if ((drain_ring_wakeups (pipe) < 0) && (shm_ring_available (ring) == 0))
+      return -1;
+  }
+
+  /* an added pipe may have more than one message in its buffer, from an
+   * earlier batched or polled receive, so read it through the buffer */
+  int can_read = 0;
+  while (1) {
+    pthread_mutex_lock (&pipes_mutex);
+    int added = (pipe_index (pipe) >= 0);
+    int r = 0;
+    if (added)
+      r = receive_pipe_message_poll (pipe, message, priority, can_read);
+    pthread_mutex_unlock (&pipes_mutex);
+    if (! added)
+      break;   /* not (or no longer) buffered, read it directly */
+    if (r != 0)
+      return r;
+    can_read = fd_can_recv (pipe, 1);
+  }
+
   char header [HEADER_SIZE];
 
   int wanted = HEADER_SIZE;
@@ -669,7 +1611,7 @@ int receive_pipe_message (int pipe, char ** message, int * priority)
   }
 
   /* allocate the result buffer */
-  char * buffer = malloc (received_len);
+  char * buffer = pkt_pool_alloc (received_len);
   if (buffer == NULL) {
     snprintf (log_buf, LOG_SIZE,
               "unable to allocate %d bytes for receive_pipe_message buffer\n",
@@ -680,7 +1622,7 @@ int receive_pipe_message (int pipe, char ** message, int * priority)
   /* printf ("receive_pipe_message allocated buffer %p\n", buffer); */
 
   if (receive_bytes (pipe, buffer, received_len, 1) < 0) {
-    free (buffer);
+    pkt_pool_release (buffer);
     return -1;
   }
 
@@ -709,7 +1651,7 @@ static int tv_compare (struct timeval * t1, struct timeval * t2)
 static int receive_dgram (int fd, char ** message, 
                           struct sockaddr * sa, socklen_t * salen)
 {
-  *message = malloc (ALLNET_MTU);
+  *message = pkt_pool_alloc (ALLNET_MTU);
   if (*message == NULL) {
     snprintf (log_buf, LOG_SIZE,
               "unable to allocate %d bytes for receive_dgram", ALLNET_MTU);
@@ -724,7 +1666,7 @@ static int receive_dgram (int fd, char ** message,
   if (result < 0) {
     if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
       perror ("recvfrom");
-    free (*message);
+    pkt_pool_release (*message);
     *message = NULL;
     if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
       return -1;
@@ -758,13 +1700,68 @@ int receive_pipe_message_fd (int timeout, char ** message, int fd,
   if (priority != NULL) *priority = ALLNET_PRIORITY_EPSILON;
   while ((timeout == PIPE_MESSAGE_WAIT_FOREVER) ||
          (tv_compare (&now, &finish) <= 0)) {
-    int pipe;
-    pipe = next_available (fd, timeout);
+    if (num_pending > 0) {   /* a message is already buffered */
+      int pipe = -1;
+      int r = 0;
+      pthread_mutex_lock (&pipes_mutex);
+      if (num_pending > 0) {
+        pipe = pending [0];
+        r = receive_pipe_message_poll (pipe, message, priority, 0);
+      }
+      pthread_mutex_unlock (&pipes_mutex);
+      if (r != 0) {
+        if (from_pipe != NULL) *from_pipe = pipe;
+        if ((sa != NULL) && (salen != NULL) && (*salen > 0))
+          bzero (sa, *salen);
+        if (salen != NULL)
+          *salen = 0;
+        return r;
+      }
+    }
+    int pipe = -1;
+    if (num_rings > 0) {
+      if (ring_burst >= MAX_RING_BURST) {
+        ring_burst = 0;   /* give the other pipes and sockets a turn */
+        pipe = next_available (fd, PIPE_MESSAGE_NO_WAIT);
+      }
+      if (pipe < 0) {
+        int r = receive_ring_message (message, from_pipe, priority);
+        if (r != 0) {
+          if ((sa != NULL) && (salen != NULL) && (*salen > 0))
+            bzero (sa, *salen);
+          if (salen != NULL)
+            *salen = 0;
+          ring_burst++;
+          return r;
+        }
+        if (set_rings_waiting (1) > 0) {  /* a message arrived meanwhile */
+          set_rings_waiting (0);
+          continue;
+        }
+        pipe = next_available (fd, timeout);
+        set_rings_waiting (0);
+      }
+    } else {
+      pipe = next_available (fd, timeout);
+    }
     if (pipe >= 0) { /* can read pipe */
       if (from_pipe != NULL) *from_pipe = pipe;
       int r;
-      if (pipe != fd) { /* it is a pipe, not a datagram socket */
-        r = receive_pipe_message_poll (pipe, message, priority);
+      struct shm_ring * ring = NULL;
+      if (num_rings > 0)
+        ring = read_ring (pipe);
+      if (ring != NULL) {   /* the message, if any, is in the ring */
+        r = drain_ring_wakeups (pipe);
+        /* if closed, first deliver whatever is still in the ring */
+        if ((r < 0) && (shm_ring_available (ring) > 0))
+          r = 0;
+      } else if (pipe != fd) { /* it is a pipe, not a datagram socket */
+        pthread_mutex_lock (&pipes_mutex);
+        if (pipe_index (pipe) >= 0)
+          r = receive_pipe_message_poll (pipe, message, priority, 1);
+        else  /* another thread removed it after it became ready */
+          r = 0;
+        pthread_mutex_unlock (&pipes_mutex);
 /* if (r < 0) printf ("receive_pipe_message_poll returned %d\n", r); */
         if ((sa != NULL) && (salen != NULL) && (*salen > 0))
           bzero (sa, *salen);
@@ -786,6 +1783,254 @@ int receive_pipe_message_fd (int timeout, char ** message, int fd,
   return 0;    /* timed out */
 }
 
+struct batch_state {
+  struct pipe_message * msgs;
+  int max;
+  char * arena;
+  int asize;
+  int count;     /* number of msgs filled in so far */
+  int used;      /* number of bytes of the arena used so far */
+};
+
+/* messages in the arena are aligned like malloc'd messages would be */
+#define ARENA_ALIGN(n)	(((n) + 7) & ~7)
+
+static int batch_has_room (struct batch_state * b, int mlen)
+{
+  return ((b->count < b->max) && (b->used + mlen <= b->asize));
+}
+
+/* adds a message (or an error, if mlen < 0) to the batch, and returns it.
+ * for messages, the caller must copy the data to the returned message.
+ * batch_has_room must have been checked (for errors, count < max) */
+static struct pipe_message * batch_add (struct batch_state * b, int pipe,
+                                        int priority, int mlen)
+{
+  struct pipe_message * pm = b->msgs + b->count;
+  b->count++;
+  pm->message = NULL;
+  if (mlen > 0) {
+    pm->message = b->arena + b->used;
+    b->used = ARENA_ALIGN (b->used + mlen);
+    if (b->used > b->asize)
+      b->used = b->asize;
+  }
+  pm->mlen = mlen;
+  pm->from_pipe = pipe;
+  pm->priority = priority;
+  pm->sa.ss_family = 0;
+  pm->salen = 0;
+  return pm;
+}
+
+/* copies complete messages from the pipe's buffer into the batch.
+ * call with pipes_mutex held, and call pipe_done afterwards */
+static void batch_from_buffer (struct batch_state * b,
+                               struct allnet_pipe_info * bp)
+{
+  while (b->count < b->max) {
+    char * data;
+    int priority;
+    int mlen = pipe_next_frame (bp, &data, &priority);
+    if (mlen <= 0)
+      return;
+    if (! batch_has_room (b, mlen)) {
+      if (mlen > b->asize) {   /* would never fit */
+        snprintf (log_buf, LOG_SIZE,
+                  "discarding %d-byte message from pipe %d, arena is %d\n",
+                  mlen, bp->pipe_fd, b->asize);
+        log_print ();
+        continue;
+      }
+      bp->start -= HEADER_SIZE + mlen;   /* leave it for the next batch */
+      return;
+    }
+    struct pipe_message * pm = batch_add (b, bp->pipe_fd, priority, mlen);
+    memcpy (pm->message, data, mlen);
+  }
+}
+
+/* copies complete messages from the ring into the batch */
+static void batch_from_ring (struct batch_state * b, int pipe,
+                             struct shm_ring * ring)
+{
+  while (b->count < b->max) {
+    int available = shm_ring_available (ring);
+    if (available < HEADER_SIZE)
+      return;
+    char header [HEADER_SIZE];
+    shm_ring_peek (ring, header, HEADER_SIZE);
+    int priority;
+    int mlen = parse_header (header, pipe, &priority);
+    /* the writer always adds complete messages, so this should never fail */
+    if ((mlen < 0) || (mlen > available - HEADER_SIZE)) {
+      snprintf (log_buf, LOG_SIZE, "ring for pipe %d is corrupted (%d/%d)\n",
+                pipe, mlen, available);
+      log_print ();
+      batch_add (b, pipe, ALLNET_PRIORITY_EPSILON, -1);
+      return;
+    }
+    if ((! batch_has_room (b, mlen)) && (mlen <= b->asize))
+      return;   /* leave it for the next batch */
+    shm_ring_read (ring, header, HEADER_SIZE);
+    if (mlen > b->asize) {     /* would never fit, discard it */
+      snprintf (log_buf, LOG_SIZE,
+                "discarding %d-byte message from ring %d, arena is %d\n",
+                mlen, pipe, b->asize);
+      log_print ();
+      while (mlen > 0) {
+        int n = ((mlen > HEADER_SIZE) ? HEADER_SIZE : mlen);
+        shm_ring_read (ring, header, n);
+        mlen -= n;
+      }
+    } else if (mlen > 0) {
+      struct pipe_message * pm = batch_add (b, pipe, priority, mlen);
+      shm_ring_read (ring, pm->message, mlen);
+    }
+  }
+}
+
+static void batch_from_rings (struct batch_state * b)
+{
+  int i;
+  for (i = 0; (i < num_rings) && (b->count < b->max); i++) {
+    int pipe = rings [i].read_fd;
+    pthread_mutex_lock (&pipes_mutex);
+    int added = ((pipe >= 0) && (pipe_index (pipe) >= 0));
+    pthread_mutex_unlock (&pipes_mutex);
+    if (added)
+      batch_from_ring (b, pipe, rings [i].ring);
+  }
+}
+
+/* adds to the batch all the messages that can be returned without
+ * reading from any fd */
+static void batch_from_pending (struct batch_state * b)
+{
+  pthread_mutex_lock (&pipes_mutex);
+  int i = 0;
+  while ((i < num_pending) && (b->count < b->max)) {
+    struct allnet_pipe_info * bp = buffers + pipe_index (pending [i]);
+    batch_from_buffer (b, bp);
+    pipe_done (bp);   /* may remove pending [i] */
+    if (bp->pending)  /* still pending, did not fit */
+      i++;
+  }
+  pthread_mutex_unlock (&pipes_mutex);
+  if (num_rings > 0)
+    batch_from_rings (b);
+}
+
+/* receives as many datagrams as are ready and fit in the batch */
+static void batch_from_dgram (struct batch_state * b, int fd)
+{
+  while (batch_has_room (b, ALLNET_MTU)) {
+    struct sockaddr_storage sas;
+    socklen_t salen = sizeof (sas);
+    int r = recvfrom (fd, b->arena + b->used, ALLNET_MTU, MSG_DONTWAIT,
+                      (struct sockaddr *) (&sas), &salen);
+    if (r < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        return;   /* no more messages ready at this time */
+      perror ("recvfrom");
+      batch_add (b, fd, ALLNET_PRIORITY_EPSILON, -1);
+      return;
+    }
+    if (r > 0) {  /* the data is already in place */
+      struct pipe_message * pm = batch_add (b, fd, ALLNET_PRIORITY_EPSILON, r);
+      memcpy (&(pm->sa), &sas, salen);
+      pm->salen = salen;
+    }
+  }
+}
+
+/* receives whatever is available on a ready fd */
+static void batch_from_fd (struct batch_state * b, int pipe, int extra)
+{
+  struct shm_ring * ring = NULL;
+  if (num_rings > 0)
+    ring = read_ring (pipe);
+  if (ring != NULL) {   /* the messages themselves are read from the ring */
+    if ((drain_ring_wakeups (pipe) < 0) && (shm_ring_available (ring) == 0))
+      batch_add (b, pipe, ALLNET_PRIORITY_EPSILON, -1);
+  } else if (pipe == extra) {
+    batch_from_dgram (b, pipe);
+  } else {
+    pthread_mutex_lock (&pipes_mutex);
+    int index = pipe_index (pipe);
+    if (index >= 0) {   /* else, removed by another thread */
+      struct allnet_pipe_info * bp = buffers + index;
+      batch_from_buffer (b, bp);
+      if (b->count < b->max) {
+        int r = pipe_fill (bp);
+        batch_from_buffer (b, bp);
+        /* report the error after any messages received before it */
+        if ((r < 0) && (b->count < b->max))
+          batch_add (b, pipe, ALLNET_PRIORITY_EPSILON, -1);
+      }
+      pipe_done (bp);
+    }
+    pthread_mutex_unlock (&pipes_mutex);
+  }
+}
+
+int receive_pipe_messages_batch_fd (int timeout, int fd,
+                                    struct pipe_message * msgs, int max,
+                                    char * arena, int asize)
+{
+  struct batch_state b;
+  b.msgs = msgs;
+  b.max = max;
+  b.arena = arena;
+  b.asize = asize;
+  b.count = 0;
+  b.used = 0;
+  if (max <= 0)
+    return 0;
+
+  struct timeval now, finish;
+  gettimeofday (&now, NULL);
+  finish = now;
+  if (timeout != PIPE_MESSAGE_WAIT_FOREVER)
+    add_us (&finish, timeout * 1000LL);
+  while ((timeout == PIPE_MESSAGE_WAIT_FOREVER) ||
+         (tv_compare (&now, &finish) <= 0)) {
+    batch_from_pending (&b);
+    int wait = timeout;
+    if (b.count > 0) {   /* return what we have, plus whatever is ready */
+      wait = PIPE_MESSAGE_NO_WAIT;
+    } else if ((num_rings > 0) && (set_rings_waiting (1) > 0)) {
+      set_rings_waiting (0);  /* a message arrived meanwhile */
+      continue;
+    }
+    int fds [MAX_READY_FDS];
+    int n = 0;
+    int want = max - b.count;
+    if (want > MAX_READY_FDS)
+      want = MAX_READY_FDS;
+    if (want > 0)
+      n = all_available (fd, wait, fds, want);
+    if ((num_rings > 0) && (b.count == 0))
+      set_rings_waiting (0);
+    int i;
+    for (i = 0; (i < n) && (b.count < max); i++)
+      batch_from_fd (&b, fds [i], fd);
+    if ((num_rings > 0) && (n > 0))   /* get any messages we were woken for */
+      batch_from_rings (&b);
+    if (b.count > 0)
+      return b.count;
+    gettimeofday (&now, NULL);
+  }
+  return 0;    /* timed out */
+}
+
+int receive_pipe_messages_batch (int timeout, struct pipe_message * msgs,
+                                 int max, char * arena, int asize)
+{
+  return receive_pipe_messages_batch_fd (timeout, -1, msgs, max,
+                                         arena, asize);
+}
+
 /* receive on the first ready pipe, returning the size and message
  * for the first one received, and returning 0 in case of timeout
  * and -1 in case of error, including a closed pipe.
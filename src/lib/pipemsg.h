@@ -15,6 +15,14 @@
 
 extern int send_pipe_message (int pipe, const char * message, int mlen, int priority);
 
+/* the bytes that send_pipe_message puts before each message */
+#define PIPE_MESSAGE_HEADER_SIZE	16
+/* fills in the header for a message of mlen bytes, so a thread can send
+ * header and message with a single write of its own.  Such a write does
+ * not save and restore the SIGPIPE handler, so the caller must make sure
+ * that SIGPIPE is ignored */
+extern void pipe_message_header (char * header, int priority, int mlen);
+
 /* same as send_pipe_message, but frees the memory referred to by message */
 extern int send_pipe_message_free (int pipe, char * message, int mlen,
                                    int priority);
@@ -29,15 +37,92 @@ extern int send_pipe_multiple_free (int pipe, int num_messages,
                                     char ** messages, const int * mlens,
                                     const int * priorities);
 
+/* send the same message to each of the pipes, without ever blocking.
+ * The message is framed once, and the frame is shared by all the pipes.
+ * Whatever cannot be written right away is added to an output queue
+ * for that pipe, which is sent in order before any later messages, and
+ * flushed whenever the pipe becomes writable while the process is in
+ * one of the receive calls, or when flush_pipe_queues is called.
+ * A message that would make a queue longer than the limit (in bytes)
+ * is dropped.  The pipes should be nonblocking, and should not be used
+ * with the other send functions.
+ * if sent_to is not NULL, it is called with the index of each pipe in pipes
+ * right after sending to (or queueing for) that pipe.
+ * returns the number of pipes to which the message was sent or queued */
+extern int send_pipe_message_all (const int * pipes, int num_pipes,
+                                  const char * message, int mlen,
+                                  int priority, void (* sent_to) (int));
+/* returns the number of bytes that are still queued */
+extern int flush_pipe_queues ();
+#define PIPE_QUEUE_DEFAULT_LIMIT	(256 * 1024)
+extern void set_pipe_queue_limit (int bytes);
+
 /* receives the message into a buffer it allocates for the purpose. */
-/* the caller is responsible for freeing the message buffer. */
+/* the caller is responsible for releasing the message buffer. */
 extern int receive_pipe_message (int pipe, char ** message, int * priority);
 
+/* the messages returned by receive_pipe_message, receive_pipe_message_any,
+ * and receive_pipe_message_fd come from a pool of buffers (pktpool.h),
+ * and must be given back with release_pipe_message rather than free */
+extern void release_pipe_message (char * message);
+
+/* used by the batch receive functions, one per message received */
+struct pipe_message {
+  char * message;    /* points into the arena given to the receive call */
+  int mlen;          /* message size, or -1 if from_pipe had an error */
+  int from_pipe;
+  int priority;
+  struct sockaddr_storage sa;  /* for messages received on the extra fd */
+  socklen_t salen;             /* 0 for messages received on pipes */
+};
+
+/* receive all the messages that are already buffered or can be read
+ * without waiting from any of the pipes, waiting up to timeout ms
+ * if none are available.  Returns the number of entries filled in msgs,
+ * at most max, or 0 in case of timeout.
+ * each message is copied into the caller's arena of asize bytes,
+ * so nothing needs to be freed, but the messages are only valid until
+ * the arena is reused.  An error on a pipe, including the pipe closing,
+ * is reported as an entry with mlen -1, after any messages received
+ * from that pipe before the error.  Messages larger than asize are
+ * discarded, so asize should be at least ALLNET_MTU */
+extern int receive_pipe_messages_batch (int timeout,
+                                        struct pipe_message * msgs, int max,
+                                        char * arena, int asize);
+/* same, but also receives datagrams from fd, as in receive_pipe_message_fd.
+ * messages from fd have the sender address in sa and salen */
+extern int receive_pipe_messages_batch_fd (int timeout, int fd,
+                                           struct pipe_message * msgs,
+                                           int max, char * arena, int asize);
+
 /* keeps track of which pipes are needed for receive_pipe_message_any,
  * which buffers partial messages received on a socket. */
+/* add_pipe and remove_pipe may be called from other threads */
 extern void add_pipe (int pipe);
 extern void remove_pipe (int pipe);
 
+/* the maximum number of pipes that can usefully be added */
+#ifdef __linux__   /* pipemsg uses epoll, only limited by available fds */
+#define PIPE_MESSAGE_MAX_FDS	65536
+#else /* __linux__ */   /* pipemsg uses select, limited to FD_SETSIZE */
+#define PIPE_MESSAGE_MAX_FDS	1024
+#endif /* __linux__ */
+
+/* optional shared-memory transport for pipes created before forking.
+ * add_pipe_ring must be called before forking, and sets up a ring
+ * of (at least) size bytes in memory shared with the children.
+ * messages sent on write_fd are then copied directly into the ring,
+ * and receiving on read_fd takes them from the ring.  The pipe is
+ * still needed, to wake up a receiver that is waiting and to detect
+ * when the other side has closed its end.
+ * returns 1 for success, 0 if the ring could not be created */
+extern int add_pipe_ring (int read_fd, int write_fd, int size);
+/* after forking, each process should call keep_pipe_rings with the
+ * pipes it will read and write (num_fds of each), so rings belonging to
+ * pipes it closes are not used if the fd numbers are reused. */
+extern void keep_pipe_rings (int num_fds, const int * read_fds,
+                             const int * write_fds);
+
 #define PIPE_MESSAGE_WAIT_FOREVER	-1
 #define PIPE_MESSAGE_NO_WAIT		0
 
@@ -45,7 +130,7 @@ extern void remove_pipe (int pipe);
  * for the first one received, and returning 0 in case of timeout
  * and -1 in case of error, including a closed pipe.
  * timeout is specified in ms.
- * the message (if any) is malloc'd, and must be free'd
+ * the message (if any) must be released with release_pipe_message
  * The pipe from which the message is received (or which has an error)
  * is returned in *from_pipe if not NULL.
  */
@@ -62,6 +147,9 @@ extern int receive_pipe_message_any (int timeout, char ** message,
  *
  * in case some other socket is ready first, or if fd is -1,
  * this call is the same as receive_pipe_message_any
+ *
+ * if fd is closed and a new socket reuses the same number, there
+ * should be at least one intervening call with a different fd (or -1)
  */
 extern int receive_pipe_message_fd (int timeout, char ** message, int fd,
                                     struct sockaddr * sa, socklen_t * salen,
@@ -0,0 +1,258 @@
+/* pktpool.c: thread-safe pool of packet-sized buffers */
+
+/* every buffer is preceded by a header giving its size class, so
+ * pkt_pool_release knows where to return it.  Free buffers are kept
+ * on singly-linked lists, first in a per-thread cache that needs no
+ * locking, and then in a shared pool protected by a mutex.  Buffers
+ * move between the two in batches, so the mutex is only needed about
+ * once every THREAD_CACHE_BATCH allocations or releases.  When a thread
+ * exits, its cached buffers go back to the shared pool */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "pktpool.h"
+#include "packet.h"
+#include "log.h"
+
+#define NUM_CLASSES	3
+static const int class_sizes [NUM_CLASSES] = { 256, 2048, ALLNET_MTU };
+/* how many free buffers of each class the shared pool keeps, beyond
+ * which buffers are returned to the system */
+static const int shared_max [NUM_CLASSES] = { 1024, 256, 128 };
+
+#define THREAD_CACHE_MAX	32
+#define THREAD_CACHE_BATCH	(THREAD_CACHE_MAX / 2)
+
+/* size_class for buffers too large for any class */
+#define LARGE_CLASS		NUM_CLASSES
+
+#define STATE_IN_USE		0x696e7573   /* "inus" */
+#define STATE_FREE		0x66726565   /* "free" */
+
+union pool_header {
+  struct {
+    int size_class;
+    int state;
+    union pool_header * next;   /* only used while on a free list */
+  } h;
+  long double align;   /* so the buffer is aligned like malloc'd memory */
+};
+
+struct thread_cache {
+  union pool_header * free [NUM_CLASSES];
+  int count [NUM_CLASSES];
+};
+
+static pthread_mutex_t shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+static union pool_header * shared_free [NUM_CLASSES];
+static int shared_count [NUM_CLASSES];
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static int cache_key_valid = 0;
+
+/* statistics, updated atomically */
+static long long int num_allocated = 0;
+static long long int num_available = 0;
+
+static void stat_add (long long int * counter, long long int value)
+{
+  __atomic_fetch_add (counter, value, __ATOMIC_RELAXED);
+}
+
+static int size_class (int size)
+{
+  int sc;
+  for (sc = 0; sc < NUM_CLASSES; sc++)
+    if (size <= class_sizes [sc])
+      return sc;
+  return LARGE_CLASS;
+}
+
+/* must be called with shared_mutex held */
+static void shared_push (union pool_header * h)
+{
+  int sc = h->h.size_class;
+  if (shared_count [sc] >= shared_max [sc]) {
+    stat_add (&num_allocated, -1);
+    stat_add (&num_available, -1);
+    free (h);
+    return;
+  }
+  h->h.next = shared_free [sc];
+  shared_free [sc] = h;
+  shared_count [sc]++;
+}
+
+/* must be called with shared_mutex held */
+static union pool_header * shared_pop (int sc)
+{
+  union pool_header * h = shared_free [sc];
+  if (h != NULL) {
+    shared_free [sc] = h->h.next;
+    shared_count [sc]--;
+  }
+  return h;
+}
+
+/* move up to count buffers of class sc from the cache to the shared pool */
+static void flush_cache (struct thread_cache * cache, int sc, int count)
+{
+  pthread_mutex_lock (&shared_mutex);
+  while ((count-- > 0) && (cache->free [sc] != NULL)) {
+    union pool_header * h = cache->free [sc];
+    cache->free [sc] = h->h.next;
+    cache->count [sc]--;
+    shared_push (h);
+  }
+  pthread_mutex_unlock (&shared_mutex);
+}
+
+static void refill_cache (struct thread_cache * cache, int sc)
+{
+  pthread_mutex_lock (&shared_mutex);
+  int i;
+  for (i = 0; i < THREAD_CACHE_BATCH; i++) {
+    union pool_header * h = shared_pop (sc);
+    if (h == NULL)
+      break;
+    h->h.next = cache->free [sc];
+    cache->free [sc] = h;
+    cache->count [sc]++;
+  }
+  pthread_mutex_unlock (&shared_mutex);
+}
+
+/* called when a thread exits */
+static void release_cache (void * arg)
+{
+  struct thread_cache * cache = (struct thread_cache *) arg;
+  int sc;
+  for (sc = 0; sc < NUM_CLASSES; sc++)
+    flush_cache (cache, sc, cache->count [sc]);
+  free (cache);
+}
+
+/* a thread that forks while another holds the mutex would leave the
+ * child unable to ever get the mutex */
+static void lock_before_fork ()
+{
+  pthread_mutex_lock (&shared_mutex);
+}
+
+static void unlock_after_fork ()
+{
+  pthread_mutex_unlock (&shared_mutex);
+}
+
+static void init_pool ()
+{
+  if (pthread_key_create (&cache_key, release_cache) == 0)
+    cache_key_valid = 1;
+  else
+    perror ("pkt_pool pthread_key_create");
+  pthread_atfork (lock_before_fork, unlock_after_fork, unlock_after_fork);
+}
+
+/* returns NULL if this thread cannot have a cache, in which case
+ * the shared pool is used directly */
+static struct thread_cache * get_cache ()
+{
+  pthread_once (&init_once, init_pool);
+  if (! cache_key_valid)
+    return NULL;
+  struct thread_cache * cache = pthread_getspecific (cache_key);
+  if (cache == NULL) {
+    cache = calloc (1, sizeof (struct thread_cache));
+    if ((cache != NULL) && (pthread_setspecific (cache_key, cache) != 0)) {
+      free (cache);
+      cache = NULL;
+    }
+  }
+  return cache;
+}
+
+char * pkt_pool_alloc (int size)
+{
+  if (size < 0)
+    return NULL;
+  int sc = size_class (size);
+  union pool_header * h = NULL;
+  if (sc != LARGE_CLASS) {
+    struct thread_cache * cache = get_cache ();
+    if (cache != NULL) {
+      if (cache->free [sc] == NULL)
+        refill_cache (cache, sc);
+      h = cache->free [sc];
+      if (h != NULL) {
+        cache->free [sc] = h->h.next;
+        cache->count [sc]--;
+      }
+    } else {
+      pthread_mutex_lock (&shared_mutex);
+      h = shared_pop (sc);
+      pthread_mutex_unlock (&shared_mutex);
+    }
+    if (h != NULL)
+      stat_add (&num_available, -1);
+  }
+  if (h == NULL) {
+    int bytes = ((sc == LARGE_CLASS) ? size : class_sizes [sc]);
+    h = malloc (sizeof (union pool_header) + bytes);
+    if (h == NULL) {
+      snprintf (log_buf, LOG_SIZE,
+                "pkt_pool_alloc unable to allocate %d bytes\n", size);
+      log_print ();
+      return NULL;
+    }
+    h->h.size_class = sc;
+    if (sc != LARGE_CLASS)
+      stat_add (&num_allocated, 1);
+  }
+  h->h.state = STATE_IN_USE;
+  h->h.next = NULL;
+  return (char *) (h + 1);
+}
+
+void pkt_pool_release (char * buffer)
+{
+  if (buffer == NULL)
+    return;
+  union pool_header * h = ((union pool_header *) buffer) - 1;
+  if (h->h.state != STATE_IN_USE) {  /* released twice, or not from pool */
+    snprintf (log_buf, LOG_SIZE,
+              "pkt_pool_release: buffer %p is not in use (%x), ignoring\n",
+              buffer, h->h.state);
+    log_print ();
+    return;
+  }
+  h->h.state = STATE_FREE;
+  int sc = h->h.size_class;
+  if ((sc < 0) || (sc >= NUM_CLASSES)) {
+    free (h);
+    return;
+  }
+  stat_add (&num_available, 1);
+  struct thread_cache * cache = get_cache ();
+  if (cache == NULL) {
+    pthread_mutex_lock (&shared_mutex);
+    shared_push (h);
+    pthread_mutex_unlock (&shared_mutex);
+    return;
+  }
+  h->h.next = cache->free [sc];
+  cache->free [sc] = h;
+  cache->count [sc]++;
+  if (cache->count [sc] > THREAD_CACHE_MAX)
+    flush_cache (cache, sc, THREAD_CACHE_BATCH);
+}
+
+void pkt_pool_stats (long long int * allocated, long long int * available)
+{
+  if (allocated != NULL)
+    *allocated = __atomic_load_n (&num_allocated, __ATOMIC_RELAXED);
+  if (available != NULL)
+    *available = __atomic_load_n (&num_available, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,25 @@
+/* pktpool.h: thread-safe pool of packet-sized buffers */
+
+#ifndef PKTPOOL_H
+#define PKTPOOL_H
+
+/* buffers come in a few size classes (256 bytes, 2KB, and ALLNET_MTU),
+ * so most packets fit in a buffer that is not much larger than needed.
+ * Each thread keeps a small cache of free buffers of each class, and
+ * only takes a lock to move buffers between its cache and the shared
+ * pool.  Larger requests are simply malloc'd and freed */
+
+/* returns a buffer of at least size bytes, aligned like malloc's,
+ * or NULL if the memory cannot be allocated */
+extern char * pkt_pool_alloc (int size);
+
+/* returns to the pool a buffer obtained from pkt_pool_alloc (NOT one
+ * obtained from malloc).  Does nothing if buffer is NULL */
+extern void pkt_pool_release (char * buffer);
+
+/* fills in (if not NULL) the number of buffers allocated from the
+ * system, and the number of those currently free in the pool */
+extern void pkt_pool_stats (long long int * allocated,
+                            long long int * available);
+
+#endif /* PKTPOOL_H */
@@ -0,0 +1,150 @@
+/* shmring.c: single-producer, single-consumer byte rings in memory that
+ * is shared between a process and the children it forks */
+
+/* the producer only ever advances head, and the consumer only ever
+ * advances tail.  Both are byte counts since the ring was created, so
+ * head - tail is always the number of bytes in the ring, and the
+ * position in the data array is the count modulo the (power of two) size.
+ * The waiting flag lets the consumer block on some other file descriptor
+ * (normally a pipe), and tells the producer when it needs to write to
+ * that descriptor to wake up the consumer.  Both sides use sequentially
+ * consistent accesses for head and waiting, so at least one of them
+ * sees the other's update, and a wakeup is never lost. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "shmring.h"
+#include "log.h"
+
+#ifndef MAP_ANON
+#define MAP_ANON	MAP_ANONYMOUS
+#endif /* MAP_ANON */
+
+#define CACHE_LINE	64
+
+struct shm_ring {
+  uint64_t head;         /* bytes written so far, only changed by producer */
+  char pad1 [CACHE_LINE - sizeof (uint64_t)];
+  uint64_t tail;         /* bytes read so far, only changed by consumer */
+  char pad2 [CACHE_LINE - sizeof (uint64_t)];
+  int waiting;           /* set by the consumer before it blocks */
+  char lock;             /* serializes producer threads of one process */
+  int size;              /* always a power of two */
+  size_t mapped;         /* how many bytes were mapped, for munmap */
+  char data [0];
+};
+
+struct shm_ring * shm_ring_create (int size)
+{
+  int actual = 4096;
+  while ((actual < size) && (actual < (1 << 30)))
+    actual = actual * 2;
+  size_t total = sizeof (struct shm_ring) + actual;
+  void * mem = mmap (NULL, total, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANON, -1, 0);
+  if (mem == MAP_FAILED) {
+    perror ("shm_ring_create mmap");
+    snprintf (log_buf, LOG_SIZE,
+              "unable to map %zd bytes for shared ring\n", total);
+    log_print ();
+    return NULL;
+  }
+  struct shm_ring * ring = (struct shm_ring *) mem;
+  memset (ring, 0, sizeof (struct shm_ring));  /* mmap zeroes it, but... */
+  ring->size = actual;
+  ring->mapped = total;
+  return ring;
+}
+
+void shm_ring_destroy (struct shm_ring * ring)
+{
+  if (ring != NULL)
+    munmap (ring, ring->mapped);
+}
+
+/* copy n bytes into the ring at the given (unwrapped) position */
+static void copy_in (struct shm_ring * ring, uint64_t pos,
+                     const char * from, int n)
+{
+  int index = (int) (pos & (ring->size - 1));
+  int first = ring->size - index;
+  if (first > n)
+    first = n;
+  memcpy (ring->data + index, from, first);
+  if (first < n)
+    memcpy (ring->data, from + first, n - first);
+}
+
+/* copy n bytes out of the ring from the given (unwrapped) position */
+static void copy_out (struct shm_ring * ring, uint64_t pos, char * to, int n)
+{
+  int index = (int) (pos & (ring->size - 1));
+  int first = ring->size - index;
+  if (first > n)
+    first = n;
+  memcpy (to, ring->data + index, first);
+  if (first < n)
+    memcpy (to + first, ring->data, n - first);
+}
+
+int shm_ring_write (struct shm_ring * ring,
+                    const char * b1, int n1, const char * b2, int n2)
+{
+  int n = n1 + n2;
+  if ((n1 < 0) || (n2 < 0) || (n > ring->size))
+    return 0;
+  while (__atomic_test_and_set (&(ring->lock), __ATOMIC_ACQUIRE))
+    ;  /* only contended if two threads send on the same pipe */
+  uint64_t head = __atomic_load_n (&(ring->head), __ATOMIC_RELAXED);
+  uint64_t tail = __atomic_load_n (&(ring->tail), __ATOMIC_ACQUIRE);
+  int result = 0;
+  if ((uint64_t) (ring->size) - (head - tail) >= (uint64_t) n) {
+    copy_in (ring, head, b1, n1);
+    if (n2 > 0)
+      copy_in (ring, head + n1, b2, n2);
+    __atomic_store_n (&(ring->head), head + n, __ATOMIC_SEQ_CST);
+    result = 1;
+  }
+  __atomic_clear (&(ring->lock), __ATOMIC_RELEASE);
+  return result;
+}
+
+int shm_ring_consumer_waiting (struct shm_ring * ring)
+{
+  return __atomic_load_n (&(ring->waiting), __ATOMIC_SEQ_CST);
+}
+
+int shm_ring_available (struct shm_ring * ring)
+{
+  uint64_t head = __atomic_load_n (&(ring->head), __ATOMIC_ACQUIRE);
+  uint64_t tail = __atomic_load_n (&(ring->tail), __ATOMIC_RELAXED);
+  return (int) (head - tail);
+}
+
+void shm_ring_peek (struct shm_ring * ring, char * buffer, int n)
+{
+  uint64_t tail = __atomic_load_n (&(ring->tail), __ATOMIC_RELAXED);
+  copy_out (ring, tail, buffer, n);
+}
+
+void shm_ring_read (struct shm_ring * ring, char * buffer, int n)
+{
+  uint64_t tail = __atomic_load_n (&(ring->tail), __ATOMIC_RELAXED);
+  copy_out (ring, tail, buffer, n);
+  __atomic_store_n (&(ring->tail), tail + n, __ATOMIC_RELEASE);
+}
+
+int shm_ring_set_waiting (struct shm_ring * ring, int waiting)
+{
+  __atomic_store_n (&(ring->waiting), waiting, __ATOMIC_SEQ_CST);
+  if (! waiting)
+    return 0;
+  /* must be sequentially consistent to be ordered after the store */
+  uint64_t head = __atomic_load_n (&(ring->head), __ATOMIC_SEQ_CST);
+  uint64_t tail = __atomic_load_n (&(ring->tail), __ATOMIC_RELAXED);
+  return (int) (head - tail);
+}
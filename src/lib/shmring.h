@@ -0,0 +1,41 @@
+/* shmring.h: single-producer, single-consumer byte rings in memory that
+ * is shared between a process and the children it forks */
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+struct shm_ring;   /* opaque, lives in shared memory */
+
+/* allocate a ring that can hold up to size bytes.  size is rounded up
+ * to a power of two.  The memory is shared with any child processes
+ * forked after this call.  Returns NULL in case of errors */
+extern struct shm_ring * shm_ring_create (int size);
+/* unmap a ring.  Only affects the calling process */
+extern void shm_ring_destroy (struct shm_ring * ring);
+
+/* producer side. */
+/* atomically adds the concatenation of the two buffers to the ring
+ * (b2 may be NULL if n2 is 0).  Either all the bytes are added, or
+ * none are.  Returns 1 if the bytes were added, 0 if there is not
+ * enough room in the ring.  Safe to call from multiple threads of
+ * the same process */
+extern int shm_ring_write (struct shm_ring * ring,
+                           const char * b1, int n1, const char * b2, int n2);
+/* after a write, returns 1 if the consumer has said it is waiting, in
+ * which case the producer should wake it up */
+extern int shm_ring_consumer_waiting (struct shm_ring * ring);
+
+/* consumer side.  Only one thread may consume from a ring */
+/* returns the number of bytes that can be read from the ring */
+extern int shm_ring_available (struct shm_ring * ring);
+/* copies n bytes into buffer without removing them from the ring.
+ * n must be less than or equal to shm_ring_available */
+extern void shm_ring_peek (struct shm_ring * ring, char * buffer, int n);
+/* same as shm_ring_peek, but also removes the bytes from the ring */
+extern void shm_ring_read (struct shm_ring * ring, char * buffer, int n);
+/* tells the producer whether the consumer is about to block.
+ * after setting waiting to 1, returns the number of bytes available,
+ * which the consumer must check before blocking */
+extern int shm_ring_set_waiting (struct shm_ring * ring, int waiting);
+
+#endif /* SHMRING_H */
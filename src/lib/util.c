@@ -1344,7 +1344,7 @@ int get_option (char option_letter, int * argcp, char ** argv)
 void print_usage (int argc, char ** argv, int user_callable, int do_exit)
 {
   if (user_callable)
-    printf ("usage: %s [-v] [interface1 [interface2]]\n", argv [0]);
+    printf ("usage: %s [-v] [-s] [interface1 [interface2]]\n", argv [0]);
   else
     printf ("%s should only be called from astart or allnetx\n", argv [0]);
   if (do_exit)
@@ -9,6 +9,7 @@
 #include <pthread.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netinet/in.h>
@@ -153,19 +154,56 @@ static void * listen_loop (void * arg)
   return NULL;
 }
 
+/* fds a process needs besides the connections, e.g. pipes, udp, files */
+#define LISTEN_RESERVED_FDS	64
+
+/* raise the soft limit on open files so max_fds connections fit, and
+ * return the number of connections that fit under the limit */
+static int listen_fd_limit (int max_fds, char * name)
+{
+  struct rlimit limit;
+  if (getrlimit (RLIMIT_NOFILE, &limit) != 0) {
+    perror ("listen getrlimit");
+    return max_fds;
+  }
+  rlim_t needed = ((rlim_t) max_fds) + LISTEN_RESERVED_FDS;
+  if ((limit.rlim_cur != RLIM_INFINITY) && (limit.rlim_cur < needed)) {
+    rlim_t original = limit.rlim_cur;
+    limit.rlim_cur = needed;
+    if ((limit.rlim_max != RLIM_INFINITY) && (limit.rlim_max < needed))
+      limit.rlim_cur = limit.rlim_max;
+    if (setrlimit (RLIMIT_NOFILE, &limit) != 0) {
+      perror ("listen setrlimit");
+      limit.rlim_cur = original;
+    }
+    if (limit.rlim_cur < needed) {
+      int available = (int) limit.rlim_cur - LISTEN_RESERVED_FDS;
+      if (available < 1)
+        available = 1;
+      snprintf (log_buf, LOG_SIZE,
+                "%s: open file limit %d, using %d instead of %d fds\n",
+                name, (int) limit.rlim_cur, available, max_fds);
+      log_print ();
+      return available;
+    }
+  }
+  return max_fds;
+}
+
 void listen_init_info (struct listen_info * info, int max_fds, char * name,
                        int port, int local_only, int add_remove_pipe,
                        int nodelay, void (* callback) (int))
 {
-  if (max_fds > 1024) {
-    printf ("using 1024 as the maximum number of open fds, %d is too large\n",
-            max_fds);
+  if ((add_remove_pipe) && (max_fds > PIPE_MESSAGE_MAX_FDS)) {
+    printf ("using %d as the maximum number of open fds, %d is too large\n",
+            PIPE_MESSAGE_MAX_FDS, max_fds);
     exit (1);
   }
   if (max_fds <= 0) {
     printf ("invalid %d for max open fds\n", max_fds);
     exit (1);
   }
+  max_fds = listen_fd_limit (max_fds, name);
   info->program_name = name;
   info->port = port;
   info->add_remove_pipe = add_remove_pipe;
@@ -174,7 +212,8 @@ void listen_init_info (struct listen_info * info, int max_fds, char * name,
   info->fds = malloc_or_fail (max_fds * sizeof (int), "listen thread fds");
   info->peers = malloc_or_fail (max_fds * sizeof (struct addr_info),
                                 "listen thread peers");
-  info->used = malloc_or_fail (max_fds * sizeof (int), "listen thread used");
+  info->used = malloc_or_fail (max_fds * sizeof (unsigned int),
+                               "listen thread used");
   info->callback = callback;
   info->nodelay = nodelay;
   int i;
@@ -349,8 +388,11 @@ void listen_remove_fd (struct listen_info * info, int fd)
   for (i = 0; i < info->num_fds; i++) {
     if (info->fds [i] == fd) {
       info->num_fds--;
-      if (i < info->num_fds)
+      if (i < info->num_fds) {
         info->fds [i] = info->fds [info->num_fds];
+        info->peers [i] = info->peers [info->num_fds];
+        info->used [i] = info->used [info->num_fds];
+      }
       break;      /* assume any fd only appears once */
     }
   }
@@ -25,7 +25,7 @@ struct listen_info {
   /* if the ip version of a peer is 0, that fd does not have a peer address */
   struct addr_info * peers;  /* handled similar to fds, holds peer addrs */
   /* for testing, make counter a char.  Normally, unsigned int */
-  unsigned char counter;  /* cycle counter for least recently used */
+  unsigned int counter;  /* cycle counter for least recently used */
   unsigned int * used;   /* array of most recent access times */
   void (* callback) (int);  /* may be NULL, otherwise called when new
                                fd added, parameter is fd */
@@ -33,6 +33,7 @@ struct listen_info {
 
 /* exits in case of errors, otherwise initializes info and starts the
  * listen thread */
+/* max_fds is reduced if the limit on open files cannot be raised to fit */
 /* ip version should be 4 or 6 */
 /* add_remove_pipe should be 1 if add_pipe and remove_pipe should be
  * called when adding or removing pipes */
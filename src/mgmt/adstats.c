@@ -0,0 +1,78 @@
+/* adstats.c: ask the local ad how long it takes to process packets */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/app_util.h"
+#include "lib/packet.h"
+#include "lib/mgmt.h"
+#include "lib/pipemsg.h"
+#include "lib/util.h"
+#include "lib/log.h"
+#include "lib/priority.h"
+
+static int send_request (int sock)
+{
+  int size = 0;
+  struct allnet_header * hp =
+    create_packet (sizeof (struct allnet_mgmt_header), ALLNET_TYPE_MGMT, 1,
+                   ALLNET_SIGTYPE_NONE, NULL, 0, NULL, 0, NULL, NULL, &size);
+  if (hp == NULL)
+    return 0;
+  struct allnet_mgmt_header * mp =
+    (struct allnet_mgmt_header *) (((char *) hp) + ALLNET_SIZE (hp->transport));
+  mp->mgmt_type = ALLNET_MGMT_STATS_REQ;
+  return send_pipe_message_free (sock, (char *) hp, size,
+                                 ALLNET_PRIORITY_LOCAL);
+}
+
+/* returns 1 and prints the statistics if this is a reply, 0 otherwise */
+static int handle_packet (char * message, int msize)
+{
+  if (! is_valid_message (message, msize))
+    return 0;
+  struct allnet_header * hp = (struct allnet_header *) message;
+  int hsize = ALLNET_MGMT_HEADER_SIZE (hp->transport);
+  if ((hp->message_type != ALLNET_TYPE_MGMT) || (msize < hsize))
+    return 0;
+  struct allnet_mgmt_header * mp =
+    (struct allnet_mgmt_header *) (message + ALLNET_SIZE (hp->transport));
+  if (mp->mgmt_type != ALLNET_MGMT_STATS)
+    return 0;
+  printf ("%.*s", msize - hsize, message + hsize);
+  return 1;
+}
+
+int main (int argc, char ** argv)
+{
+  log_to_output (get_option ('v', &argc, argv));
+  int sock = connect_to_local (argv [0], argv [0]);
+  if (sock < 0)
+    return 1;
+  if (! send_request (sock)) {
+    printf ("unable to send request to ad\n");
+    return 1;
+  }
+  unsigned long long int finish = allnet_time_ms () + 5000;
+  unsigned long long int now;
+  while ((now = allnet_time_ms ()) < finish) {
+    int pipe;
+    int pri;
+    char * message;
+    int found = receive_pipe_message_any ((int) (finish - now),
+                                          &message, &pipe, &pri);
+    if (found < 0) {
+      printf ("allnet-adstats pipe closed, exiting\n");
+      return 1;
+    }
+    if (found == 0)
+      continue;
+    int done = handle_packet (message, found);
+    release_pipe_message (message);
+    if (done)
+      return 0;
+  }
+  printf ("no reply from ad\n");
+  return 1;
+}
@@ -236,7 +236,7 @@ void keyd_main (char * pname)
     if ((found > 0) && (is_valid_message (message, found)))
       handle_packet (sock, message, found);
     if (found > 0)
-      free (message);
+      release_pipe_message (message);
   }
   snprintf (log_buf, LOG_SIZE, "keyd infinite loop ended, exiting\n");
   log_print ();
@@ -60,7 +60,7 @@ static void main_loop (int sock, int debug, int max, int verify)
     int received = 0;
     if (handle_packet (message, found, &received, debug, verify))
       return;
-    free (message);
+    release_pipe_message (message);
     if ((max > 0) && (received)) {
       max--;
       if (max == 0)
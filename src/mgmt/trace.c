@@ -476,7 +476,8 @@ static void main_loop (int sock, unsigned char * my_address, int nbits,
       respond_to_trace (sock, message, found, pri + 1, my_address, nbits,
                         match_only, forward_only, cache);
     }
-    free (message);
+    if (found > 0)
+      release_pipe_message (message);
   }
 }
 
@@ -748,7 +749,7 @@ static void wait_for_responses (int sock, char * trace_id, int sec,
     handle_packet (message, found, trace_id, tv_start,
                    match_only, no_intermediates);
     if (found > 0)
-      free (message);
+      release_pipe_message (message);
     time_spent = allnet_time_ms () - start;
   }
 #ifdef DEBUG_PRINT
@@ -1,30 +1,49 @@
 /* record.c: keep track of recently received packets */
 
-/* the way we keep track is to use two hash tables.  Each hash table
- * is indexed by two bytes of the hash of the packet, and records
- * the entire hash.  New hashes overwrite old hashes, but presumably
- * in different locations in the two hash tables, so in at least one
- * of the hash tables, the hash is likely to remain for a while.
- * When looking up, a match in either hash table means we have seen
- * the packet recently.
+/* the way we keep track is to use a hash table of buckets, each with
+ * RECORD_SLOTS slots.  Each packet has a 64-bit hash, and may be stored
+ * in either of two buckets selected by different parts of the hash.
+ * A new hash goes into an empty slot if there is one, or else replaces
+ * a hash that has not been seen for the last window seconds, and only
+ * if there are none of those, moves a hash in one of the buckets to its
+ * other bucket, or finally replaces the least recently seen hash.
+ * The size of the table and the window may be set in ~/.allnet/ad/record
+ * as two numbers (entries and seconds) on separate lines.
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <time.h>
 
 #include "record.h"
 #include "lib/log.h"
+#include "lib/util.h"
+#include "lib/config.h"
 
-#define ENTRIES_PER_TABLE		1024
+#define RECORD_SLOTS		4       /* slots per bucket */
+#define DEFAULT_ENTRIES		65536
+#define DEFAULT_WINDOW		120     /* seconds */
+#define MIN_ENTRIES		1024
 
 struct hash_entry {
-  int hash;
-  time_t last_seen;
+  unsigned long long int hash;
+  time_t last_seen;              /* 0 for an empty slot */
   int connection;
+  int size;                      /* to detect (rare) collisions */
 };
 
-static struct hash_entry hash1 [ENTRIES_PER_TABLE];
-static struct hash_entry hash2 [ENTRIES_PER_TABLE];
+static struct hash_entry * table = NULL;
+static int num_buckets = 0;
+static int window = DEFAULT_WINDOW;
+static unsigned long long int seed = 0;
+
+/* a collision is a new packet whose hash matches an old one, which
+ * would otherwise have been dropped.  An eviction removes a hash that
+ * was seen within the window, so a duplicate may later be forwarded */
+static unsigned long long int collisions = 0;
+static unsigned long long int evictions = 0;
 
 /* data must have at least ((bits + 7) / 8) bytes */
 int allnet_record_simple_hash_fn (char * data, int bits)
@@ -56,47 +75,120 @@ int allnet_record_simple_hash_fn (char * data, int bits)
   return result;
 }
 
-static void lr_hash_fun (char * data, int bits,
-                         int * hash, int * lindex, int * rindex)
+/* the 64-bit hash of MurmurHash2, with a random seed chosen at startup
+ * so that others cannot easily construct packets with the same hash */
+static unsigned long long int record_hash (const char * data, int dsize)
 {
-  *hash = allnet_record_simple_hash_fn (data, bits);
-  int left_hash  = (((*hash) >> 16) & 0xff00) | (((*hash) >> 8) & 0xff);
-  *lindex = left_hash % ENTRIES_PER_TABLE;
-  int right_hash = (((*hash) >>  8) & 0xff00) | ( (*hash)       & 0xff);
-  *rindex = right_hash % ENTRIES_PER_TABLE;
-/*
-  printf ("hash = %x, left %d %x, right = %d %x\n", (*hash),
-          left_hash % ENTRIES_PER_TABLE,
-          hash1 [left_hash  % ENTRIES_PER_TABLE].hash,
-          right_hash % ENTRIES_PER_TABLE,
-          hash2 [right_hash  % ENTRIES_PER_TABLE].hash);
- */
+  const unsigned long long int m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+  unsigned long long int h = seed ^ (dsize * m);
+  int i;
+  for (i = 0; i + 8 <= dsize; i += 8) {
+    unsigned long long int k;
+    memcpy (&k, data + i, 8);
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+  if (i < dsize) {
+    unsigned long long int k = 0;
+    memcpy (&k, data + i, dsize - i);
+    h ^= k;
+    h *= m;
+  }
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
 }
 
-/* returns 0 if not found, 1 or more if found */
-static int get_hash_time (struct hash_entry * entry, int hash, time_t now)
+/* reads the number of entries and the window from ~/.allnet/ad/record */
+static void read_config (int * entries, int * seconds)
 {
-  /* printf ("get_hash_time (%x/%ld, %x, %ld)\n",
-          entry->hash, entry->last_seen, hash, now); */
-  if ((entry->hash != hash) || (entry->last_seen == 0))
-    return 0;
-  int hash_time = now - entry->last_seen;
-  if (hash_time == 0)
-    hash_time = 1;
-  return hash_time;
+  int fd = open_read_config ("ad", "record", 0);
+  if (fd < 0)
+    return;
+  char buffer [100];
+  int n = read (fd, buffer, sizeof (buffer) - 1);
+  close (fd);
+  if (n <= 0)
+    return;
+  buffer [n] = '\0';
+  int e = 0;
+  int s = 0;
+  int found = sscanf (buffer, "%d\n%d", &e, &s);
+  if ((found >= 1) && (e > 0))
+    *entries = e;
+  if ((found >= 2) && (s > 0))
+    *seconds = s;
 }
 
 static void init ()
 {
-  static int initialized = 0;
-  if (! initialized) {
-    int i;
-    for (i = 0; i < ENTRIES_PER_TABLE; i++) {
-      hash1 [i].hash = 0; hash1 [i].last_seen = 0; hash1 [i].connection = -1;
-      hash2 [i].hash = 0; hash2 [i].last_seen = 0; hash2 [i].connection = -1;
+  if (table != NULL)
+    return;
+  int entries = DEFAULT_ENTRIES;
+  read_config (&entries, &window);
+  if (entries < MIN_ENTRIES)
+    entries = MIN_ENTRIES;
+  num_buckets = (entries + RECORD_SLOTS - 1) / RECORD_SLOTS;
+  int bytes = num_buckets * RECORD_SLOTS * sizeof (struct hash_entry);
+  table = malloc_or_fail (bytes, "record table");
+  int i;
+  for (i = 0; i < num_buckets * RECORD_SLOTS; i++) {
+    table [i].hash = 0;
+    table [i].last_seen = 0;
+    table [i].connection = -1;
+    table [i].size = 0;
+  }
+  random_bytes ((char *) (&seed), sizeof (seed));
+  snprintf (log_buf, LOG_SIZE,
+            "recording up to %d packets (%d bytes) for %d seconds\n",
+            num_buckets * RECORD_SLOTS, bytes, window);
+  log_print ();
+}
+
+/* returns the bucket's first slot */
+static struct hash_entry * bucket (unsigned long long int hash, int second)
+{
+  unsigned long long int h = ((second) ? (hash >> 32) : hash);
+  return table + ((h & 0xffffffff) % num_buckets) * RECORD_SLOTS;
+}
+
+/* returns a slot that is empty, or has not been seen within the window */
+static struct hash_entry * free_slot (struct hash_entry * b, time_t now)
+{
+  int i;
+  for (i = 0; i < RECORD_SLOTS; i++)
+    if ((b [i].last_seen == 0) || (b [i].last_seen + window <= now))
+      return b + i;
+  return NULL;
+}
+
+/* both buckets are full of recent hashes.  If one of them can move to
+ * its other bucket, move it and return its old slot, otherwise NULL */
+static struct hash_entry * make_room (struct hash_entry * b1,
+                                      struct hash_entry * b2, time_t now)
+{
+  int i;
+  for (i = 0; i < 2 * RECORD_SLOTS; i++) {
+    struct hash_entry * e = ((i < RECORD_SLOTS) ? (b1 + i) :
+                                                  (b2 + i - RECORD_SLOTS));
+    struct hash_entry * here = ((i < RECORD_SLOTS) ? b1 : b2);
+    struct hash_entry * other = bucket (e->hash, 0);
+    if (other == here)
+      other = bucket (e->hash, 1);
+    if ((other == b1) || (other == b2))
+      continue;
+    struct hash_entry * dest = free_slot (other, now);
+    if (dest != NULL) {
+      *dest = *e;
+      return e;
     }
-    initialized = 1;
   }
+  return NULL;
 }
 
 /* return 0 if this is a new packet, and the number of seconds (at least 1)
@@ -104,28 +196,47 @@ static void init ()
 int record_packet_time (char * data, int dsize, int conn)
 {
   init ();
-
-  int hash, left_index, right_index;
-  lr_hash_fun (data, dsize * 8, &hash, &left_index, &right_index);
-
+  unsigned long long int hash = record_hash (data, dsize);
   time_t now = time (NULL);
-  int left_time  = get_hash_time (hash1 + left_index , hash, now);
-  int right_time = get_hash_time (hash2 + right_index, hash, now);
-
-  /* store into both hash tables */
-  hash1 [left_index].hash = hash;
-  hash1 [left_index].last_seen = now;
-  hash2 [right_index].hash = hash;
-  hash2 [right_index].last_seen = now;
-
-/*
-  printf ("saved hash 0x%x at indices %d/%d, time %ld, delta %d/%d\n",
-          hash, left_index, right_index, now, left_time, right_time); */
-
-  if (left_time  == 0)        return right_time;
-  if (right_time == 0)        return left_time;
-  if (left_time > right_time) return right_time;  /* return lesser time */
-                              return left_time;
+  struct hash_entry * b1 = bucket (hash, 0);
+  struct hash_entry * b2 = bucket (hash, 1);
+  struct hash_entry * found = NULL;
+  struct hash_entry * replace = NULL;   /* the best slot for a new hash */
+  int i;
+  for (i = 0; i < 2 * RECORD_SLOTS; i++) {
+    struct hash_entry * e = ((i < RECORD_SLOTS) ? (b1 + i) :
+                                                  (b2 + i - RECORD_SLOTS));
+    if ((e->last_seen != 0) && (e->hash == hash) &&
+        (e->connection == conn)) {
+      if (e->size == dsize) {
+        found = e;
+        break;
+      }
+      collisions++;
+    }
+    /* prefer empty slots, then the one seen least recently */
+    if ((replace == NULL) || (e->last_seen < replace->last_seen))
+      replace = e;
+  }
+  if (found != NULL) {
+    int seconds = now - found->last_seen;
+    if (seconds <= 0)
+      seconds = 1;
+    found->last_seen = now;
+    return seconds;
+  }
+  if ((replace->last_seen != 0) && (replace->last_seen + window > now)) {
+    struct hash_entry * moved = make_room (b1, b2, now);
+    if (moved != NULL)
+      replace = moved;
+    else
+      evictions++;
+  }
+  replace->hash = hash;
+  replace->last_seen = now;
+  replace->connection = conn;
+  replace->size = dsize;
+  return 0;
 }
 
 /* clear all packets sent on this connection */
@@ -133,13 +244,30 @@ void record_packet_clear (int conn)
 {
   init ();
   int i;
-  for (i = 0; i < ENTRIES_PER_TABLE; i++) {
-    if (hash1 [i].connection == conn) {
-      hash1 [i].hash = 0; hash1 [i].last_seen = 0; hash1 [i].connection = -1;
-    }
-    if (hash2 [i].connection == conn) {
-      hash2 [i].hash = 0; hash2 [i].last_seen = 0; hash2 [i].connection = -1;
+  for (i = 0; i < num_buckets * RECORD_SLOTS; i++) {
+    if (table [i].connection == conn) {
+      table [i].hash = 0;
+      table [i].last_seen = 0;
+      table [i].connection = -1;
     }
   }
 }
 
+int record_print_stats (char * buffer, int bsize)
+{
+  init ();
+  time_t now = time (NULL);
+  int used = 0;
+  int i;
+  for (i = 0; i < num_buckets * RECORD_SLOTS; i++)
+    if ((table [i].last_seen != 0) && (table [i].last_seen + window > now))
+      used++;
+  int n = snprintf (buffer, bsize,
+                    "record: %d of %d entries seen in %ds, "
+                    "%llu early evictions, %llu collisions\n",
+                    used, num_buckets * RECORD_SLOTS, window,
+                    evictions, collisions);
+  if (n > bsize)
+    n = bsize;
+  return n;
+}
@@ -10,6 +10,11 @@ extern int record_packet_time (char * data, int dsize, int conn);
 /* clear all packets sent on this connection */
 extern void record_packet_clear (int conn);
 
+/* prints the number of packets recorded within the window, and how often
+ * a recent packet had to be forgotten, or a hash matched a different packet.
+ * Returns the number of characters printed */
+extern int record_print_stats (char * buffer, int bsize);
+
 /* possibly useful elsewhere */
 extern int allnet_record_simple_hash_fn (char * data, int bits);
 
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <pthread.h>
 #include <ifaddrs.h>
 #include <netdb.h>
@@ -19,7 +20,9 @@
 #include "lib/log.h"
 #include "lib/config.h"
 
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+/* aip looks up routes for every packet it forwards, so lookups only
+ * take the read lock, and only changes take the write lock */
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
 
 /* up to 4 DHT neighbors per address bit */
 #define PEERS_PER_BIT	4
@@ -30,13 +33,36 @@ struct peer_info {
   int refreshed;
 };
 
+/* peers are kept in k-buckets as in Kademlia: a peer whose address matches
+ * the first n bits of my address (but not bit n) is in row n, which holds
+ * up to PEERS_PER_BIT peers, most recently added first.  So the only peers
+ * closer than me to an address are in the row given by the number of bits
+ * the address matches my address, and an exact match can only be in that
+ * same row */
 struct peer_info peers [MAX_PEERS];
 
-/* for now use a fixed-size array of addr_infos to store the ping list. */
-/* addresses are added at the front and dropped from the back */
-#define MAX_PINGS	128
+/* the ping list is an array of ping_info, used as a list from the newest
+ * to the oldest entry, and as a hash table by destination.  Addresses are
+ * added at the front and dropped from the back.  The size of the list is
+ * DEFAULT_PINGS, or the number in ~/.allnet/adht/pings */
+#define DEFAULT_PINGS	128
+#define MIN_PINGS	16
+#define MAX_PINGS	65536
 
-static struct peer_info pings [MAX_PINGS];
+struct ping_info {
+  struct addr_info ai;       /* ai.nbits is 0 for an unused entry */
+  int refreshed;
+  int next;                  /* in the same hash bucket or free list, or -1 */
+  int newer;                 /* in the list, or -1 */
+  int older;
+};
+
+static struct ping_info * pings = NULL;
+static int max_pings = 0;
+static int * ping_buckets = NULL;   /* 2 * max_pings buckets */
+static int ping_free = -1;
+static int ping_newest = -1;
+static int ping_oldest = -1;
 
 static char my_address [ADDRESS_SIZE] = {0, 0, 0, 0, 0, 0, 0, 0};
 
@@ -49,6 +75,129 @@ struct sockaddr_storage ip6_defaults [NUM_DEFAULTS];
  * new address on every invocation (and perhaps more frequently?) */
 static int save_my_own_address = 1;
 
+/* returns the index in peers of the first entry in the row for this
+ * address, or -1 if it is my address */
+static int peer_row (const unsigned char * addr)
+{
+  int bit_pos = matching_bits (addr, ADDRESS_BITS,
+                               (unsigned char *) my_address, ADDRESS_BITS);
+  if (bit_pos >= ADDRESS_BITS)
+    return -1;
+  return bit_pos * PEERS_PER_BIT;
+}
+
+/* reads the size of the ping list from ~/.allnet/adht/pings, if any */
+static int read_max_pings ()
+{
+  int fd = open_read_config ("adht", "pings", 0);
+  if (fd < 0)
+    return DEFAULT_PINGS;
+  char buffer [100];
+  int n = read (fd, buffer, sizeof (buffer) - 1);
+  close (fd);
+  if (n <= 0)
+    return DEFAULT_PINGS;
+  buffer [n] = '\0';
+  int result = DEFAULT_PINGS;
+  if (sscanf (buffer, "%d", &result) != 1)
+    return DEFAULT_PINGS;
+  if (result < MIN_PINGS)
+    result = MIN_PINGS;
+  if (result > MAX_PINGS)
+    result = MAX_PINGS;
+  return result;
+}
+
+/* empties the ping list, allocating it the first time */
+static void clear_pings ()
+{
+  if (pings == NULL) {
+    max_pings = read_max_pings ();
+    pings = malloc_or_fail (max_pings * sizeof (struct ping_info),
+                            "routing pings");
+    ping_buckets = malloc_or_fail (2 * max_pings * sizeof (int),
+                                   "routing ping buckets");
+  }
+  int i;
+  for (i = 0; i < 2 * max_pings; i++)
+    ping_buckets [i] = -1;
+  bzero ((char *) pings, max_pings * sizeof (struct ping_info));
+  for (i = 0; i < max_pings; i++)
+    pings [i].next = ((i + 1 < max_pings) ? (i + 1) : -1);
+  ping_free = 0;
+  ping_newest = -1;
+  ping_oldest = -1;
+}
+
+static int ping_bucket (const unsigned char * destination)
+{
+  return ((readb32 ((char *) destination) ^
+           readb32 ((char *) (destination + 4))) % (2 * max_pings));
+}
+
+/* returns the index of the ping with this destination, or -1 */
+static int find_ping (const unsigned char * destination)
+{
+  int i;
+  for (i = ping_buckets [ping_bucket (destination)]; i >= 0;
+       i = pings [i].next)
+    if (memcmp (pings [i].ai.destination, destination, ADDRESS_SIZE) == 0)
+      return i;
+  return -1;
+}
+
+static void remove_ping (int i)
+{
+  int * p = ping_buckets + ping_bucket (pings [i].ai.destination);
+  while ((*p >= 0) && (*p != i))
+    p = &(pings [*p].next);
+  if (*p == i)
+    *p = pings [i].next;
+  if (pings [i].newer >= 0)
+    pings [pings [i].newer].older = pings [i].older;
+  else
+    ping_newest = pings [i].older;
+  if (pings [i].older >= 0)
+    pings [pings [i].older].newer = pings [i].newer;
+  else
+    ping_oldest = pings [i].newer;
+  pings [i].ai.nbits = 0;
+  pings [i].next = ping_free;
+  ping_free = i;
+}
+
+/* adds a ping that is not already in the list, at the front (newest)
+ * or at the back, dropping the oldest ping if the list is full */
+static void add_ping (struct addr_info * addr, int newest)
+{
+  if (ping_free < 0)
+    remove_ping (ping_oldest);
+  int i = ping_free;
+  ping_free = pings [i].next;
+  pings [i].ai = *addr;
+  pings [i].refreshed = 1;
+  int b = ping_bucket (addr->destination);
+  pings [i].next = ping_buckets [b];
+  ping_buckets [b] = i;
+  if (newest) {
+    pings [i].newer = -1;
+    pings [i].older = ping_newest;
+    if (ping_newest >= 0)
+      pings [ping_newest].newer = i;
+    ping_newest = i;
+    if (ping_oldest < 0)
+      ping_oldest = i;
+  } else {
+    pings [i].older = -1;
+    pings [i].newer = ping_oldest;
+    if (ping_oldest >= 0)
+      pings [ping_oldest].older = i;
+    ping_oldest = i;
+    if (ping_newest < 0)
+      ping_newest = i;
+  }
+}
+
 void print_dht (int to_log)
 {
   int npeers = 0;
@@ -73,12 +222,11 @@ void print_ping_list (int to_log)
 {
   int i, n;
   int count = 0;
-  for (i = 0; i < MAX_PINGS; i++)
-    if (pings [i].ai.nbits > 0)
-      count++;
+  for (i = ping_newest; i >= 0; i = pings [i].older)
+    count++;
   snprintf (log_buf, LOG_SIZE, "pings: %d\n", count);
   if (to_log) log_print (); else printf ("%s", log_buf);
-  for (i = 0; i < MAX_PINGS; i++) {
+  for (i = ping_newest; i >= 0; i = pings [i].older) {
     if (pings [i].ai.nbits > 0) {
       n = snprintf (log_buf, LOG_SIZE, "%3d (%d): ", i, pings [i].refreshed);
       addr_info_to_string (&(pings [i].ai), log_buf + n, LOG_SIZE - n);
@@ -162,7 +310,7 @@ static void save_peers ()
   int cping = 0;
   for (i = 0; i < MAX_PEERS; i++)
     cpeer += entry_to_file (fd, &(peers [i].ai), i);
-  for (i = 0; i < MAX_PINGS; i++)
+  for (i = ping_newest; i >= 0; i = pings [i].older)  /* newest first */
     cping += entry_to_file (fd, &(pings [i].ai), -1);
   close (fd);
   peers_file_time = time (NULL);  /* no need to re-read in load_peers (1) */
@@ -293,7 +441,7 @@ static void load_peers (int only_if_newer)
   peers_file_time = mtime;
   /* an unused entry has nbits set to 0 -- might as well clear everything */
   bzero ((char *) (peers), sizeof (peers));
-  bzero ((char *) (pings), sizeof (pings));
+  clear_pings ();
   bzero (my_address, sizeof (my_address));
   int fd = open_read_config ("adht", "peers", 1);
   if (fd < 0) {
@@ -315,33 +463,35 @@ static void load_peers (int only_if_newer)
     read_buffer (line + 9, strlen (line + 9), my_address, ADDRESS_SIZE);
   else   /* use a different address each time we are called */
     random_bytes (my_address, ADDRESS_SIZE);
-  int ping_index = 0;
   while (read_line (fd, line, sizeof (line))) {
+    struct addr_info ai;
+    ai.nbits = 0;
     if (strncmp (line, "p: ", 3) != 0) {
       char * end;
       int peer = strtol (line, &end, 10);
-      if ((end != line) && (peer >= 0) && (peer < MAX_PEERS)) {
-        load_peer (&(peers [peer].ai), end, 1);
-        peers [peer].refreshed = 1;
+      if ((end != line) && (peer >= 0) && (peer < MAX_PEERS))
+        load_peer (&ai, end, 1);
+      if (ai.nbits == 0)
+        continue;
+      /* put it in the row for its address, which is only different from
+       * the saved index if my address has changed */
+      int row = peer_row (ai.destination);
+      int col = 0;
+      while ((row >= 0) && (col < PEERS_PER_BIT) &&
+             (peers [row + col].ai.nbits != 0))
+        col++;
+      if ((row >= 0) && (col < PEERS_PER_BIT)) {
+        peers [row + col].ai = ai;
+        peers [row + col].refreshed = 1;
       }
     } else {
-      load_peer (&(pings [ping_index++].ai), line + 1, 0);
+      load_peer (&ai, line + 1, 0);
+      /* the file has the newest first, so each one goes at the back */
+      if ((ai.nbits != 0) && (find_ping (ai.destination) < 0))
+        add_ping (&ai, 0);
     }
   }
   close (fd);
-  int i;
-  int cpeers = 0;
-  int cpings = 0;
-  for (i = 0; i < MAX_PEERS; i++)
-    if (peers [i].ai.nbits != 0) {
-      peers [i].refreshed = 1;
-      cpeers++;
-    }
-  for (i = 0; i < MAX_PINGS; i++)
-    if (pings [i].ai.nbits != 0) {
-      pings [i].refreshed = 1;
-      cpings++;
-    }
 }
 
 /* run as a thread since getaddrinfo can be extremely slow (10's of seconds) */
@@ -401,7 +551,10 @@ static void * init_default_dns (void * arg)
   return NULL;
 }
 
-/* always called with lock held */
+/* the peers file is checked for changes at most once a second */
+static time_t next_peers_check = 0;
+
+/* always called with the write lock held */
 static int init_peers (int always)
 {
   static int initialized = 0;
@@ -423,16 +576,37 @@ static int init_peers (int always)
     load_peers (1);
   }
   initialized = 1;
+  next_peers_check = time (NULL) + 1;
   return result;
 }
 
+/* take the read lock, after loading the peers if it is time to check */
+static void read_lock ()
+{
+  pthread_rwlock_rdlock (&lock);
+  if (time (NULL) < next_peers_check)
+    return;
+  pthread_rwlock_unlock (&lock);
+  pthread_rwlock_wrlock (&lock);
+  if (time (NULL) >= next_peers_check)   /* nobody else checked already */
+    init_peers (0);
+  pthread_rwlock_unlock (&lock);
+  pthread_rwlock_rdlock (&lock);
+}
+
+static void write_lock ()
+{
+  pthread_rwlock_wrlock (&lock);
+  if (time (NULL) >= next_peers_check)
+    init_peers (0);
+}
+
 /* fills in addr (of size at least ADDRESS_SIZE) with my address */
 void routing_my_address (unsigned char * addr)
 {
-  pthread_mutex_lock (&mutex);
-  init_peers (0);
+  read_lock ();
   memcpy (addr, my_address, ADDRESS_SIZE);
-  pthread_mutex_unlock (&mutex);
+  pthread_rwlock_unlock (&lock);
 }
 
 /* return true if the destination is closer to target than to
@@ -464,8 +638,9 @@ static int addr_not_farther (unsigned char * dest, int nbits,
 /* fills in an array of sockaddr_storage to the top internet addresses
  * (up to max_matches) for the given AllNet address.
  * returns zero if there are no matches */
-/* the top matches are the ones with the most matching bits, so we start
- * looking from the last row of the array. */
+/* the matches are the peers closer to dest than I am.  If dest matches
+ * the first n bits of my address, these can only be in row n of the
+ * k-buckets, the peers that also match my first n bits but not bit n */
 int routing_top_dht_matches (unsigned char * dest, int nbits,
                              struct sockaddr_storage * result, int max_matches)
 {
@@ -476,22 +651,22 @@ print_dht (0); */
     nbits = 0;
   if (nbits > ADDRESS_BITS)
     nbits = ADDRESS_BITS;
-  pthread_mutex_lock (&mutex);
-  init_peers (0);
-  int row, col;
-  for (row = ADDRESS_BITS - 1; row >= 0; row--) {
-    for (col = 0; col < PEERS_PER_BIT; col++) {
-      struct addr_info * ai = &(peers [row * PEERS_PER_BIT + col].ai);
-      if ((ai->nbits > 0) &&
-          (addr_closer (dest, nbits, (unsigned char *) my_address,
-                        ai->destination))) {
-        struct sockaddr * sap = (struct sockaddr *) (& (result [peer]));
-        if (ai_to_sockaddr (ai, sap))
-          peer++;   /* a valid translation */
-      }
+  read_lock ();
+  int row = matching_bits (dest, nbits, (unsigned char *) my_address,
+                           ADDRESS_BITS);
+  int col;
+  for (col = 0; (row < nbits) && (col < PEERS_PER_BIT) &&
+                (peer < max_matches); col++) {
+    struct addr_info * ai = &(peers [row * PEERS_PER_BIT + col].ai);
+    if ((ai->nbits > 0) &&
+        (addr_closer (dest, nbits, (unsigned char *) my_address,
+                      ai->destination))) {
+      struct sockaddr * sap = (struct sockaddr *) (& (result [peer]));
+      if (ai_to_sockaddr (ai, sap))
+        peer++;   /* a valid translation */
     }
   }
-  pthread_mutex_unlock (&mutex);
+  pthread_rwlock_unlock (&lock);
   if (peer < max_matches)
     peer += add_default_routes (result, peer, max_matches);
 #ifdef DEBUG_PRINT
@@ -528,21 +703,31 @@ static void exact_match_print (char * description, int found,
 }
 
 /* returns 1 if found (and fills in result if not NULL), otherwise returns 0 */
-static int search_data_structure (struct peer_info * ds, int max,
-                                  const unsigned char * addr,
-                                  struct addr_info * result)
+static int search_peers (const unsigned char * addr, struct addr_info * result)
 {
-  int found = 0;
-  int i;
-  for (i = 0; (i < max) && (found == 0); i++) {
-    if ((ds [i].ai.nbits != 0) &&
-        (memcmp (addr, ds [i].ai.destination, ADDRESS_SIZE) == 0)) {
-      found = 1;
+  int row = peer_row (addr);
+  int col;
+  for (col = 0; (row >= 0) && (col < PEERS_PER_BIT); col++) {
+    struct peer_info * p = peers + row + col;
+    if ((p->ai.nbits != 0) &&
+        (memcmp (addr, p->ai.destination, ADDRESS_SIZE) == 0)) {
       if (result != NULL)
-        *result = ds [i].ai;
+        *result = p->ai;
+      return 1;
     }
   }
-  return found;
+  return 0;
+}
+
+/* returns 1 if found (and fills in result if not NULL), otherwise returns 0 */
+static int search_pings (const unsigned char * addr, struct addr_info * result)
+{
+  int i = ((pings == NULL) ? -1 : find_ping (addr));
+  if (i < 0)
+    return 0;
+  if (result != NULL)
+    *result = pings [i].ai;
+  return 1;
 }
 
 /* returns 1 and fills in result (if not NULL) if it finds an exact
@@ -551,42 +736,20 @@ static int search_data_structure (struct peer_info * ds, int max,
 int routing_exact_match (const unsigned char * addr, struct addr_info * result)
 {
   int found = 0;
-  pthread_mutex_lock (&mutex);
-  init_peers (0);
-#if 0
-  int i;
-  for (i = 0; (i < MAX_PEERS) && (found == 0); i++) {
-    if ((peers [i].ai.nbits != 0) &&
-        (memcmp (addr, peers [i].ai.destination, ADDRESS_SIZE) == 0)) {
-      found = 1;
-      if (result != NULL)
-        *result = peers [i].ai;
-    }
-  }
-  for (i = 0; (i < MAX_PINGS) && (found == 0); i++) {
-    if ((pings [i].ai.nbits != 0) &&
-        (memcmp (addr, pings [i].ai.destination, ADDRESS_SIZE) == 0)) {
-      found = 1;
-      if (result != NULL)
-        *result = pings [i].ai;
-    }
-  }
-#else /* ! 0 */
-  found = search_data_structure (peers, MAX_PEERS, addr, result);
+  read_lock ();
+  found = search_peers (addr, result);
   if (! found)
-    found = search_data_structure (pings, MAX_PINGS, addr, result);
-#endif /* 0 */
-  pthread_mutex_unlock (&mutex);
+    found = search_pings (addr, result);
+  pthread_rwlock_unlock (&lock);
   exact_match_print ("routing_exact_match", found, addr, result);
   return found;
 }
 
 int ping_exact_match (const unsigned char * addr, struct addr_info * result)
 {
-  pthread_mutex_lock (&mutex);
-  init_peers (0);
-  int found = search_data_structure (pings, MAX_PINGS, addr, result);
-  pthread_mutex_unlock (&mutex);
+  read_lock ();
+  int found = search_pings (addr, result);
+  pthread_rwlock_unlock (&lock);
   exact_match_print ("ping_exact_match", found, addr, result);
   return found;
 }
@@ -623,13 +786,9 @@ static int find_ip (struct internet_addr * addr)
 
 static void delete_ping (struct addr_info * addr)
 {
-  int i;
-  for (i = 0; i < MAX_PINGS; i++) {
-    if ((pings [i].ai.nbits > 0) &&
-        (matches (pings [i].ai.destination, ADDRESS_BITS,
-                  addr->destination, ADDRESS_BITS) >= ADDRESS_BITS))
-      pings [i].ai.nbits = 0;  /* delete */
-  }
+  int i = find_ping (addr->destination);
+  if (i >= 0)
+    remove_ping (i);
 }
 
 /* either adds or refreshes a DHT entry.
@@ -637,17 +796,18 @@ static void delete_ping (struct addr_info * addr)
 int routing_add_dht (struct addr_info * addr)
 {
   int result = -1;
-  pthread_mutex_lock (&mutex);
-  init_peers (0);
+  write_lock ();
   if ((addr->nbits == ADDRESS_BITS) &&
       (addr->type == ALLNET_ADDR_INFO_TYPE_DHT)) {
-    int bit_pos = matching_bits (addr->destination, ADDRESS_BITS,
-                                 (unsigned char *) my_address, ADDRESS_BITS);
+    int index = peer_row (addr->destination);
 #ifdef DEBUG_PRINT
-    printf ("adding at bit position %d, address ", bit_pos);
+    printf ("adding at index %d, address ", index);
     print_addr_info (addr);
 #endif /* DEBUG_PRINT */
-    int index = bit_pos * PEERS_PER_BIT;
+    if (index < 0) {   /* my own address */
+      pthread_rwlock_unlock (&lock);
+      return -1;
+    }
     int found = find_peer (peers + index, PEERS_PER_BIT, addr);
     int ip_index = find_ip (&(addr->ip));
     /* there should not be any others with the same IP.  If found, delete */
@@ -671,31 +831,18 @@ int routing_add_dht (struct addr_info * addr)
   }
   if (result >= 0)
     save_peers ();
-  pthread_mutex_unlock (&mutex);
+  pthread_rwlock_unlock (&lock);
   return result;
 }
 
-/* returns -1 if not found, the index if found */
-static int find_ping (struct addr_info * addr)
-{
-  int i;
-  for (i = 0; i < MAX_PINGS; i++) {
-    if ((pings [i].ai.nbits > 0) &&
-        (matches (pings [i].ai.destination, ADDRESS_BITS,
-                  addr->destination, ADDRESS_BITS) >= ADDRESS_BITS))
-      return i;
-  } 
-  return -1;
-}
-
 /* either adds or refreshes a ping entry.
  * returns 1 for a new entry, 0 for an existing entry, -1 for an entry that
  * is already in the DHT list, and -2 for other errors */
 int routing_add_ping_locked (struct addr_info * addr)
 {
   int result = -2;
-  int i;
-  if (find_peer (peers, MAX_PEERS, addr) >= 0) {
+  int row = peer_row (addr->destination);
+  if ((row >= 0) && (find_peer (peers + row, PEERS_PER_BIT, addr) >= 0)) {
 #ifdef DEBUG_PRINT
     printf ("rapl found peer, returning -1\n");
 #endif /* DEBUG_PRINT */
@@ -706,21 +853,16 @@ int routing_add_ping_locked (struct addr_info * addr)
 #endif /* DEBUG_PRINT */
     result = -1;
   } else {
-    int n = find_ping (addr);
+    int n = find_ping (addr->destination);
     if (n == -1) {   /* add to the front */
-      for (i = MAX_PINGS - 1; i > 0; i--)
-        pings [i] = pings [i - 1];
-      pings [0].ai = *addr;
-      pings [0].refreshed = 1;
+      add_ping (addr, 1);
       result = 1;
 #ifdef DEBUG_PRINT
       printf ("rapl did not find ping, returning 1\n");
 #endif /* DEBUG_PRINT */
     } else {         /* move to the front */
-      for (i = n; i > 0; i--)
-        pings [i] = pings [i - 1];
-      pings [0].ai = *addr;
-      pings [0].refreshed = 1;
+      remove_ping (n);
+      add_ping (addr, 1);
       result = 0;
 #ifdef DEBUG_PRINT
       printf ("rapl found ping, returning 0\n");
@@ -738,14 +880,13 @@ void routing_expire_dht ()
   print_dht (0);
   print_ping_list (0);
 #endif /* DEBUG_PRINT */
-  pthread_mutex_lock (&mutex);
-  init_peers (0);
+  write_lock ();
   int changed = 0;
   int i;
   /* delete pings that haven't been refreshed */
-  for (i = 0; i < MAX_PINGS; i++) {
+  for (i = 0; i < max_pings; i++) {
     if ((pings [i].ai.nbits > 0) && (! pings [i].refreshed)) {
-      pings [i].ai.nbits = 0;
+      remove_ping (i);
       changed = 1;
     }
     /* mark all pings as not refreshed */
@@ -771,7 +912,7 @@ void routing_expire_dht ()
   }
   if (changed)
     save_peers ();
-  pthread_mutex_unlock (&mutex);
+  pthread_rwlock_unlock (&lock);
 #ifdef DEBUG_PRINT
   printf ("routing_expire_dht () finished\n");
   print_dht (0);
@@ -799,8 +940,7 @@ static struct addr_info * get_nth_peer (int n)
 int routing_table (struct addr_info * data, int num_entries)
 {
   int result = 0;
-  pthread_mutex_lock (&mutex);
-  init_peers (0);
+  read_lock ();
   if (num_entries > 0) {
     int num_peers = 0;
     int i, index;
@@ -828,7 +968,7 @@ int routing_table (struct addr_info * data, int num_entries)
     }
     free (permutation);
   }
-  pthread_mutex_unlock (&mutex);
+  pthread_rwlock_unlock (&lock);
   return result;
 }
 
@@ -837,12 +977,11 @@ int routing_table (struct addr_info * data, int num_entries)
  * is already in the DHT list, and -2 for other errors */
 int routing_add_ping (struct addr_info * addr)
 {
-  pthread_mutex_lock (&mutex);
-  init_peers (0);
+  write_lock ();
   int result = routing_add_ping_locked (addr);
   if (result >= 0)
     save_peers ();
-  pthread_mutex_unlock (&mutex);
+  pthread_rwlock_unlock (&lock);
   return result;
 }
 
@@ -851,16 +990,16 @@ int routing_add_ping (struct addr_info * addr)
  * When there are no more values to fill in, returns -1 */
 int routing_ping_iterator (int iter, struct addr_info * ai)
 {
-  if ((iter < 0) || (iter >= MAX_PINGS))
+  if (iter < 0)
     return -1;
-  pthread_mutex_lock (&mutex);
-  init_peers (0);
-  while ((iter < MAX_PINGS) && (pings [iter].ai.nbits == 0))
+  read_lock ();
+  while ((iter < max_pings) && (pings [iter].ai.nbits == 0))
     iter++;
-  if ((iter < MAX_PINGS) && (ai != NULL))
+  int found = (iter < max_pings);
+  if ((found) && (ai != NULL))
     *ai = pings [iter].ai;
-  pthread_mutex_unlock (&mutex);
-  if (iter < MAX_PINGS)
+  pthread_rwlock_unlock (&lock);
+  if (found)
     return iter + 1;
   return -1;
 }
@@ -8,7 +8,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "social.h"
 #include "lib/packet.h"
@@ -19,11 +22,13 @@
 #include "lib/keys.h"
 #include "lib/cipher.h"
 #include "lib/priority.h"
+#include "lib/sha.h"
 
 struct social_one_tier {
   int address_bytes_per_entry;
   /* the IDs and public keys of the contacts, in a table */
   struct table connections;
+  char digest [SHA512_SIZE];  /* of the file the table was read from */
 };
 
 static void print_social_tier (int tier, struct social_one_tier * soc)
@@ -50,12 +55,217 @@ static void print_social_tier (int tier, struct social_one_tier * soc)
  define MAX_SOCIAL_TIER		3
 */
 
+/* the keys that can verify a signature from one of my contacts.
+ * Copied from keys.c by update_social, because the keys.c functions
+ * return statically allocated arrays, which threads cannot share */
+struct social_key {
+  unsigned char address [ADDRESS_SIZE];
+  int nbits;
+  allnet_rsa_pubkey key;
+  int contact;      /* for log messages: contact index, or -1 for bc keys */
+  int index;        /* keyset index for contacts, or bc key index */
+};
+
+/* a binary trie on the key addresses, so a packet is only checked
+ * against the keys whose address matches its source.  A key with an
+ * n-bit address is stored in the node at depth n, and the keys are
+ * sorted so each node's own keys, followed by the keys of its subtree,
+ * are a contiguous range of the key array */
+struct key_trie_node {
+  int child [2];    /* -1 if none */
+  int first;        /* the keys in the subtree are first..last-1 */
+  int own;          /* the first own keys are stored in this node */
+  int last;
+};
+
+/* the same signed packet usually reaches us many times, from different
+ * neighbors and from caches, so remember the results of recent signature
+ * checks.  Entries are identified by hashes of the signed bytes and of
+ * the signature, and by the source address */
+#define CACHE_ENTRIES		4096
+#define CACHE_BUCKETS		(CACHE_ENTRIES * 2)
+#define CACHE_SECONDS		300
+#define CACHE_MESSAGE_HASH	32
+#define CACHE_SIG_HASH		16
+#define CACHE_KEY_SIZE		(CACHE_MESSAGE_HASH + CACHE_SIG_HASH + \
+				 ADDRESS_SIZE + 1)
+
+struct cache_entry {
+  char key [CACHE_KEY_SIZE];
+  int in_use;
+  time_t expiration;
+  int tier;         /* the value returned by social_connection */
+  int valid;
+  int next;         /* in the same bucket, or -1 */
+  int newer;        /* in the LRU list, or -1 */
+  int older;
+};
+
+struct social_cache {
+  pthread_mutex_t mutex;
+  struct cache_entry entries [CACHE_ENTRIES];
+  int buckets [CACHE_BUCKETS];  /* index of the first entry, or -1 */
+  int newest;       /* every entry is in the LRU list, unused ones oldest */
+  int oldest;
+  long long int hits;
+  long long int misses;
+};
+
 struct social_info {
   struct social_one_tier info [MAX_SOCIAL_TIER];
   int max_bytes;    /* should not use more than max_bytes of storage */
   int max_check;    /* should not check more than max_check sigs per call */
+  /* social_connection holds the lock for reading, update_social for writing */
+  pthread_rwlock_t lock;
+  struct social_key * keys;
+  int num_keys;
+  struct key_trie_node * trie;  /* node 0 is the root */
+  char keys_digest [SHA512_SIZE];
+  struct social_cache cache;
 };
 
+static void cache_unlink_lru (struct social_cache * c, int i)
+{
+  struct cache_entry * e = c->entries + i;
+  if (e->newer >= 0)
+    c->entries [e->newer].older = e->older;
+  else
+    c->newest = e->older;
+  if (e->older >= 0)
+    c->entries [e->older].newer = e->newer;
+  else
+    c->oldest = e->newer;
+}
+
+static void cache_make_newest (struct social_cache * c, int i)
+{
+  cache_unlink_lru (c, i);
+  struct cache_entry * e = c->entries + i;
+  e->newer = -1;
+  e->older = c->newest;
+  if (c->newest >= 0)
+    c->entries [c->newest].newer = i;
+  c->newest = i;
+  if (c->oldest < 0)
+    c->oldest = i;
+}
+
+static void cache_make_oldest (struct social_cache * c, int i)
+{
+  cache_unlink_lru (c, i);
+  struct cache_entry * e = c->entries + i;
+  e->older = -1;
+  e->newer = c->oldest;
+  if (c->oldest >= 0)
+    c->entries [c->oldest].older = i;
+  c->oldest = i;
+  if (c->newest < 0)
+    c->newest = i;
+}
+
+static int cache_bucket (const char * key)
+{
+  unsigned int hash = readb32 (key) ^ readb32 (key + CACHE_MESSAGE_HASH);
+  return hash % CACHE_BUCKETS;
+}
+
+/* removes the entry from its bucket, and makes it the next to be reused */
+static void cache_remove (struct social_cache * c, int i)
+{
+  struct cache_entry * e = c->entries + i;
+  if (! e->in_use)
+    return;
+  int * p = c->buckets + cache_bucket (e->key);
+  while ((*p >= 0) && (*p != i))
+    p = &(c->entries [*p].next);
+  if (*p == i)
+    *p = e->next;
+  e->in_use = 0;
+  e->next = -1;
+  cache_make_oldest (c, i);
+}
+
+static void cache_clear (struct social_cache * c)
+{
+  int i;
+  for (i = 0; i < CACHE_BUCKETS; i++)
+    c->buckets [i] = -1;
+  for (i = 0; i < CACHE_ENTRIES; i++) {
+    c->entries [i].in_use = 0;
+    c->entries [i].next = -1;
+    c->entries [i].newer = ((i > 0) ? (i - 1) : -1);
+    c->entries [i].older = ((i + 1 < CACHE_ENTRIES) ? (i + 1) : -1);
+  }
+  c->newest = 0;
+  c->oldest = CACHE_ENTRIES - 1;
+}
+
+static void cache_key (char * key, char * message, int msize,
+                       char * sig, int ssize, unsigned char * src, int sbits)
+{
+  memset (key, 0, CACHE_KEY_SIZE);
+  sha512_bytes (message, msize, key, CACHE_MESSAGE_HASH);
+  sha512_bytes (sig, ssize, key + CACHE_MESSAGE_HASH, CACHE_SIG_HASH);
+  if (sbits > ADDRESS_BITS)
+    sbits = ADDRESS_BITS;
+  if (sbits < 0)
+    sbits = 0;
+  char * address = key + CACHE_MESSAGE_HASH + CACHE_SIG_HASH;
+  memcpy (address, src, (sbits + 7) / 8);
+  if ((sbits % 8) != 0)   /* clear the bits past sbits */
+    address [sbits / 8] &= (0xff << (8 - (sbits % 8))) & 0xff;
+  key [CACHE_KEY_SIZE - 1] = sbits;
+}
+
+/* returns 1 and sets tier and valid if the key is in the cache */
+static int cache_find (struct social_cache * c, const char * key,
+                       int * tier, int * valid)
+{
+  time_t now = time (NULL);
+  pthread_mutex_lock (&(c->mutex));
+  int i = c->buckets [cache_bucket (key)];
+  while ((i >= 0) && (memcmp (c->entries [i].key, key, CACHE_KEY_SIZE) != 0))
+    i = c->entries [i].next;
+  int found = 0;
+  if ((i >= 0) && (c->entries [i].expiration < now)) {
+    cache_remove (c, i);
+  } else if (i >= 0) {
+    *tier = c->entries [i].tier;
+    *valid = c->entries [i].valid;
+    cache_make_newest (c, i);
+    found = 1;
+  }
+  if (found)
+    c->hits++;
+  else
+    c->misses++;
+  pthread_mutex_unlock (&(c->mutex));
+  return found;
+}
+
+static void cache_add (struct social_cache * c, const char * key,
+                       int tier, int valid)
+{
+  pthread_mutex_lock (&(c->mutex));
+  int b = cache_bucket (key);
+  int i = c->buckets [b];
+  while ((i >= 0) && (memcmp (c->entries [i].key, key, CACHE_KEY_SIZE) != 0))
+    i = c->entries [i].next;
+  if (i < 0) {  /* not added by another thread, so reuse the oldest entry */
+    i = c->oldest;
+    cache_remove (c, i);
+    memcpy (c->entries [i].key, key, CACHE_KEY_SIZE);
+    c->entries [i].next = c->buckets [b];
+    c->buckets [b] = i;
+    c->entries [i].in_use = 1;
+  }
+  c->entries [i].expiration = time (NULL) + CACHE_SECONDS;
+  c->entries [i].tier = tier;
+  c->entries [i].valid = valid;
+  cache_make_newest (c, i);
+  pthread_mutex_unlock (&(c->mutex));
+}
+
 struct social_info * init_social (int max_bytes, int max_check)
 {
   struct social_info * result = malloc (sizeof (struct social_info));
@@ -68,10 +278,20 @@ struct social_info * init_social (int max_bytes, int max_check)
   }
   result->max_bytes = max_bytes;
   result->max_check = max_check;
+  pthread_rwlock_init (&(result->lock), NULL);
+  result->keys = NULL;
+  result->num_keys = 0;
+  result->trie = NULL;
+  memset (result->keys_digest, 0, SHA512_SIZE);
+  pthread_mutex_init (&(result->cache.mutex), NULL);
+  cache_clear (&(result->cache));
+  result->cache.hits = 0;
+  result->cache.misses = 0;
   int bytes = ADDRESS_SIZE;
   int i;
   for (i = 0; i < MAX_SOCIAL_TIER; i++) {
     init_table (&result->info [i].connections);
+    memset (result->info [i].digest, 0, SHA512_SIZE);
     result->info [i].address_bytes_per_entry = bytes;
     if (bytes == ADDRESS_SIZE)
       bytes -= 2;
@@ -81,6 +301,22 @@ struct social_info * init_social (int max_bytes, int max_check)
   return result;
 }
 
+/* sets digest to the hash of the contents of the file */
+static void file_digest (int fd, char * digest)
+{
+  memset (digest, 0, SHA512_SIZE);
+  struct stat st;
+  if ((fstat (fd, &st) != 0) || (st.st_size <= 0) ||
+      (st.st_size > 0x10000000))
+    return;
+  int size = (int) (st.st_size);
+  char * data = malloc_or_fail (size, "social file digest");
+  int n = pread (fd, data, size, 0);
+  if (n > 0)
+    sha512 (data, n, digest);
+  free (data);
+}
+
 /* return the number of bytes in the updated social tier, and in
  * any case never more than free_bytes */
 static int update_social_tier (int tier, struct social_one_tier * st,
@@ -120,80 +356,281 @@ static int update_social_tier (int tier, struct social_one_tier * st,
     free (path);
     return free_bytes;
   }
+  char digest [SHA512_SIZE];
+  file_digest (fd, digest);
   int bytes = table_from_file (&(st->connections), fd,
                                st->address_bytes_per_entry, free_bytes);
   close (fd);
-  if (bytes != 0)
+  if (bytes != 0) {
+    memcpy (st->digest, digest, SHA512_SIZE);
     return bytes;
+  }
   else   /* did not read from file, using older one */
     return st->connections.storage_size;
 }
 
-time_t update_social (struct social_info * soc, int update_seconds)
-{
-  int free_bytes = soc->max_bytes;
-  int i;
-  for (i = 1; i < MAX_SOCIAL_TIER; i++) {  /* skip social level 0 */
-    free_bytes -= update_social_tier (i, soc->info + i, free_bytes);
-    print_social_tier (i, soc->info + i);
-  }
-  return (time (NULL) + update_seconds);
-}
-
-/* returns 1 if this message is from my contact, and 0 otherwise */
-static int is_my_contact (char * message, int msize,
-                          unsigned char * sender, int bits,
-                          int algo, char * sig, int ssize)
+/* collect the keys of my contacts and broadcast contacts into a new array */
+static int collect_keys (struct social_key ** result)
 {
   char ** contacts;
   int nc = all_contacts (&contacts);
+  struct bc_key_info * bc;
+  int nbc = get_other_keys (&bc);
+  int count = nbc;
   int ic;
+  for (ic = 0; ic < nc; ic++) {
+    int nk = all_keys (contacts [ic], NULL);
+    if (nk > 0)
+      count += nk;
+  }
+  *result = NULL;
+  if (count <= 0)
+    return 0;
+  struct social_key * keys =
+    malloc_or_fail (count * sizeof (struct social_key), "social keys");
+  int n = 0;
   for (ic = 0; ic < nc; ic++) {
     keyset * keysets;
     int nk = all_keys (contacts [ic], &keysets);
     int ink;
-    for (ink = 0; ink < nk; ink++) {
-      unsigned char address [ADDRESS_SIZE];
-      int na_bits = get_remote (keysets [ink], address);
+    for (ink = 0; (ink < nk) && (n < count); ink++) {
       allnet_rsa_pubkey key;
-      int ksize = get_contact_pubkey (keysets [ink], &key);
-      if ((ksize > 0) && (matches (sender, bits, address, na_bits) > 0) &&
-          (allnet_verify (message, msize, sig, ssize, key))) {
-        snprintf (log_buf, LOG_SIZE, "verified from contact %d %d\n", ic, ink);
-        log_print ();
-        return 1;
+      if (get_contact_pubkey (keysets [ink], &key) <= 0)
+        continue;
+      memset (keys [n].address, 0, ADDRESS_SIZE);
+      keys [n].nbits = get_remote (keysets [ink], keys [n].address);
+      keys [n].key = key;
+      keys [n].contact = ic;
+      keys [n].index = ink;
+      n++;
+    }
+  }
+  int ibc;
+  for (ibc = 0; (ibc < nbc) && (n < count); ibc++) {
+    memcpy (keys [n].address, bc [ibc].address, ADDRESS_SIZE);
+    keys [n].nbits = ADDRESS_BITS;
+    keys [n].key = bc [ibc].pub_key;
+    keys [n].contact = -1;
+    keys [n].index = ibc;
+    n++;
+  }
+  *result = keys;
+  return n;
+}
+
+/* sets digest to a hash of the addresses and public keys */
+static void digest_keys (struct social_key * keys, int nkeys, char * digest)
+{
+  memset (digest, 0, SHA512_SIZE);
+  if (nkeys <= 0)
+    return;
+  /* each key is hashed together with the digest of the keys before it */
+  char buffer [SHA512_SIZE + ADDRESS_SIZE + 1 + 1024];
+  int k;
+  for (k = 0; k < nkeys; k++) {
+    memcpy (buffer, digest, SHA512_SIZE);
+    int n = SHA512_SIZE;
+    memcpy (buffer + n, keys [k].address, ADDRESS_SIZE);
+    n += ADDRESS_SIZE;
+    buffer [n++] = keys [k].nbits;
+    n += allnet_pubkey_to_raw (keys [k].key, buffer + n, sizeof (buffer) - n);
+    sha512 (buffer, n, digest);
+  }
+}
+
+static int address_bit (const unsigned char * address, int pos)
+{
+  return (address [pos / 8] >> (7 - (pos % 8))) & 1;
+}
+
+static int key_bits (struct social_key * key)
+{
+  if (key->nbits < 0)
+    return 0;
+  if (key->nbits > ADDRESS_BITS)
+    return ADDRESS_BITS;
+  return key->nbits;
+}
+
+/* assigns key ranges to the subtree at node, and adds the keys to order */
+static void number_trie (struct key_trie_node * trie, int node,
+                         int * node_keys, int * next_key, int * order,
+                         int * count)
+{
+  struct key_trie_node * t = trie + node;
+  t->first = *count;
+  int k;
+  for (k = node_keys [node]; k >= 0; k = next_key [k])
+    order [(*count)++] = k;
+  t->own = *count - t->first;
+  int i;
+  for (i = 0; i < 2; i++)
+    if (t->child [i] >= 0)
+      number_trie (trie, t->child [i], node_keys, next_key, order, count);
+  t->last = *count;
+}
+
+/* builds the trie, and sorts the keys into the order used by the trie */
+static struct key_trie_node * build_trie (struct social_key * keys, int nkeys)
+{
+  int max_nodes = nkeys * ADDRESS_BITS + 1;
+  struct key_trie_node * trie =
+    malloc_or_fail (max_nodes * sizeof (struct key_trie_node), "social trie");
+  int * node_keys = malloc_or_fail (max_nodes * sizeof (int), "trie keys");
+  int * next_key = malloc_or_fail ((nkeys + 1) * sizeof (int), "trie next");
+  int * order = malloc_or_fail ((nkeys + 1) * sizeof (int), "trie order");
+  trie [0].child [0] = -1;
+  trie [0].child [1] = -1;
+  node_keys [0] = -1;
+  int num_nodes = 1;
+  int k;
+  for (k = nkeys - 1; k >= 0; k--) {  /* backwards, so lists keep the order */
+    int node = 0;
+    int bit;
+    for (bit = 0; bit < key_bits (keys + k); bit++) {
+      int b = address_bit (keys [k].address, bit);
+      if (trie [node].child [b] < 0) {
+        trie [num_nodes].child [0] = -1;
+        trie [num_nodes].child [1] = -1;
+        node_keys [num_nodes] = -1;
+        trie [node].child [b] = num_nodes++;
       }
+      node = trie [node].child [b];
     }
+    next_key [k] = node_keys [node];
+    node_keys [node] = k;
+  }
+  int count = 0;
+  number_trie (trie, 0, node_keys, next_key, order, &count);
+  if (nkeys > 0) {
+    struct social_key * sorted =
+      malloc_or_fail (nkeys * sizeof (struct social_key), "trie sort");
+    for (k = 0; k < nkeys; k++)
+      sorted [k] = keys [order [k]];
+    memcpy (keys, sorted, nkeys * sizeof (struct social_key));
+    free (sorted);
   }
+  free (node_keys);
+  free (next_key);
+  free (order);
+  return trie;
+}
 
-  struct bc_key_info * bc;
-  int nbc = get_other_keys (&bc);
-  int ibc;
-  for (ibc = 0; ibc < nbc; ibc++) {
-    if ((matches (sender, bits,
-                  (unsigned char *) (bc [ibc].address), ADDRESS_BITS) > 0) &&
-        (allnet_verify (message, msize, sig, ssize, bc [ibc].pub_key))) {
-      snprintf (log_buf, LOG_SIZE, "verified from bc contact %d\n", ibc);
-      log_print ();
+time_t update_social (struct social_info * soc, int update_seconds)
+{
+  struct social_key * keys;
+  int num_keys = collect_keys (&keys);
+  struct key_trie_node * trie = build_trie (keys, num_keys);
+  char new_keys_digest [SHA512_SIZE];
+  digest_keys (keys, num_keys, new_keys_digest);
+  pthread_rwlock_wrlock (&(soc->lock));
+  int changed =
+    (memcmp (new_keys_digest, soc->keys_digest, SHA512_SIZE) != 0);
+  memcpy (soc->keys_digest, new_keys_digest, SHA512_SIZE);
+  int free_bytes = soc->max_bytes;
+  int i;
+  for (i = 1; i < MAX_SOCIAL_TIER; i++) {  /* skip social level 0 */
+    char old_digest [SHA512_SIZE];
+    memcpy (old_digest, soc->info [i].digest, SHA512_SIZE);
+    free_bytes -= update_social_tier (i, soc->info + i, free_bytes);
+    print_social_tier (i, soc->info + i);
+    if (memcmp (old_digest, soc->info [i].digest, SHA512_SIZE) != 0)
+      changed = 1;
+  }
+  if (soc->keys != NULL)
+    free (soc->keys);
+  soc->keys = keys;
+  soc->num_keys = num_keys;
+  if (soc->trie != NULL)
+    free (soc->trie);
+  soc->trie = trie;
+  /* if the keys or tiers changed, earlier results may no longer hold.
+   * Nobody else can be using the cache while we hold the write lock */
+  snprintf (log_buf, LOG_SIZE,
+            "signature cache: %lld hits, %lld misses%s\n",
+            soc->cache.hits, soc->cache.misses, ((changed) ? ", cleared" : ""));
+  log_print ();
+  if (changed)
+    cache_clear (&(soc->cache));
+  pthread_rwlock_unlock (&(soc->lock));
+  return (time (NULL) + update_seconds);
+}
+
+/* returns 1 if one of the keys first..last-1 verifies the signature */
+static int verify_keys (struct social_info * soc, int first, int last,
+                        char * message, int msize, char * sig, int ssize)
+{
+  int i;
+  for (i = first; i < last; i++) {
+    struct social_key * sk = soc->keys + i;
+    if (allnet_verify (message, msize, sig, ssize, sk->key)) {
+      char buf [LOG_SIZE];   /* may be called from several threads */
+      if (sk->contact >= 0)
+        snprintf (buf, sizeof (buf), "verified from contact %d %d\n",
+                  sk->contact, sk->index);
+      else
+        snprintf (buf, sizeof (buf), "verified from bc contact %d\n",
+                  sk->index);
+      log_print_str (buf);
       return 1;
     }
   }
-/* printf ("is_my_contact (%d, %d) => 0\n", nc, nbc); */
   return 0;
 }
 
+/* returns 1 if this message is from my contact, and 0 otherwise */
+/* called with soc->lock held for reading */
+static int is_my_contact (struct social_info * soc, char * message, int msize,
+                          unsigned char * sender, int bits,
+                          int algo, char * sig, int ssize)
+{
+  if (soc->trie == NULL)
+    return 0;
+  if (bits > ADDRESS_BITS)
+    bits = ADDRESS_BITS;
+  /* the keys with shorter addresses than the sender's are in the nodes
+   * along the sender's path, and those with longer addresses are in the
+   * subtree at the end of the path */
+  int node = 0;
+  int bit;
+  for (bit = 0; bit < bits; bit++) {
+    struct key_trie_node * t = soc->trie + node;
+    if (verify_keys (soc, t->first, t->first + t->own,
+                     message, msize, sig, ssize))
+      return 1;
+    node = t->child [address_bit (sender, bit)];
+    if (node < 0)
+      return 0;
+  }
+  return verify_keys (soc, soc->trie [node].first, soc->trie [node].last,
+                      message, msize, sig, ssize);
+}
+
 /* checks the signature, and sets valid accordingly.
  * returns the social distance if known, and UNKNOWN_SOCIAL_TIER otherwise */
 int social_connection (struct social_info * soc, char * vmessage, int vsize,
                        unsigned char * src, int sbits, int algo,
                        char * sig, int ssize, int * valid)
 {
-snprintf (log_buf, LOG_SIZE, "social_connection (%d) called\n", algo);
-log_print ();
   if (algo == ALLNET_SIGTYPE_NONE)
     return UNKNOWN_SOCIAL_TIER;
   *valid = 0;
-  if (is_my_contact (vmessage, vsize, src, sbits, algo, sig, ssize)) {
+  char key [CACHE_KEY_SIZE];
+  cache_key (key, vmessage, vsize, sig, ssize, src, sbits);
+  int tier;
+  pthread_rwlock_rdlock (&(soc->lock));
+  if (cache_find (&(soc->cache), key, &tier, valid)) {
+    pthread_rwlock_unlock (&(soc->lock));
+    return tier;
+  }
+  int found = is_my_contact (soc, vmessage, vsize, src, sbits, algo, sig, ssize);
+  /* add while still holding the lock, so the keys cannot have changed */
+  if (found)
+    cache_add (&(soc->cache), key, 1, 1);
+  else
+    cache_add (&(soc->cache), key, UNKNOWN_SOCIAL_TIER, 0);
+  pthread_rwlock_unlock (&(soc->lock));
+  if (found) {
     *valid = 1;
     return 1;
   }
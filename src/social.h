@@ -23,6 +23,8 @@ extern time_t update_social (struct social_info * soc, int update_seconds);
 
 /* checks the signature, and sets valid accordingly.
  * returns the social distance if known, and UNKNOWN_SOCIAL_TIER otherwise */
+/* may be called from several threads at once, and concurrently with
+ * update_social */
 extern int social_connection (struct social_info * soc,
                               char * verify, int vsize,
                               unsigned char * src, int sbits,
@@ -1,77 +1,221 @@
 /* track.c: keep track of recently received packets */
+/* for each source address (and number of bits), keep a count of the bytes
+ * received, which decays by DECAY every second.  Since all the counts
+ * decay at the same rate, the largest count only changes when a source
+ * sends, so the top sender is easy to keep track of.
+ * The sources are in a hash table, and when the table is full, the
+ * source that sent least recently is replaced. */
 
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include "lib/packet.h"
 #include "lib/priority.h"
 #include "lib/util.h"
 #include "lib/log.h"
 
-#define SAVED_ADDRESSES	128
+#define MAX_SOURCES	4096
+#define NUM_BUCKETS	(MAX_SOURCES * 2)
+#define DECAY		0.875    /* per second, so about halved in 5s */
+#define MAX_DECAY	300      /* after this many seconds, count is zero */
 
 struct rate_record {
-  unsigned char address [ADDRESS_SIZE];
+  unsigned char address [ADDRESS_SIZE];  /* bits after num_bits are zero */
   unsigned char num_bits;
-  int packet_size;
+  int in_use;
+  double bytes;        /* decayed count of bytes, as of second last_update */
+  time_t last_update;
+  int next;            /* in the same hash bucket, or -1 */
+  int newer;           /* in the LRU list, or -1 */
+  int older;
 };
 
-static struct rate_record record [SAVED_ADDRESSES];
+static struct rate_record record [MAX_SOURCES];
+static int buckets [NUM_BUCKETS];
+static int newest = -1;
+static int oldest = -1;
+
+static double decay_table [MAX_DECAY];   /* decay_table [n] = DECAY^n */
+static int initialized = 0;
 
-static int next = -1;
+/* total bytes from all sources, decayed the same way */
+static double total_bytes = 0.0;
+static time_t total_update = 0;
+
+static int top = -1;   /* the source with the most bytes, if any */
 
 #define DEFAULT_MAX	(ALLNET_PRIORITY_MAX - 1)
 
-int largest_rate ()
+static double decay (double bytes, time_t last, time_t now)
 {
-  return DEFAULT_MAX;
+  if (now <= last)
+    return bytes;
+  if (now - last >= MAX_DECAY)
+    return 0.0;
+  return bytes * decay_table [now - last];
 }
 
-/* record that this source is sending this packet of given size */
-/* return an integer, as a fraction of ALLNET_PRIORITY_MAX, to indicate what
- * fraction of the available bandwidth this source is using.
- * ALLNET_PRIORITY_MAX is defined in priority.h
- */
-int track_rate (unsigned char * source, int sbits, int packet_size)
+static void unlink_lru (int i)
+{
+  if (record [i].newer >= 0)
+    record [record [i].newer].older = record [i].older;
+  else
+    newest = record [i].older;
+  if (record [i].older >= 0)
+    record [record [i].older].newer = record [i].newer;
+  else
+    oldest = record [i].newer;
+}
+
+static void make_newest (int i)
+{
+  unlink_lru (i);
+  record [i].newer = -1;
+  record [i].older = newest;
+  if (newest >= 0)
+    record [newest].newer = i;
+  newest = i;
+  if (oldest < 0)
+    oldest = i;
+}
+
+static void init_track ()
 {
   int i;
-  if (next < 0) {    /* initialize */
-    for (i = 0; i < SAVED_ADDRESSES; i++) {
-      memset (record [i].address, 0, ADDRESS_SIZE);
-      record [i].num_bits = 0;
-      record [i].packet_size = 0;
-    }
-    next = 0;
+  decay_table [0] = 1.0;
+  for (i = 1; i < MAX_DECAY; i++)
+    decay_table [i] = decay_table [i - 1] * DECAY;
+  for (i = 0; i < NUM_BUCKETS; i++)
+    buckets [i] = -1;
+  for (i = 0; i < MAX_SOURCES; i++) {
+    record [i].in_use = 0;
+    record [i].next = -1;
+    record [i].newer = ((i > 0) ? (i - 1) : -1);
+    record [i].older = ((i + 1 < MAX_SOURCES) ? (i + 1) : -1);
   }
+  newest = 0;
+  oldest = MAX_SOURCES - 1;
+  initialized = 1;
+}
+
+static int source_hash (const unsigned char * address, int nbits)
+{
+  unsigned int hash = nbits;
+  int i;
+  for (i = 0; i < (nbits + 7) / 8; i++)
+    hash = hash * 31 + address [i];
+  return hash % NUM_BUCKETS;
+}
+
+static void remove_record (int i)
+{
+  int * p = buckets + source_hash (record [i].address, record [i].num_bits);
+  while ((*p >= 0) && (*p != i))
+    p = &(record [*p].next);
+  if (*p == i)
+    *p = record [i].next;
+  record [i].in_use = 0;
+  record [i].next = -1;
+}
 
-  /* how many saved packets have the same source as this one? */
-  int nmatches = 0;
-  int total = 0;
-  for (i = 0; i < SAVED_ADDRESSES; i++) {
-    if (record [i].packet_size > 0) {
-      total += record [i].packet_size;
-      if (matches (source, sbits, record [i].address, record [i].num_bits))
-        nmatches += record [i].packet_size;
+/* after the top source is removed, find the new top */
+static void find_top (time_t now)
+{
+  top = -1;
+  double max = 0.0;
+  int i;
+  for (i = 0; i < MAX_SOURCES; i++) {
+    if (record [i].in_use) {
+      double bytes = decay (record [i].bytes, record [i].last_update, now);
+      if ((top < 0) || (bytes > max)) {
+        top = i;
+        max = bytes;
+      }
     }
   }
+}
 
-  /* save this packet */
-  memcpy (record [next].address, source, ADDRESS_SIZE);
-  record [next].num_bits = sbits;
-  record [next].packet_size = packet_size;
-  next = (next + 1) % SAVED_ADDRESSES;
+/* returns the record for this source, creating it if necessary */
+static int find_record (const unsigned char * address, int nbits, time_t now)
+{
+  int b = source_hash (address, nbits);
+  int i;
+  for (i = buckets [b]; i >= 0; i = record [i].next)
+    if ((record [i].num_bits == nbits) &&
+        (memcmp (record [i].address, address, ADDRESS_SIZE) == 0))
+      return i;
+  i = oldest;   /* replace the source that sent least recently */
+  if (record [i].in_use)
+    remove_record (i);
+  memcpy (record [i].address, address, ADDRESS_SIZE);
+  record [i].num_bits = nbits;
+  record [i].in_use = 1;
+  record [i].bytes = 0.0;
+  record [i].last_update = now;
+  record [i].next = buckets [b];
+  buckets [b] = i;
+  if (i == top)
+    find_top (now);
+  return i;
+}
 
-  nmatches += packet_size;    /* add in this packet */
-  total += packet_size;    /* add in this packet */
+static int fraction (double bytes, time_t now)
+{
+  double total = decay (total_bytes, total_update, now);
+  if (total <= 0.0)
+    return DEFAULT_MAX;
+  double result = bytes / total * ALLNET_PRIORITY_MAX;
+  if (result >= ALLNET_PRIORITY_MAX)
+    return DEFAULT_MAX;
+  if (result < 1.0)
+    return 1;
+  return (int) result;
+}
 
-  if (total == 0) {
-    printf ("error in track_rate: illegal total size %d, returning one\n",
-            total);
+/* return the rate of the sender that is sending the most at this time */
+/* used by default when we cannot prove who the sender is */
+int largest_rate ()
+{
+  if ((! initialized) || (top < 0))
     return DEFAULT_MAX;
-  }
+  time_t now = time (NULL);
+  return fraction (decay (record [top].bytes, record [top].last_update, now),
+                   now);
+}
+
+/* record that this source is sending this packet of given size */
+/* return an integer, as a fraction of ALLNET_PRIORITY_MAX, to indicate what
+ * fraction of the available bandwidth this source is using.
+ * ALLNET_PRIORITY_MAX is defined in priority.h
+ */
+int track_rate (unsigned char * source, int sbits, int packet_size)
+{
+  if (! initialized)
+    init_track ();
+  if (sbits < 0)
+    sbits = 0;
+  if (sbits > ADDRESS_BITS)
+    sbits = ADDRESS_BITS;
+  unsigned char address [ADDRESS_SIZE];
+  memset (address, 0, sizeof (address));
+  memcpy (address, source, (sbits + 7) / 8);
+  if ((sbits % 8) != 0)   /* clear the bits past sbits */
+    address [sbits / 8] &= (0xff << (8 - (sbits % 8))) & 0xff;
+  time_t now = time (NULL);
+  total_bytes = decay (total_bytes, total_update, now) + packet_size;
+  total_update = now;
+
+  int i = find_record (address, sbits, now);
+  struct rate_record * r = record + i;
+  r->bytes = decay (r->bytes, r->last_update, now) + packet_size;
+  r->last_update = now;
+  make_newest (i);
+  if ((top < 0) ||
+      (r->bytes > decay (record [top].bytes, record [top].last_update, now)))
+    top = i;
 #ifdef DEBUG_PRINT
-  printf ("total %d, matching %d\n", total, nmatches);
+  printf ("total %g, matching %g\n", total_bytes, r->bytes);
 #endif /* DEBUG_PRINT */
-  return (ALLNET_PRIORITY_MAX / total) * nmatches;
+  return fraction (r->bytes, now);
 }
-
@@ -0,0 +1,227 @@
+/* verify.c: verify packet signatures for ad, in worker threads */
+/* checking an RSA signature takes much longer than anything else ad
+ * does with a packet, so ad gives signed packets to a pool of threads.
+ * Each source address hashes to one of SOURCE_BUCKETS buckets, and
+ * each bucket to one thread, so packets from the same source are
+ * verified, and their results delivered, in the order they arrived.
+ * The results go back to ad over a pipe, as messages that hold a
+ * pointer to the finished job. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "lib/packet.h"
+#include "lib/pipemsg.h"
+#include "lib/pktpool.h"
+#include "lib/priority.h"
+#include "lib/log.h"
+#include "lib/util.h"
+#include "social.h"
+#include "adstats.h"
+#include "verify.h"
+
+#define SOURCE_BUCKETS	256
+
+struct verify_job {
+  struct verify_result result;   /* must be first */
+  int bucket;
+  int check;                     /* whether there is a signature to check */
+};
+
+struct verify_worker {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  struct verify_job ** jobs;     /* circular queue of max_jobs entries */
+  int first;
+  int count;
+};
+
+static struct social_info * verify_soc = NULL;
+static struct verify_worker * workers = NULL;
+static int num_workers = 0;
+static int max_jobs = 0;
+static int result_write_fd = -1;
+
+/* number of packets submitted but not yet done, only used by ad's thread */
+static int in_progress [SOURCE_BUCKETS];
+
+int verify_packet (struct social_info * soc, char * packet, int psize,
+                   int * valid)
+{
+  struct allnet_header * hp = (struct allnet_header *) packet;
+  *valid = 0;
+  if ((psize < ALLNET_HEADER_SIZE) || (hp->sig_algo == ALLNET_SIGTYPE_NONE))
+    return UNKNOWN_SOCIAL_TIER;
+  int sig_size = ((packet [psize - 2] & 0xff) << 8) +
+                 (packet [psize - 1] & 0xff);
+  int hsize = ALLNET_SIZE (hp->transport);
+  if ((sig_size <= 0) || (hsize + sig_size + 2 >= psize))
+    return UNKNOWN_SOCIAL_TIER;
+  char * verify = packet + hsize;
+  int vsize = psize - (hsize + sig_size + 2);
+  char * sig = packet + hsize + vsize;
+  return social_connection (soc, verify, vsize, hp->source, hp->src_nbits,
+                            hp->sig_algo, sig, sig_size, valid);
+}
+
+static int source_bucket (struct allnet_header * hp)
+{
+  int nbits = hp->src_nbits;
+  if (nbits > ADDRESS_BITS)
+    nbits = ADDRESS_BITS;
+  unsigned int hash = nbits;
+  int i;
+  for (i = 0; i < (nbits + 7) / 8; i++) {
+    int byte = hp->source [i] & 0xff;
+    if ((i + 1) * 8 > nbits)   /* ignore the bits past nbits */
+      byte &= (0xff << ((i + 1) * 8 - nbits)) & 0xff;
+    hash = hash * 31 + byte;
+  }
+  return hash % SOURCE_BUCKETS;
+}
+
+static void * verify_thread (void * arg)
+{
+  struct verify_worker * w = (struct verify_worker *) arg;
+  while (1) {
+    pthread_mutex_lock (&(w->mutex));
+    while (w->count == 0)
+      pthread_cond_wait (&(w->cond), &(w->mutex));
+    struct verify_job * job = w->jobs [w->first];
+    w->first = (w->first + 1) % max_jobs;
+    w->count--;
+    pthread_mutex_unlock (&(w->mutex));
+    if (job->check)
+      job->result.social_distance =
+        verify_packet (verify_soc, job->result.packet, job->result.psize,
+                       &(job->result.valid));
+    /* send_pipe_message changes the SIGPIPE handler, which would race
+     * with ad's own sends, so write the message directly.  A single write
+     * this small is atomic, so the threads never interleave their results */
+    char frame [PIPE_MESSAGE_HEADER_SIZE + sizeof (job)];
+    pipe_message_header (frame, ALLNET_PRIORITY_LOCAL, sizeof (job));
+    memcpy (frame + PIPE_MESSAGE_HEADER_SIZE, &job, sizeof (job));
+    if (write (result_write_fd, frame, sizeof (frame)) != sizeof (frame)) {
+      log_print_str ("verify_thread unable to send result, exiting\n");
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+int verify_start (struct social_info * soc, int num_threads, int max_queued)
+{
+  if ((num_threads <= 0) || (max_queued <= 0))
+    return -1;
+  int pipefd [2];
+  if (pipe (pipefd) < 0) {
+    perror ("verify_start pipe");
+    return -1;
+  }
+  /* the threads write without changing the SIGPIPE handler, and ad's own
+   * sends then restore SIG_IGN, so nothing can raise SIGPIPE */
+  signal (SIGPIPE, SIG_IGN);
+  /* only ad reads the results, so it should never block */
+  fcntl (pipefd [0], F_SETFL, fcntl (pipefd [0], F_GETFL) | O_NONBLOCK);
+  result_write_fd = pipefd [1];
+  verify_soc = soc;
+  max_jobs = max_queued;
+  workers = malloc_or_fail (num_threads * sizeof (struct verify_worker),
+                            "verify_start");
+  int i;
+  for (i = 0; i < num_threads; i++) {
+    struct verify_worker * w = workers + i;
+    pthread_mutex_init (&(w->mutex), NULL);
+    pthread_cond_init (&(w->cond), NULL);
+    w->jobs = malloc_or_fail (max_queued * sizeof (struct verify_job *),
+                              "verify_start jobs");
+    w->first = 0;
+    w->count = 0;
+    if (pthread_create (&(w->thread), NULL, verify_thread, w) != 0) {
+      perror ("verify_start pthread_create");
+      free (w->jobs);
+      break;
+    }
+    pthread_detach (w->thread);
+  }
+  num_workers = i;
+  snprintf (log_buf, LOG_SIZE, "started %d signature verification threads\n",
+            num_workers);
+  log_print ();
+  if (num_workers == 0) {
+    close (pipefd [0]);
+    close (pipefd [1]);
+    result_write_fd = -1;
+    return -1;
+  }
+  return pipefd [0];
+}
+
+int verify_needed (char * packet, int psize)
+{
+  struct allnet_header * hp = (struct allnet_header *) packet;
+  if (hp->sig_algo != ALLNET_SIGTYPE_NONE)
+    return 1;
+  return (in_progress [source_bucket (hp)] > 0);
+}
+
+int verify_submit (char * packet, int psize, int priority)
+{
+  if (num_workers <= 0)
+    return 0;
+  struct allnet_header * hp = (struct allnet_header *) packet;
+  int bucket = source_bucket (hp);
+  struct verify_worker * w = workers + (bucket % num_workers);
+  pthread_mutex_lock (&(w->mutex));
+  int full = (w->count >= max_jobs);
+  pthread_mutex_unlock (&(w->mutex));
+  if (full)   /* only this thread adds, so it stays not full */
+    return 0;
+  struct verify_job * job = malloc (sizeof (struct verify_job));
+  char * copy = pkt_pool_alloc (psize);
+  if ((job == NULL) || (copy == NULL)) {
+    if (job != NULL)
+      free (job);
+    pkt_pool_release (copy);
+    return 0;
+  }
+  memcpy (copy, packet, psize);
+  job->result.packet = copy;
+  job->result.psize = psize;
+  job->result.priority = priority;
+  job->result.social_distance = UNKNOWN_SOCIAL_TIER;
+  job->result.valid = 0;
+  job->result.submitted = adstats_now ();
+  job->bucket = bucket;
+  job->check = (hp->sig_algo != ALLNET_SIGTYPE_NONE);
+  pthread_mutex_lock (&(w->mutex));
+  w->jobs [(w->first + w->count) % max_jobs] = job;
+  w->count++;
+  pthread_cond_signal (&(w->cond));
+  pthread_mutex_unlock (&(w->mutex));
+  in_progress [bucket]++;
+  return 1;
+}
+
+struct verify_result * verify_result (char * message, int msize)
+{
+  struct verify_job * job;
+  if (msize != sizeof (job))
+    return NULL;
+  memcpy (&job, message, sizeof (job));
+  return &(job->result);
+}
+
+void verify_done (struct verify_result * result)
+{
+  struct verify_job * job = (struct verify_job *) result;
+  in_progress [job->bucket]--;
+  pkt_pool_release (job->result.packet);
+  free (job);
+}
@@ -0,0 +1,45 @@
+/* verify.h: verify packet signatures for ad, in worker threads */
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "social.h"
+
+/* checks the signature (if any) at the end of the packet.  Sets valid,
+ * and returns the social distance, or UNKNOWN_SOCIAL_TIER */
+extern int verify_packet (struct social_info * soc, char * packet, int psize,
+                          int * valid);
+
+/* starts num_threads threads to call verify_packet, each with a queue
+ * of up to max_queued packets.  Returns a pipe on which the results are
+ * delivered as messages, which the caller should give to add_pipe, or
+ * -1 if the threads could not be started */
+extern int verify_start (struct social_info * soc, int num_threads,
+                         int max_queued);
+
+/* returns 1 if the packet has a signature, or if packets from the same
+ * source are still being verified, so this one must follow them */
+extern int verify_needed (char * packet, int psize);
+
+/* copies the packet, and queues it for verification.  Packets from the
+ * same source go to the same thread, so their results are delivered
+ * in the order they were submitted.  Returns 1 if the packet was
+ * queued, and 0 if the pool was not started or the queue is full */
+extern int verify_submit (char * packet, int psize, int priority);
+
+struct verify_result {
+  char * packet;            /* a copy, released by verify_done */
+  int psize;
+  int priority;             /* as given to verify_submit */
+  int social_distance;
+  int valid;
+  unsigned long long int submitted;  /* adstats_now () when submitted */
+};
+
+/* given a message received from the result pipe, returns the result,
+ * or NULL if the message is not a valid result.
+ * Every result must then be given to verify_done */
+extern struct verify_result * verify_result (char * message, int msize);
+extern void verify_done (struct verify_result * result);
+
+#endif /* VERIFY_H */
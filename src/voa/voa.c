@@ -736,7 +736,7 @@ static int voa_receive (int timeout)
     int size = receive_pipe_message_any (timeout, &message, &pipe, &priority);
     if (size > 0) {
       ret = handle_packet ((const char *)message, size, timeout != PIPE_MESSAGE_WAIT_FOREVER);
-      free (message);
+      release_pipe_message (message);
     }
 
     if (timeout != PIPE_MESSAGE_WAIT_FOREVER) {
@@ -45,12 +45,12 @@ static void wait_for_ack (char * contact, char * message_ack,
           (hp->message_type == ALLNET_TYPE_ACK) &&
           (memcmp (data, message_ack, MESSAGE_ID_SIZE) == 0)) {
         printf ("key exchange is complete with contact %s\n", contact);
-        free (ack);
+        release_pipe_message (ack);
         return;
       }
     }
     if (asize > 0)
-      free (ack);
+      release_pipe_message (ack);
     gettimeofday (&now, NULL);
   } while (delta_us (&now, start) < 3 * 1000 * 1000);
 }
@@ -163,7 +163,7 @@ static void wait_for_key (int sock, char * secret, char * contact,
             sending_hops = hp->max_hops;
           send_key_message (pipe, contact, keys, secret, sending_hops,
                             timeout + 1000000 - delta_us (&finish, &start));
-          free (packet);
+          release_pipe_message (packet);
           return;
         } else {
           printf ("received key with hmac other than expected\n");
@@ -179,7 +179,7 @@ static void wait_for_key (int sock, char * secret, char * contact,
 #endif /* DEBUG_PRINT */
     }
     if (found > 0)
-      free (packet);
+      release_pipe_message (packet);
   }
 }
 
@@ -144,7 +144,7 @@ static void wait_for_key (int sock, char * secret, char * contact,
     if (is_valid_message (message, found))
       done = handle_packet (sock, message, found, my_key, ksize, contact, keys,
                             secret, address, nbits, start, &finish);
-    free (message);
+    release_pipe_message (message);
     gettimeofday (&finish, NULL);
   }
 }
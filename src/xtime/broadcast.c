@@ -42,7 +42,7 @@ static void * receive_ignore (void * arg)
     int priority;
     int n = receive_pipe_message (*sockp, &message, &priority);
     if (n > 0)    /* ignore the message and recycle the storage */
-      free (message);
+      release_pipe_message (message);
     else          /* some error -- quit */
       return NULL;
   }